@@ -51,6 +51,7 @@ enum IN_ERROR
   ERR_FATAL_NO_OUTPUT_FILE,
   ERR_FATAL_NO_MODULES,
   ERR_FATAL_NO_START_FUNCTION,
+  ERR_FATAL_JIT_ERROR,
 
   // Validation errors that prevent compiling the module
   ERR_VALIDATION_ERROR = -0xFFF,
@@ -27,6 +27,14 @@
 
 #define IN_INIT_FUNCTION "_innative_internal_start"
 #define IN_EXIT_FUNCTION "_innative_internal_exit"
+#define IN_INSTANCE_VARIABLE "_innative_internal_instance"
+#define IN_INSTANCE_DEFAULT_VARIABLE "_innative_internal_instance_default"
+#define IN_INSTANCE_KEY_VARIABLE "_innative_internal_instance_key"
+#define IN_INSTANCE_SLOT_FUNCTION "_innative_internal_instance_slot"
+#define IN_INSTANCE_CREATE_FUNCTION "_innative_internal_instance_create"
+#define IN_INSTANCE_RESET_FUNCTION "_innative_internal_instance_reset"
+#define IN_INSTANCE_DESTROY_FUNCTION "_innative_internal_instance_destroy"
+#define IN_INSTANCE_ENTER_FUNCTION "_innative_internal_instance_enter"
 
 #ifdef __cplusplus
 extern "C" {
@@ -64,7 +72,8 @@ typedef struct IN__EXPORTS
   // 'err' won't be valid until FinalizeEnvironment() is called to resolve all pending module loads.
   /// \param env The environment to modify.
   /// \param data Either a pointer to the module in memory, or a UTF8 encoded null-terminated string pointing to a file that
-  /// contains the module.
+  /// contains the module. Files are mapped into memory instead of being read, and stay mapped until the environment is
+  /// destroyed.
   /// \param size The length of the memory that the data pointer points to, or zero if the data pointer is actually a UTF8
   /// encoded null terminated string.
   /// \param name A name to use for the module. If the module data does not contain a name, this will be used.
@@ -179,6 +188,56 @@ typedef struct IN__EXPORTS
   /// Destroys an environment and safely deconstructs all it's caches and memory allocations.
   /// \param env The environment to destroy.
   void (*DestroyEnvironment)(Environment* env);
+
+  /// Compiles all the modules in the environment directly into memory using an in-process JIT instead of producing a
+  /// binary file. The returned assembly behaves exactly like one returned by LoadAssembly, and must be freed with
+  /// FreeAssembly. Static library embeddings are loaded into the JIT, dynamic library embeddings are loaded into the
+  /// process, and any remaining symbols are resolved against the host process.
+  /// \param env The environment to compile.
+  /// \param assembly Receives a pointer to the compiled assembly.
+  enum IN_ERROR (*CompileJIT)(Environment* env, void** assembly);
+
+  /// Creates a new instance of every module in an assembly compiled with ENV_INSTANCES, running all their init and start
+  /// functions. The instance starts out with its own copy of every linear memory, table and global. The calling thread's
+  /// current instance is unchanged.
+  /// \param assembly A pointer to a webassembly binary loaded by LoadAssembly or CompileJIT.
+  /// \return The new instance, or null if it couldn't be allocated.
+  void* (*CreateInstance)(void* assembly);
+
+  /// Returns an instance to the state it had right after it was created, by freeing its linear memories and tables and
+  /// running all the init and start functions again.
+  /// \param assembly A pointer to a webassembly binary loaded by LoadAssembly or CompileJIT.
+  /// \param instance The instance to reset.
+  void (*ResetInstance)(void* assembly, void* instance);
+
+  /// Frees an instance and all its linear memories and tables. If it was the calling thread's current instance, the thread
+  /// is left without one.
+  /// \param assembly A pointer to a webassembly binary loaded by LoadAssembly or CompileJIT.
+  /// \param instance The instance to destroy.
+  void (*DestroyInstance)(void* assembly, void* instance);
+
+  /// Makes an instance current on the calling thread, so any exported function it calls afterwards operates on it.
+  /// \param assembly A pointer to a webassembly binary loaded by LoadAssembly or CompileJIT.
+  /// \param instance The instance to enter, or null to leave the current one.
+  /// \return The instance that was current before.
+  void* (*EnterInstance)(void* assembly, void* instance);
+
+  /// Gets how much memory an environment is currently using, broken down by what it is used for. The environment's
+  /// memlimit is compared against the arena and modules fields.
+  /// \param env The environment to inspect.
+  /// \param usage A pointer to a MemoryUsage struct that receives the result.
+  enum IN_ERROR (*GetMemoryUsage)(const Environment* env, MemoryUsage* usage);
+
+  /// Overrides the optimization level used for a single function, so hot functions can be optimized more aggressively
+  /// than the rest of the environment, and cold functions can be compiled faster. Only applies when entire modules are
+  /// optimized at once, which excludes ENV_LAZY_COMPILE and ENV_TIERED_COMPILE.
+  /// \param env The environment to modify.
+  /// \param module_name The name of the module that contains the function.
+  /// \param function_name Either the name of the function from the name section, or the name it is exported as.
+  /// \param optimize One of the ENV_OPTIMIZE_O* levels, or ENV_OPTIMIZE_BASELINE. All other optimization flags are
+  /// taken from the environment.
+  enum IN_ERROR (*AddOptimization)(Environment* env, const char* module_name, const char* function_name,
+                                   uint64_t optimize);
 } IRExports;
 
 /// Statically linked function that loads the runtime stub, which then loads the actual runtime functions into exports.
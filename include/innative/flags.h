@@ -30,7 +30,8 @@ enum WASM_ENVIRONMENT_FLAGS
   // Enables compiling .wat and .wast files
   ENV_ENABLE_WAT = (1 << 3),
 
-  // Attempts to compile the modules in parallel as much as possible (Experimental).
+  // Attempts to compile the modules in parallel as much as possible (Experimental). Modules with many functions also parse
+  // and validate their function bodies in parallel, limited by maxthreads.
   ENV_MULTITHREADED = (1 << 4),
 
   // Outputs a `.llvm` file in the target output directory for each module being compiled that outputs the optimized, final
@@ -81,6 +82,80 @@ enum WASM_ENVIRONMENT_FLAGS
   // that lock up a web browser. This option is provided purely for compatibility with the standard.
   ENV_DISABLE_TAIL_CALL = (1 << 15),
 
+  // Splits each module into several partitions after it has been compiled to LLVM IR and lowers each partition to machine
+  // code on its own thread, in its own LLVMContext, producing one object file per partition that are all handed to the
+  // linker. The number of partitions is limited by maxthreads (or the number of logical cores if maxthreads is 0), and
+  // small modules are never split. This makes machine code generation for very large modules scale with available cores.
+  ENV_PARALLEL_CODEGEN = (1 << 16),
+
+  // Emits object code into memory buffers instead of intermediate files, and hands both the objects and any in-memory
+  // embeddings to the linker through anonymous in-memory files, so only the final output touches the disk. This is only
+  // supported on Linux, other platforms silently fall back to writing intermediate files. Has no effect on modules stored
+  // in a cachepath, because those must be written to disk.
+  ENV_LINK_IN_MEMORY = (1 << 17),
+
+  // Only applies to CompileJIT. Instead of compiling every function before the assembly is returned, each function starts
+  // out as a stub that compiles that one function the first time it is called, then redirects itself to the compiled
+  // body. Optimizations are applied to each function as it is compiled. This makes startup almost instant for large
+  // modules, and only pays for code that actually runs.
+  ENV_LAZY_COMPILE = (1 << 18),
+
+  // Only applies to CompileJIT. Every function is first compiled without any IR optimizations, and counts how many times
+  // it is called or loops. Once a function becomes hot, an optimized copy of it is compiled on a background thread, using
+  // the optimization level set in the environment (or O3 if none is set), and all future calls are redirected to it. A
+  // call that is already running stays in the unoptimized version until it returns. This gives fast startup while still
+  // reaching peak performance in long-running instances.
+  ENV_TIERED_COMPILE = (1 << 19),
+
+  // Reserves 8 GiB of address space for each linear memory up front, which covers every possible address plus offset a
+  // webassembly load or store can produce, and commits pages as the memory grows. Anything past the current size is
+  // inaccessible, and a fault inside this region is turned into a trap, so ENV_CHECK_MEMORY_ACCESS no longer needs to
+  // insert explicit bounds checks. This is only supported on 64-bit linux, other platforms ignore this flag.
+  ENV_MEMORY_GUARD_PAGES = (1 << 20),
+
+  // Reserves enough address space for each linear memory to reach its declared maximum size (or 4 GiB if it has none) up
+  // front, and commits pages as the memory grows, so the memory never moves. This lets the compiler treat the memory
+  // pointer as loop-invariant instead of reloading it after every call that could grow memory, which allows loads and
+  // stores to be hoisted and vectorized. ENV_MEMORY_GUARD_PAGES implies this.
+  ENV_MEMORY_RESERVE = (1 << 21),
+
+  // Moves all linear memories, tables and globals out of process-wide variables and into an instance structure, which is
+  // found through a thread-local pointer. This lets a single compiled binary run any number of isolated instances at once,
+  // which are managed using CreateInstance, ResetInstance, DestroyInstance and EnterInstance. Exported functions always
+  // operate on the instance the calling thread last entered, or on the default instance if it never entered one. The
+  // init function creates and enters the default instance, and the exit function destroys it. Exported memories, tables
+  // and globals still refer to their initial values, not to any instance. Each instance allocates its own linear memory,
+  // so with ENV_MEMORY_GUARD_PAGES every instance reserves a little over 8 GiB of address space per memory, and with
+  // ENV_MEMORY_RESERVE it reserves the declared maximum. Only committed pages use physical memory, but a 47-bit address
+  // space then fits at most about 16000 instances with guarded memories.
+  ENV_INSTANCES = (1 << 22),
+
+  // Instead of decoding every function body while parsing, only remember where each body is in the binary module and
+  // decode its instructions whenever validation, compilation or serialization needs them. This skips the largest
+  // allocation made while loading a module, but malformed instructions are only reported once the body is validated.
+  // Modules passed to AddModule as a buffer must stay valid until the environment is destroyed. This has no effect on
+  // .wat files.
+  ENV_LAZY_DECODE = (1 << 23),
+
+  // Validates each function body of a binary module while it's being parsed, instead of walking every body again during
+  // validation, and lets the compiler skip type checks that validation already made. Combined with ENV_LAZY_DECODE, each
+  // body is validated right after it is found instead of being decoded a second time by validation. This has no effect
+  // on .wat files.
+  ENV_FUSED_VALIDATION = (1 << 24),
+
+  // Keeps parameters and locals in SSA form while compiling, building PHI nodes where blocks and loops merge, instead of
+  // giving each one a stack allocation that only the optimizer can promote to registers. This makes unoptimized code
+  // much faster and saves the optimizer a lot of work on functions with many locals. Ignored if ENV_DEBUG is set,
+  // because debuggers can only inspect locals that live on the stack.
+  ENV_SSA_LOCALS = (1 << 25),
+
+  // Hands each module to the linker as LLVM bitcode instead of object code, so calls between modules can be inlined and
+  // anything no module uses is stripped. If ENV_MULTITHREADED is also set, each module gets a ThinLTO summary so the
+  // linker can optimize and compile them in parallel, otherwise every module is merged for full LTO. Only the built-in
+  // LLD linker understands bitcode, so this is ignored if the environment has an external linker, and it has no effect
+  // on the JIT.
+  ENV_LTO = (1 << 26),
+
   // Strictly adheres to the standard, provided the optimization level does not exceed ENV_OPTIMIZE_STRICT.
   ENV_STRICT = ENV_CHECK_STACK_OVERFLOW | ENV_CHECK_FLOAT_TRUNC | ENV_CHECK_MEMORY_ACCESS | ENV_CHECK_INDIRECT_CALL |
                ENV_DISABLE_TAIL_CALL | ENV_CHECK_INT_DIVISION | ENV_WHITELIST,
@@ -102,14 +177,15 @@ enum WASM_OPTIMIZE_FLAGS
                            ENV_OPTIMIZE_FAST_MATH_NO_INF | ENV_OPTIMIZE_FAST_MATH_NO_SIGNED_ZERO |
                            ENV_OPTIMIZE_FAST_MATH_ALLOW_RECIPROCAL | ENV_OPTIMIZE_FAST_MATH_CONTRACT |
                            ENV_OPTIMIZE_FAST_MATH_ALLOW_APPROXIMATE_FUNCTIONS,
-  ENV_OPTIMIZE_O0     = 0,        // no optimization
-  ENV_OPTIMIZE_O1     = (1 << 8), // some optimization
-  ENV_OPTIMIZE_O2     = (2 << 8), // more optimization
-  ENV_OPTIMIZE_O3     = (3 << 8), // all the optimization
-  ENV_OPTIMIZE_Os     = (4 << 8), // minimize code size
-  ENV_OPTIMIZE_OMASK  = (7 << 8),
-  ENV_OPTIMIZE_STRICT = ENV_OPTIMIZE_O3, // Only performs optimizations that cannot invalidate the standard
-  ENV_OPTIMIZE_ALL    = ENV_OPTIMIZE_O3 |
+  ENV_OPTIMIZE_O0       = 0,        // no optimization
+  ENV_OPTIMIZE_O1       = (1 << 8), // some optimization
+  ENV_OPTIMIZE_O2       = (2 << 8), // more optimization
+  ENV_OPTIMIZE_O3       = (3 << 8), // all the optimization
+  ENV_OPTIMIZE_Os       = (4 << 8), // minimize code size
+  ENV_OPTIMIZE_BASELINE = (5 << 8), // compile as fast as possible: only mem2reg and simplifycfg, then FastISel codegen
+  ENV_OPTIMIZE_OMASK    = (7 << 8),
+  ENV_OPTIMIZE_STRICT   = ENV_OPTIMIZE_O3, // Only performs optimizations that cannot invalidate the standard
+  ENV_OPTIMIZE_ALL      = ENV_OPTIMIZE_O3 |
                      ENV_OPTIMIZE_FAST_MATH, // Performs all optimizations, but will never compromise the sandbox.
 };
 
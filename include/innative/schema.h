@@ -259,11 +259,13 @@ typedef struct IN_WASM_FUNCTION_BODY
   varuint32 body_size;
   varuint32 n_locals;
   varsint7* locals;
-  Instruction* body;
-  varuint32 n_body;       // INTERNAL: track actual number of instructions
+  uint8_t* body;          // INTERNAL: compact instruction stream, decoded with BodyReader
+  varuint32 n_body;       // INTERNAL: number of instructions, or 0 if body still points into the module source
   DebugInfo* local_names; // INTERNAL: debug names of locals, always the size of n_locals or NULL if it doesn't exist
   DebugInfo* param_names; // INTERNAL: debug names of parameters, always the size of n_params or NULL if it doesn't exist
   DebugInfo debug;
+  varuint32 n_bytes;   // INTERNAL: size of the instruction stream in bytes
+  unsigned int* lines; // INTERNAL: line and column of each instruction, or NULL if ENV_DEBUG wasn't set
 } FunctionBody;
 
 // Encodes initialization data for a data section
@@ -290,13 +292,8 @@ namespace innative {
   }
 }
 typedef innative::code::Context IN_CODE_CONTEXT;
-namespace llvm {
-  class LLVMContext;
-}
-typedef llvm::LLVMContext LLVM_LLVM_CONTEXT;
 #else
 typedef void IN_CODE_CONTEXT;
-typedef void LLVM_LLVM_CONTEXT;
 #endif
 
 // Represents a single webassembly module
@@ -369,6 +366,7 @@ typedef struct IN_WASM_MODULE
   {
     varuint32 n_funcbody;
     FunctionBody* funcbody;
+    bool validated; // INTERNAL: every body was already validated while it was being parsed
   } code;
 
   struct DataSection
@@ -383,6 +381,9 @@ typedef struct IN_WASM_MODULE
   struct kh_exports_s* exports;
   const char* path;       // For debugging purposes, store path to source .wat file, if it exists.
   IN_CODE_CONTEXT* cache; // If non-zero, points to a cached compilation of this module
+  uint8_t hash[16];       // Hash of the module source, only computed when the environment has a cachepath
+  const uint8_t* source;  // INTERNAL: source of a module that won't be parsed unless its objects aren't cached
+  uint64_t n_source;
 } Module;
 
 // Represents a single validation error node in a singly-linked list.
@@ -415,9 +416,21 @@ enum WASM_LOG_LEVEL
 };
 
 KHASH_DECLARE(modulepair, kh_cstr_t, FunctionType);
+KHASH_DECLARE(optimizehint, kh_cstr_t, uint64_t);
 
 struct IN_WASM_ALLOCATOR;
 
+// Breakdown of how much memory an environment is using, in bytes. Filled in by GetMemoryUsage().
+typedef struct IN_WASM_MEMORY_USAGE
+{
+  uint64_t arena;   // Memory held by the environment's allocator, which stores almost everything parsed from a module
+  uint64_t mapped;  // Module and library files mapped into memory, which are backed by the files themselves
+  uint64_t modules; // The environment's module array
+  uint64_t hashes;  // Hash tables owned by the environment and its modules
+  uint64_t llvm;    // Estimated size of the LLVM modules cached from the last compilation
+  uint64_t total;   // Sum of everything except mapped files
+} MemoryUsage;
+
 // Represents a collection of webassembly modules and configuration options that will be compiled into a single binary
 typedef struct IN_WASM_ENVIRONMENT
 {
@@ -445,7 +458,14 @@ typedef struct IN_WASM_ENVIRONMENT
   struct kh_modules_s* modulemap;
   struct kh_modulepair_s* whitelist;
   struct kh_cimport_s* cimports;
-  LLVM_LLVM_CONTEXT* context;
+  const char* cachepath; // If not NULL, object files are kept in this directory, keyed by a hash of all modules and
+                         // compilation settings, and are reused by any later compilation with identical inputs.
+                         // Binary modules aren't parsed until Validate or Compile, which skips them if it reuses the
+                         // objects, so parse errors are reported there instead of by AddModule.
+  struct IN_WASM_THREADPOOL* pool; // Stores a pointer to the internal thread pool, sized by maxthreads
+  uint64_t memlimit; // If nonzero, allocations that would make the allocator and module array use more than this many
+                     // bytes fail with ERR_FATAL_OUT_OF_MEMORY instead of allocating more memory.
+  struct kh_optimizehint_s* optimizehints; // Per-function optimization levels, use AddOptimization() to manage this list
 } Environment;
 
 #ifdef __cplusplus
@@ -55,17 +55,27 @@ static const std::unordered_map<std::string, unsigned int> flag_map = {
   { "check_indirect_call", ENV_CHECK_INDIRECT_CALL },
   { "check_int_division", ENV_CHECK_INT_DIVISION },
   { "disable_tail_call", ENV_DISABLE_TAIL_CALL },
+  { "parallel_codegen", ENV_PARALLEL_CODEGEN },
+  { "link_in_memory", ENV_LINK_IN_MEMORY },
+  { "memory_guard_pages", ENV_MEMORY_GUARD_PAGES },
+  { "memory_reserve", ENV_MEMORY_RESERVE },
+  { "instances", ENV_INSTANCES },
+  { "lazy_decode", ENV_LAZY_DECODE },
+  { "fused_validation", ENV_FUSED_VALIDATION },
+  { "ssa_locals", ENV_SSA_LOCALS },
+  { "lto", ENV_LTO },
 };
 
 static const std::unordered_map<std::string, unsigned int> optimize_map = {
   { "o0", ENV_OPTIMIZE_O0 }, { "o1", ENV_OPTIMIZE_O1 }, { "o2", ENV_OPTIMIZE_O2 },
   { "o3", ENV_OPTIMIZE_O3 }, { "os", ENV_OPTIMIZE_Os }, { "fastmath", ENV_OPTIMIZE_FAST_MATH },
+  { "baseline", ENV_OPTIMIZE_BASELINE },
 };
 
 void usage()
 {
   std::cout
-    << "Usage: innative-cmd [-r] [-c] [-i [lite]] [-u] [-v] [-f FLAG...] [-l FILE] [-L FILE] [-o FILE] [-a FILE] [-d PATH] [-j PATH] [-s [FILE]] [-w [MODULE:]FUNCTION] FILE...\n"
+    << "Usage: innative-cmd [-r] [-c] [-i [lite]] [-u] [-v] [-f FLAG...] [-l FILE] [-L FILE] [-o FILE] [-a FILE] [-d PATH] [-j PATH] [-k PATH] [-m MEGABYTES] [-s [FILE]] [-w [MODULE:]FUNCTION] FILE...\n"
        "  -r : Run the compiled result immediately and display output. Requires a start function.\n"
        "  -f <FLAG>: Set a supported flag to true. Flags:\n         ";
 
@@ -83,6 +93,8 @@ void usage()
        "  -a <FILE> : Specifies an alternative linker to use instead of LLD.\n"
        "  -d <PATH> : Sets the directory that contains the SDK library and data files.\n"
        "  -j <PATH> : Sets the directory for temporary object files and intermediate compilation results.\n"
+       "  -k <PATH> : Sets a persistent cache directory. Object files are reused from it if the modules and flags are unchanged.\n"
+       "  -m <MEGABYTES> : Fails with an out of memory error instead of using more than this much memory to load the modules.\n"
        "  -e <MODULE> : Sets the environment/system module name. Any functions with the module name will have the module name stripped when linking with C functions.\n"
        "  -s [<FILE>] : Serializes all modules to .wat files. <FILE> can specify the output if only one module is present.\n"
        "  -w <[MODULE:]FUNCTION> : whitelists a given C import, does name-mangling if the module is specified.\n"
@@ -142,6 +154,8 @@ int main(int argc, char* argv[])
                                  // injected into the environment
   const char* libpath   = nullptr;
   const char* objpath   = nullptr;
+  const char* cachepath = nullptr;
+  uint64_t memlimit     = 0;
   const char* linker    = nullptr;
   const char* serialize = nullptr;
   const char* system    = nullptr;
@@ -248,6 +262,14 @@ int main(int argc, char* argv[])
           if(checkarg(++i, argc, argv, err))
             objpath = argv[i];
           break;
+        case 'k': // Specify object cache directory
+          if(checkarg(++i, argc, argv, err))
+            cachepath = argv[i];
+          break;
+        case 'm': // Specify memory limit
+          if(checkarg(++i, argc, argv, err))
+            memlimit = strtoull(argv[i], nullptr, 10) << 20;
+          break;
         case 'i': // install
           std::cout << "Installing inNative Runtime..." << std::endl;
           {
@@ -447,6 +469,10 @@ int main(int argc, char* argv[])
     env->libpath = libpath;
   if(objpath)
     env->objpath = objpath;
+  if(cachepath)
+    env->cachepath = cachepath;
+  if(memlimit)
+    env->memlimit = memlimit;
   if(linker)
     env->linker = linker;
   if(system)
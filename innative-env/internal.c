@@ -16,12 +16,14 @@
 HANDLE heap     = 0;
 DWORD heapcount = 0;
 #elif defined(IN_PLATFORM_POSIX)
-const int SYSCALL_WRITE  = 1;
-const int SYSCALL_MMAP   = 9;
-const int SYSCALL_MUNMAP = 11;
-const int SYSCALL_MREMAP = 25;
-const int SYSCALL_EXIT   = 60;
-const int MREMAP_MAYMOVE = 1;
+const int SYSCALL_WRITE        = 1;
+const int SYSCALL_MMAP         = 9;
+const int SYSCALL_MPROTECT     = 10;
+const int SYSCALL_MUNMAP       = 11;
+const int SYSCALL_RT_SIGACTION = 13;
+const int SYSCALL_MREMAP       = 25;
+const int SYSCALL_EXIT         = 60;
+const int MREMAP_MAYMOVE       = 1;
 
 #ifdef IN_CPU_x86_64
 IN_COMPILER_DLLEXPORT extern IN_COMPILER_NAKED void* _innative_syscall(size_t syscall_number, const void* p1, size_t p2,
@@ -202,6 +204,217 @@ IN_COMPILER_DLLEXPORT extern void _innative_internal_env_free_memory(void* p)
   }
 }
 
+// Reserved memories are preceded by a header that stores whether the memory has a guard region, the reservation size and
+// the committed size, which is kept large enough that the memory itself always starts on a page boundary.
+#define IN_RESERVED_HEADER 0x10000
+
+#if defined(IN_PLATFORM_LINUX) && defined(IN_CPU_x86_64)
+#define IN_GUARD_PAGES
+#define IN_GUARD_REGIONS_PER_PAGE 255 // Fills exactly one 4 KiB page along with the next pointer
+
+struct _innative_kernel_sigaction
+{
+  void* handler;
+  unsigned long flags;
+  void* restorer;
+  uint64_t mask;
+};
+
+// Guard regions are kept in a linked list of fixed-size pages. Pages are only ever appended and never freed, so the
+// signal handler can walk the list at any time without taking a lock, and there's no limit on how many regions exist.
+struct _innative_guard_page
+{
+  struct _innative_guard_page* volatile next;
+  char* volatile regions[IN_GUARD_REGIONS_PER_PAGE];
+  uint64_t sizes[IN_GUARD_REGIONS_PER_PAGE];
+};
+
+static struct _innative_guard_page guard_first;
+static volatile int guard_installed = 0;
+static struct _innative_kernel_sigaction guard_previous;
+
+IN_COMPILER_NAKED void _innative_internal_sigreturn() { __asm volatile("movq $15, %rax\n\tsyscall"); }
+
+// Executing this raises the same illegal instruction signal that every other webassembly trap does
+IN_COMPILER_NAKED void _innative_internal_guard_trap() { __asm volatile("ud2"); }
+
+static void _innative_internal_guard_handler(int sig, void* info, void* context)
+{
+  char* addr = *(char**)((char*)info + 16); // siginfo_t::si_addr
+
+  for(struct _innative_guard_page* page = &guard_first; page != 0; page = page->next)
+  {
+    for(int i = 0; i < IN_GUARD_REGIONS_PER_PAGE; ++i)
+    {
+      char* region = page->regions[i]; // A value of 1 marks a slot that is still being claimed
+      if(region > (char*)1 && addr >= region && addr < region + page->sizes[i])
+      {
+        // Resume execution at a trap instruction instead of the faulting access (ucontext_t::uc_mcontext.gregs[REG_RIP])
+        *(uint64_t*)((char*)context + 168) = (uint64_t)&_innative_internal_guard_trap;
+        return;
+      }
+    }
+  }
+
+  // This fault has nothing to do with us, so we pass it on to whatever handler was installed before ours, which stays
+  // installed for the next fault. If there was no handler, we restore the default action and let the access fault
+  // again, which terminates the process exactly like it would have without us.
+  if(guard_previous.handler == (void*)0 || guard_previous.handler == (void*)1) // SIG_DFL or SIG_IGN
+  {
+    struct _innative_kernel_sigaction action = { 0, 0, 0, 0 };
+    _innative_syscall(SYSCALL_RT_SIGACTION, (void*)11, (size_t)&action, 0, sizeof(uint64_t), 0, 0);
+  }
+  else if(guard_previous.flags & 0x04) // SA_SIGINFO
+    ((void (*)(int, void*, void*))guard_previous.handler)(sig, info, context);
+  else
+    ((void (*)(int))guard_previous.handler)(sig);
+}
+
+// Returns 0 if a new page of slots couldn't be allocated, in which case the region can't be protected
+static int _innative_internal_add_guard_region(char* region, uint64_t size)
+{
+  if(__sync_bool_compare_and_swap(&guard_installed, 0, 1))
+  {
+    struct _innative_kernel_sigaction action = { (void*)&_innative_internal_guard_handler, 0x04000004, // SA_SIGINFO |
+                                                 (void*)&_innative_internal_sigreturn, 0 };          // SA_RESTORER
+    _innative_syscall(SYSCALL_RT_SIGACTION, (void*)11, (size_t)&action, (size_t)&guard_previous, sizeof(uint64_t), 0, 0);
+  }
+
+  struct _innative_guard_page* page = &guard_first;
+  struct _innative_guard_page* spare = 0;
+  for(;;)
+  {
+    for(int i = 0; i < IN_GUARD_REGIONS_PER_PAGE; ++i)
+    {
+      if(__sync_bool_compare_and_swap(&page->regions[i], 0, (char*)1))
+      {
+        page->sizes[i]   = size;
+        page->regions[i] = region;
+        if(spare != 0)
+          _innative_syscall(SYSCALL_MUNMAP, spare, sizeof(struct _innative_guard_page), 0, 0, 0, 0);
+        return 1;
+      }
+    }
+
+    if(page->next != 0)
+    {
+      page = page->next;
+      continue;
+    }
+
+    // Every slot is taken, so append a new page. If another thread appends one first, we keep ours for the next attempt.
+    if(!spare)
+    {
+      spare = _innative_syscall(SYSCALL_MMAP, NULL, sizeof(struct _innative_guard_page), PROT_READ | PROT_WRITE,
+                                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      if((void*)spare >= (void*)0xfffffffffffff001) // This is a syscall error from -4095 to -1
+        return 0;
+    }
+    if(__sync_bool_compare_and_swap(&page->next, 0, spare))
+      spare = 0;
+    page = page->next;
+  }
+}
+
+static void _innative_internal_remove_guard_region(char* region)
+{
+  for(struct _innative_guard_page* page = &guard_first; page != 0; page = page->next)
+    for(int i = 0; i < IN_GUARD_REGIONS_PER_PAGE; ++i)
+      if(page->regions[i] == region)
+      {
+        page->sizes[i]   = 0;
+        page->regions[i] = 0;
+        return;
+      }
+}
+#endif
+
+// Implementation of the mem.grow instruction for memories that never move. The first call reserves enough address space
+// for the memory to grow to `reserve` bytes, and each call after that commits more of it in place. Any access past the
+// committed size faults. If `guard` is set, the compiler removed the bounds checks for this memory, so on platforms that
+// support it the memory is registered as a guard region, which turns that fault into a trap.
+IN_COMPILER_DLLEXPORT extern void* _innative_internal_env_grow_memory_reserved(void* p, uint64_t i, uint64_t max,
+                                                                                 uint64_t reserve, uint32_t guard)
+{
+  uint64_t* info = (uint64_t*)p;
+  uint64_t old   = 0;
+  char* region   = 0;
+
+  if(info != 0)
+  {
+    old = info[-1];
+    i += old;
+    reserve = info[-2];
+  }
+
+  if((max > 0 && i > max) || i > reserve)
+    return 0;
+
+  if(!info)
+  {
+#ifdef IN_PLATFORM_WIN32
+    region = VirtualAlloc(0, (SIZE_T)reserve + IN_RESERVED_HEADER, MEM_RESERVE, PAGE_NOACCESS);
+    if(!region || !VirtualAlloc(region, IN_RESERVED_HEADER, MEM_COMMIT, PAGE_READWRITE))
+      return 0;
+#elif defined(IN_PLATFORM_POSIX)
+    region = _innative_syscall(SYSCALL_MMAP, NULL, reserve + IN_RESERVED_HEADER, PROT_NONE,
+                               MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if((void*)region >= (void*)0xfffffffffffff001) // This is a syscall error from -4095 to -1
+      return 0;
+    if(_innative_syscall(SYSCALL_MPROTECT, region, IN_RESERVED_HEADER, PROT_READ | PROT_WRITE, 0, 0, 0) != 0)
+    {
+      _innative_syscall(SYSCALL_MUNMAP, region, reserve + IN_RESERVED_HEADER, 0, 0, 0, 0);
+      return 0;
+    }
+#else
+#error unknown platform!
+#endif
+    info     = (uint64_t*)(region + IN_RESERVED_HEADER);
+    info[-3] = guard;
+    info[-2] = reserve;
+#ifdef IN_GUARD_PAGES
+    // The compiler already removed the bounds checks for this memory, so it must never run without a guard region
+    if(guard && !_innative_internal_add_guard_region((char*)info, reserve))
+    {
+      _innative_syscall(SYSCALL_MUNMAP, region, reserve + IN_RESERVED_HEADER, 0, 0, 0, 0);
+      return 0;
+    }
+#endif
+  }
+
+  if(i > old)
+  {
+#ifdef IN_PLATFORM_WIN32
+    if(!VirtualAlloc((char*)info + old, (SIZE_T)(i - old), MEM_COMMIT, PAGE_READWRITE))
+      return 0;
+#elif defined(IN_PLATFORM_POSIX)
+    if(_innative_syscall(SYSCALL_MPROTECT, (char*)info + old, i - old, PROT_READ | PROT_WRITE, 0, 0, 0) != 0)
+      return 0;
+#endif
+  }
+
+  info[-1] = i;
+  return info;
+}
+
+IN_COMPILER_DLLEXPORT extern void _innative_internal_env_free_memory_reserved(void* p)
+{
+  if(p)
+  {
+    char* region = (char*)p - IN_RESERVED_HEADER;
+
+#ifdef IN_GUARD_PAGES
+    if(((uint64_t*)p)[-3])
+      _innative_internal_remove_guard_region((char*)p);
+#endif
+#ifdef IN_PLATFORM_WIN32
+    VirtualFree(region, 0, MEM_RELEASE);
+#elif defined(IN_PLATFORM_POSIX)
+    _innative_syscall(SYSCALL_MUNMAP, region, ((uint64_t*)p)[-2] + IN_RESERVED_HEADER, 0, 0, 0, 0);
+#endif
+  }
+}
+
 // You cannot return from the entry point of a program, you must instead call a platform-specific syscall to terminate it.
 IN_COMPILER_DLLEXPORT extern void _innative_internal_env_exit(int status)
 {
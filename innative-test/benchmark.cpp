@@ -2,7 +2,10 @@
 // For conditions of distribution and use, see copyright notice in innative.h
 
 #include "benchmark.h"
+#include "../innative/stream.h"
 #include <chrono>
+#include <thread>
+#include <algorithm>
 
 Benchmarks::Benchmarks(const IRExports& exports, const char* arg0, int loglevel, const path& folder) :
   _exports(exports),
@@ -29,6 +32,249 @@ void Benchmarks::Run(FILE* out)
   DoBenchmark<int, int>(out, "../scripts/benchmark_n-body.wasm", "nbody", COLUMNS, &Benchmarks::nbody, 11);
   DoBenchmark<int, int>(out, "../scripts/benchmark_fannkuch-redux.wasm", "fannkuch_redux", COLUMNS,
                         &Benchmarks::fannkuch_redux, 11);
+  RunCompileTimes(out);
+  RunBoundsChecks(out);
+  RunLEB128(out);
+  RunParse(out);
+  RunParallelParse(out);
+}
+
+// Compares how long each benchmark takes to compile with O0, baseline and O3. The second row is how many times faster
+// than O0 each one is, which is what ENV_OPTIMIZE_BASELINE has to justify itself with. No numbers from this table have
+// been recorded yet, because they can only be measured on a machine with an LLVM 9 build.
+void Benchmarks::RunCompileTimes(FILE* out)
+{
+  static constexpr int COLUMNS[4] = { 24, 11, 11, 11 };
+  static constexpr const char* FILES[3][2] = { { "../scripts/benchmark-fac.wat", "fac" },
+                                               { "../scripts/benchmark_n-body.wasm", "nbody" },
+                                               { "../scripts/benchmark_fannkuch-redux.wasm", "fannkuch_redux" } };
+
+  fprintf(out, "\n%-*s %-*s %-*s %-*s\n", COLUMNS[0], "Compile Time", COLUMNS[1], "O0", COLUMNS[2], "Baseline",
+          COLUMNS[3], "O3");
+  fprintf(out, "%-*s %-*s %-*s %-*s\n", COLUMNS[0], "------------", COLUMNS[1], "--", COLUMNS[2], "--------", COLUMNS[3],
+          "--");
+
+  for(auto& file : FILES)
+  {
+    int64_t timing[3] = { MeasureCompile(file[0], ENV_OPTIMIZE_O0), MeasureCompile(file[0], ENV_OPTIMIZE_BASELINE),
+                          MeasureCompile(file[0], ENV_OPTIMIZE_O3) };
+    fprintf(out, "%-*s %-*lli %-*lli %-*lli\n", COLUMNS[0], file[1], COLUMNS[1], timing[0], COLUMNS[2], timing[1],
+            COLUMNS[3], timing[2]);
+    fprintf(out, "%-*s %-*.2f %-*.2f %-*.2f\n", COLUMNS[0], "", COLUMNS[1], 1.0, COLUMNS[2],
+            double(timing[0]) / timing[1], COLUMNS[3], double(timing[0]) / timing[2]);
+  }
+}
+
+// Compares a loop over linear memory with and without ENV_CHECK_MEMORY_ACCESS, which shows how much of the cost of the
+// bounds checks is left after they have been merged and hoisted out of the loop
+void Benchmarks::RunBoundsChecks(FILE* out)
+{
+  static constexpr int COLUMNS[3] = { 24, 11, 11 };
+  static constexpr const char* WASM = "../scripts/benchmark-memory.wat";
+
+  int64_t timing[2] = { MeasureWASM<int, int>(WASM, "memloop", 0, ENV_OPTIMIZE_O3, 256),
+                        MeasureWASM<int, int>(WASM, "memloop", ENV_CHECK_MEMORY_ACCESS, ENV_OPTIMIZE_O3, 256) };
+
+  fprintf(out, "\n%-*s %-*s %-*s\n", COLUMNS[0], "Bounds Checks", COLUMNS[1], "Unchecked", COLUMNS[2], "Checked");
+  fprintf(out, "%-*s %-*s %-*s\n", COLUMNS[0], "-------------", COLUMNS[1], "---------", COLUMNS[2], "-------");
+  fprintf(out, "%-*s %-*lli %-*lli\n", COLUMNS[0], "memloop", COLUMNS[1], timing[0], COLUMNS[2], timing[1]);
+  fprintf(out, "%-*s %-*.2f %-*.2f\n", COLUMNS[0], "", COLUMNS[1], 1.0, COLUMNS[2], double(timing[0]) / timing[1]);
+}
+
+void Benchmarks::RunLEB128(FILE* out)
+{
+  static constexpr int COLUMNS[4] = { 24, 11, 11, 11 };
+  static constexpr size_t COUNT   = 1 << 22;
+
+  // Most LEB128 values in a module are small indices and counts, so we use a similar distribution
+  std::vector<uint8_t> buf;
+  buf.reserve(COUNT * 2);
+  uint32_t seed = 1;
+  for(size_t i = 0; i < COUNT; ++i)
+  {
+    seed       = seed * 1103515245 + 12345;
+    uint32_t v = seed >> 8;
+    switch(seed % 10)
+    {
+    default: v &= 0x7F; break;
+    case 7:
+    case 8: v &= 0x3FFF; break;
+    case 9: break;
+    }
+    do
+    {
+      buf.push_back((v & 0x7F) | (v > 0x7F ? 0x80 : 0));
+      v >>= 7;
+    } while(v != 0);
+  }
+
+  std::vector<varuint32> values(COUNT);
+  innative::utility::Stream s = { buf.data(), buf.size(), 0 };
+  IN_ERROR err                = ERR_SUCCESS;
+  int64_t timing[3];
+
+  auto t = start();
+  for(size_t i = 0; i < COUNT; ++i)
+    values[i] = static_cast<varuint32>(s.DecodeLEB128(err, 32, false));
+  timing[0] = end(t);
+
+  s.pos = 0;
+  t     = start();
+  for(size_t i = 0; i < COUNT; ++i)
+    values[i] = s.ReadVarUInt32(err);
+  timing[1] = end(t);
+
+  s.pos = 0;
+  t     = start();
+  s.ReadVarUInt32Array(values.data(), COUNT, err);
+  timing[2] = end(t);
+
+  fprintf(out, "\n%-*s %-*s %-*s %-*s\n", COLUMNS[0], "LEB128", COLUMNS[1], "Generic", COLUMNS[2], "Inline", COLUMNS[3],
+          "Bulk");
+  fprintf(out, "%-*s %-*s %-*s %-*s\n", COLUMNS[0], "------", COLUMNS[1], "-------", COLUMNS[2], "------", COLUMNS[3],
+          "----");
+  fprintf(out, "%-*s %-*lli %-*lli %-*lli\n", COLUMNS[0], "varuint32", COLUMNS[1], timing[0], COLUMNS[2], timing[1],
+          COLUMNS[3], timing[2]);
+  fprintf(out, "%-*s %-*.2f %-*.2f %-*.2f\n", COLUMNS[0], "", COLUMNS[1], 1.0, COLUMNS[2],
+          double(timing[0]) / timing[1], COLUMNS[3], double(timing[0]) / timing[2]);
+}
+
+// Measures how long it takes to parse a large binary module from start to finish, which is what decoding LEB128 values
+// actually has to speed up, since parsing does much more than decoding integers.
+void Benchmarks::RunParse(FILE* out)
+{
+  static constexpr int COLUMNS[3] = { 24, 11, 11 };
+  static constexpr varuint32 FUNCTIONS    = 20000;
+  static constexpr varuint32 INSTRUCTIONS = 100; // Groups of instructions in each function body
+
+  auto leb = [](std::vector<uint8_t>& v, uint64_t x) {
+    do
+    {
+      v.push_back((x & 0x7F) | (x > 0x7F ? 0x80 : 0));
+      x >>= 7;
+    } while(x != 0);
+  };
+  auto section = [&](std::vector<uint8_t>& v, uint8_t id, const std::vector<uint8_t>& contents) {
+    v.push_back(id);
+    leb(v, contents.size());
+    v.insert(v.end(), contents.begin(), contents.end());
+  };
+
+  // Every function takes and returns an i32, and calls the function before it, so indices get large enough to need
+  // multiple bytes, just like they would in a real module.
+  std::vector<uint8_t> types = { 0x01, 0x60, 0x01, 0x7f, 0x01, 0x7f };
+  std::vector<uint8_t> funcs;
+  std::vector<uint8_t> code;
+  leb(funcs, FUNCTIONS);
+  leb(code, FUNCTIONS);
+  uint32_t seed = 1;
+  for(varuint32 i = 0; i < FUNCTIONS; ++i)
+  {
+    funcs.push_back(0x00);
+
+    std::vector<uint8_t> body = { 0x01, 0x01, 0x7f }; // One i32 local
+    for(varuint32 j = 0; j < INSTRUCTIONS; ++j)
+    {
+      seed = seed * 1103515245 + 12345;
+      body.insert(body.end(), { 0x20, 0x00, 0x41 }); // local.get 0, i32.const
+      leb(body, (seed >> 8) & (seed % 3 ? 0x7F : 0x3FFF));
+      body.insert(body.end(), { 0x6a, 0x21, 0x01 }); // i32.add, local.set 1
+      if(i > 0)
+      {
+        body.insert(body.end(), { 0x20, 0x01, 0x10 }); // local.get 1, call
+        leb(body, i - 1);
+        body.insert(body.end(), { 0x21, 0x00 }); // local.set 0
+      }
+    }
+    body.insert(body.end(), { 0x20, 0x00, 0x0b }); // local.get 0, end
+    leb(code, body.size());
+    code.insert(code.end(), body.begin(), body.end());
+  }
+
+  std::vector<uint8_t> module = { 0x00, 0x61, 0x73, 0x6d, 0x01, 0x00, 0x00, 0x00 };
+  section(module, 1, types);
+  section(module, 3, funcs);
+  section(module, 10, code);
+
+  int64_t timing[2];
+  for(int i = 0; i < 2; ++i) // The first run also pays for allocating memory and bringing the module into the cache
+  {
+    Environment* env = (*_exports.CreateEnvironment)(1, 0, _arg0);
+    env->flags       = 0;
+    env->log         = stdout;
+    env->loglevel    = _loglevel;
+
+    int err;
+    auto t = start();
+    (*_exports.AddModule)(env, module.data(), module.size(), "generated", &err);
+    (*_exports.FinalizeEnvironment)(env);
+    timing[0] = end(t);
+    assert(err == ERR_SUCCESS);
+
+    t = start();
+    (*_exports.Validate)(env);
+    timing[1] = end(t);
+    assert(!env->errors);
+
+    (*_exports.DestroyEnvironment)(env);
+  }
+
+  fprintf(out, "\n%-*s %-*s %-*s\n", COLUMNS[0], "Parse", COLUMNS[1], "Parse", COLUMNS[2], "Validate");
+  fprintf(out, "%-*s %-*s %-*s\n", COLUMNS[0], "-----", COLUMNS[1], "-----", COLUMNS[2], "--------");
+  fprintf(out, "%-*s %-*lli %-*lli\n", COLUMNS[0], (std::to_string(module.size() >> 10) + " KB").c_str(), COLUMNS[1],
+          timing[0], COLUMNS[2], timing[1]);
+  fprintf(out, "%-*s %-*.2f %-*.2f\n", COLUMNS[0], "MB/s", COLUMNS[1], double(module.size()) / timing[0], COLUMNS[2],
+          double(module.size()) / timing[1]);
+}
+
+// Loads thousands of small modules at once, which is dominated by how much the loading threads contend over the
+// environment's allocator and module array, so it compares a single thread against every core on this machine.
+void Benchmarks::RunParallelParse(FILE* out)
+{
+  static constexpr int COLUMNS[3] = { 24, 11, 11 };
+  static constexpr int NUM        = 2000;
+  static constexpr char MODULE_TEMPLATE[] = "(module $parallel%i "
+                                            "\n  (global $global_i32 (export \"global_i32_%i\") i32 i32.const 666)"
+                                            "\n  (memory $memory (export \"memory_%i\") 1 2)"
+                                            "\n  (table $table (export \"table_%i\") 10 20 funcref)"
+                                            "\n  (func $print_i32 (export \"print_i32_%i\") (param i32))"
+                                            "\n  (func $print_f64_f64 (export \"print_f64_f64_%i\") (param f64 f64))"
+                                            "\n)";
+
+  std::vector<std::string> modules(NUM);
+  for(int i = 0; i < NUM; ++i)
+  {
+    modules[i].resize(sizeof(MODULE_TEMPLATE) + 64);
+    modules[i].resize(SPRINTF((char*)modules[i].data(), modules[i].size(), MODULE_TEMPLATE, i, i, i, i, i, i));
+  }
+
+  const unsigned int THREADS[2] = { 1, std::max(1u, std::thread::hardware_concurrency()) };
+  int64_t timing[2];
+  for(int i = 0; i < 2; ++i)
+  {
+    Environment* env = (*_exports.CreateEnvironment)(1, THREADS[i], _arg0);
+    env->flags       = ENV_MULTITHREADED | ENV_ENABLE_WAT;
+    env->features    = ENV_FEATURE_ALL;
+    env->log         = stdout;
+    env->loglevel    = _loglevel;
+
+    std::vector<int> err(NUM);
+    auto t = start();
+    for(int j = 0; j < NUM; ++j)
+      (*_exports.AddModule)(env, modules[j].data(), modules[j].size(), "parallel", &err[j]);
+    (*_exports.FinalizeEnvironment)(env);
+    timing[i] = end(t);
+    assert(std::all_of(err.begin(), err.end(), [](int e) { return e == ERR_SUCCESS; }));
+
+    (*_exports.DestroyEnvironment)(env);
+  }
+
+  fprintf(out, "\n%-*s %-*s %-*s\n", COLUMNS[0], "Parallel Parse", COLUMNS[1], "1 Thread", COLUMNS[2],
+          (std::to_string(THREADS[1]) + " Threads").c_str());
+  fprintf(out, "%-*s %-*s %-*s\n", COLUMNS[0], "--------------", COLUMNS[1], "--------", COLUMNS[2], "---------");
+  fprintf(out, "%-*s %-*lli %-*lli\n", COLUMNS[0], (std::to_string(NUM) + " modules").c_str(), COLUMNS[1], timing[0],
+          COLUMNS[2], timing[1]);
+  fprintf(out, "%-*s %-*.2f %-*.2f\n", COLUMNS[0], "", COLUMNS[1], 1.0, COLUMNS[2], double(timing[0]) / timing[1]);
 }
 
 void* Benchmarks::LoadWASM(const char* wasm, int flags, int optimize)
@@ -86,6 +332,17 @@ void* Benchmarks::LoadWASM(const char* wasm, int flags, int optimize)
   return m;
 }
 
+// Measures how long it takes to compile, link and load a module, which is dominated by LLVM at every optimization level
+int64_t Benchmarks::MeasureCompile(const char* wasm, int optimize)
+{
+  auto t    = start();
+  void* m   = LoadWASM(wasm, ENV_SANDBOX, optimize);
+  int64_t r = end(t);
+  if(m)
+    (*_exports.FreeAssembly)(m);
+  return r;
+}
+
 std::chrono::high_resolution_clock::time_point Benchmarks::start() { return std::chrono::high_resolution_clock::now(); }
 
 int64_t Benchmarks::end(std::chrono::high_resolution_clock::time_point start)
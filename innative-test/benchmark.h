@@ -22,6 +22,11 @@ public:
   Benchmarks(const IRExports& exports, const char* arg0, int loglevel, const path& folder);
   ~Benchmarks();
   void Run(FILE* out);
+  void RunLEB128(FILE* out);
+  void RunParse(FILE* out);
+  void RunParallelParse(FILE* out);
+  void RunCompileTimes(FILE* out);
+  void RunBoundsChecks(FILE* out);
   static int64_t fac(int64_t n);
   static int nbody(int n);
   static int fannkuch_redux(int n);
@@ -75,6 +80,7 @@ public:
 
 protected:
   void* LoadWASM(const char* wasm, int flags, int optimize);
+  int64_t MeasureCompile(const char* wasm, int optimize);
   std::chrono::high_resolution_clock::time_point start();
   int64_t end(std::chrono::high_resolution_clock::time_point start);
 
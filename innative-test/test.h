@@ -10,8 +10,17 @@
 #include <stdio.h>
 #include <vector>
 #include <string.h>
+#include <functional>
 #include "../innative/filesys.h"
 
+// A module passed to TestHarness::CompileModules. A size of 0 means data is a file path, just like AddModule.
+struct TestModule
+{
+  const void* data;
+  uint64_t size;
+  const char* name;
+};
+
 class TestHarness
 {
 public:
@@ -23,6 +32,7 @@ public:
   void test_queue();
   void test_stack();
   void test_stream();
+  void test_threadpool();
   void test_util();
   void test_parallel_parsing();
   void test_serializer();
@@ -30,8 +40,35 @@ public:
   void test_malloc();
   void test_embedding();
   void test_errors();
+  void test_memory();
+  void test_validation();
+  void test_locals();
+  void test_optimize();
+  void test_parallel_compile();
+  void test_instances();
+  void test_tiered();
+  void test_link_memory();
+  void test_bounds_check();
+  void test_lazy_compile();
+  void test_memory_reserve();
+  void test_instruction_stream();
+  void test_lazy_decode();
+  void test_parallel_codegen();
+  void test_guard_pages();
+  void test_object_cache();
   int CompileWASM(const path& file);
 
+  // Compiles the modules into out with the default environment embedded and loads the result, or uses CompileJIT if out
+  // is empty. setup can change the environment before any modules are added. Each step is tested, and nullptr is
+  // returned if any of them fail.
+  void* CompileModules(const std::vector<TestModule>& modules, uint64_t flags, uint64_t optimize, const path& out,
+                       const std::function<void(Environment*)>& setup = nullptr, unsigned int maxthreads = 0);
+  inline void* CompileModule(const char* wat, const char* name, uint64_t flags, uint64_t optimize, const path& out,
+                             const std::function<void(Environment*)>& setup = nullptr)
+  {
+    return CompileModules({ { wat, strlen(wat), name } }, flags, optimize, out, setup);
+  }
+
   inline std::pair<uint32_t, uint32_t> Results()
   {
     auto r    = _testdata;
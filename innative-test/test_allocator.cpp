@@ -31,6 +31,8 @@ void TestHarness::test_allocator()
       while(total < MAXSIZE)
       {
         size_t sz = 1 + (size_t)((float(rand()) / RAND_MAX) * MAXALLOC);
+        if(!(rand() % 64)) // Occasionally make an allocation too large for the thread's chunk
+          sz *= 100;
         total += sz;
         maps[id].push_back({ alloc.allocate(sz), sz });
       }
@@ -62,4 +64,56 @@ void TestHarness::test_allocator()
 
     TEST(pass);
   }
-}
\ No newline at end of file
+
+  // Scratch memory must be reused once a scope ends, so repeating the same work never grows the arena
+  Environment* env = (*_exports.CreateEnvironment)(1, 0, 0);
+  TEST(env != nullptr);
+  if(!env)
+    return;
+
+  utility::ScratchArena& scratch = utility::ScratchArena::Get();
+  size_t capacity                = 0;
+  for(size_t k = 0; k < TRIALS; ++k)
+  {
+    utility::ScratchScope outer(*env);
+    char* a = outer.alloc<char>(100);
+    TEST(a != nullptr);
+    TEST(!(reinterpret_cast<size_t>(a) % alignof(std::max_align_t)));
+    memset(a, 1, 100);
+
+    for(size_t i = 0; i < MAXALLOC; ++i)
+    {
+      utility::ScratchScope inner(*env);
+      char* b = inner.alloc<char>(i * 1000 + 1); // Some of these need more than one block
+      TEST(b != nullptr);
+      TEST(b >= a + 100 || b + i * 1000 + 1 <= a);
+      memset(b, 2, i * 1000 + 1);
+    }
+
+    TEST(std::all_of(a, a + 100, [](char c) { return c == 1; }));
+    if(!k)
+      capacity = scratch.Capacity();
+    TEST(scratch.Capacity() == capacity);
+  }
+
+  // A single huge allocation must not stay with the thread after the outermost scope ends
+  {
+    utility::ScratchScope outer(*env);
+    {
+      utility::ScratchScope inner(*env);
+      TEST(inner.alloc<char>(utility::IN_SCRATCH_RETAIN * 4) != nullptr);
+    }
+    TEST(scratch.Capacity() >= utility::IN_SCRATCH_RETAIN * 4); // Only the outermost scope trims the arena
+  }
+  TEST(scratch.Capacity() <= utility::IN_SCRATCH_RETAIN);
+
+  // Blocks that are already there can always be reused, but new blocks must stay under the environment's memlimit
+  env->memlimit = 1;
+  {
+    utility::ScratchScope outer(*env);
+    TEST(outer.alloc<char>(1) != nullptr);
+    TEST(outer.alloc<char>(utility::IN_SCRATCH_RETAIN * 2) == nullptr);
+  }
+
+  (*_exports.DestroyEnvironment)(env);
+}
@@ -0,0 +1,76 @@
+// Copyright (c)2019 Black Sphere Studios
+// For conditions of distribution and use, see copyright notice in innative.h
+
+#include "traps.h"
+#include "innative/export.h"
+
+void TestHarness::test_bounds_check()
+{
+  // fill has one check per iteration that gets hoisted out of the loop, and sum has two checks against the same index
+  // that get merged before being hoisted.
+  static constexpr char MODULE[] =
+    "(module $bounds"
+    "\n  (memory 1)"
+    "\n  (func (export \"fill\") (param i32) (local i32)"
+    "\n    (block"
+    "\n      (loop"
+    "\n        (br_if 1 (i32.ge_u (local.get 1) (local.get 0)))"
+    "\n        (i32.store (i32.shl (local.get 1) (i32.const 2)) (local.get 1))"
+    "\n        (local.set 1 (i32.add (local.get 1) (i32.const 1)))"
+    "\n        (br 0))))"
+    "\n  (func (export \"sum\") (param i32) (result i32) (local i32 i32)"
+    "\n    (block"
+    "\n      (loop"
+    "\n        (br_if 1 (i32.ge_u (local.get 1) (local.get 0)))"
+    "\n        (local.set 2 (i32.add (local.get 2)"
+    "\n          (i32.add (i32.load (i32.shl (local.get 1) (i32.const 2)))"
+    "\n                   (i32.load offset=4 (i32.shl (local.get 1) (i32.const 2))))))"
+    "\n        (local.set 1 (i32.add (local.get 1) (i32.const 1)))"
+    "\n        (br 0)))"
+    "\n    (local.get 2))"
+    "\n  (func (export \"load\") (param i32) (result i32) (i32.load (local.get 0)))"
+    "\n)";
+
+  static constexpr int WORDS = 65536 / 4; // One page of i32 values
+
+  // The pass only runs when optimizing, so the unoptimized build shows how the module behaves without it
+  const uint64_t OPTIMIZE[] = { ENV_OPTIMIZE_O0, ENV_OPTIMIZE_O3 };
+
+  for(uint64_t optimize : OPTIMIZE)
+  {
+    path dll_path  = _folder / "bounds_check" IN_LIBRARY_EXTENSION;
+    void* assembly = CompileModule(MODULE, "bounds", ENV_CHECK_MEMORY_ACCESS, optimize, dll_path);
+    if(assembly)
+    {
+      auto fill = (void (*)(int))(*_exports.LoadFunction)(assembly, "bounds", "fill");
+      auto sum  = (int (*)(int))(*_exports.LoadFunction)(assembly, "bounds", "sum");
+      auto load = (int (*)(int))(*_exports.LoadFunction)(assembly, "bounds", "load");
+      TEST(fill && sum && load);
+
+      if(fill && sum && load)
+      {
+        // The last iteration is out of bounds, but every store before it must still have happened
+        TEST(Traps(fill, WORDS + 1));
+        TEST((*load)(0) == 0);
+        TEST((*load)(4) == 1);
+        TEST((*load)((WORDS - 1) * 4) == WORDS - 1);
+
+        // Each iteration adds i + (i + 1), so summing n values gives n squared
+        TEST(!Traps(fill, WORDS));
+        TEST((*sum)(0) == 0);
+        TEST((*sum)(10) == 100);
+        TEST((*sum)(WORDS - 1) == (WORDS - 1) * (WORDS - 1));
+
+        // Only the merged offset=4 access of the last iteration is out of bounds
+        TEST(Traps(sum, WORDS));
+        TEST(Traps(sum, 0x7FFFFFFF));
+        TEST(Traps(load, WORDS * 4 - 3));
+        TEST(!Traps(load, WORDS * 4 - 4));
+      }
+
+      (*_exports.FreeAssembly)(assembly);
+    }
+
+    remove(dll_path);
+  }
+}
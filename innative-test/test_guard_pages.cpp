@@ -0,0 +1,105 @@
+// Copyright (c)2019 Black Sphere Studios
+// For conditions of distribution and use, see copyright notice in innative.h
+
+#include "traps.h"
+#include "innative/export.h"
+
+#if defined(IN_PLATFORM_LINUX) && defined(IN_CPU_x86_64)
+#include <sys/mman.h>
+
+static sigjmp_buf fault_jump;
+static volatile sig_atomic_t fault_expected = 0;
+
+// Stands in for whatever handler the embedding program installed before loading a module with guard pages. It stays
+// installed behind the guard handler after this test finishes, so any fault nobody expects still aborts the program.
+static void FaultHandler(int, siginfo_t*, void*)
+{
+  if(!fault_expected)
+    abort();
+  siglongjmp(fault_jump, 1);
+}
+#endif
+
+void TestHarness::test_guard_pages()
+{
+  static constexpr char MODULE[] =
+    "(module $guard"
+    "\n  (memory 1)"
+    "\n  (func (export \"load\") (param i32) (result i32) (i32.load (local.get 0)))"
+    "\n  (func (export \"store\") (param i32 i32) (i32.store (local.get 0) (local.get 1)))"
+    "\n  (func (export \"grow\") (param i32) (result i32) (memory.grow (local.get 0)))"
+    "\n)";
+
+  static constexpr int PAGE = 65536;
+
+#if defined(IN_PLATFORM_LINUX) && defined(IN_CPU_x86_64)
+  // The guard handler saves whatever handler it replaces when the first guard region is registered, which is why this
+  // test must run before any other test that uses guard pages.
+  struct sigaction previous;
+  sigaction(SIGSEGV, nullptr, &previous);
+  TEST(previous.sa_handler == SIG_DFL);
+
+  struct sigaction action = {};
+  action.sa_sigaction     = FaultHandler;
+  action.sa_flags         = SA_SIGINFO;
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGSEGV, &action, nullptr);
+#endif
+
+  // Without bounds checks, every out of bounds access must still trap by hitting an inaccessible page. On platforms
+  // without guard pages, the bounds checks stay in place, so the module must behave exactly the same.
+  path dll_path  = _folder / "guard_pages" IN_LIBRARY_EXTENSION;
+  void* assembly = CompileModule(MODULE, "guard", ENV_MEMORY_GUARD_PAGES | ENV_CHECK_MEMORY_ACCESS, ENV_OPTIMIZE_O3,
+                                 dll_path);
+  if(assembly)
+  {
+    auto load  = (int (*)(int))(*_exports.LoadFunction)(assembly, "guard", "load");
+    auto store = (void (*)(int, int))(*_exports.LoadFunction)(assembly, "guard", "store");
+    auto grow  = (int (*)(int))(*_exports.LoadFunction)(assembly, "guard", "grow");
+    TEST(load && store && grow);
+
+    if(load && store && grow)
+    {
+      TEST(!Traps(store, PAGE - 4, 7));
+      TEST((*load)(PAGE - 4) == 7);
+      TEST(Traps(load, PAGE));
+      TEST(Traps(load, PAGE - 3));
+      TEST(Traps(store, PAGE, 1));
+      TEST(Traps(load, -4)); // The largest address a webassembly load can use
+      TEST(Traps(store, 0x7FFFFFFF, 1));
+
+      // Growing commits another page in place, so the old page keeps its values, and the new end must trap instead
+      TEST((*grow)(1) == 1);
+      TEST((*load)(PAGE - 4) == 7);
+      TEST(!Traps(store, PAGE, 3));
+      TEST((*load)(PAGE) == 3);
+      TEST(!Traps(load, PAGE * 2 - 4));
+      TEST(Traps(load, PAGE * 2));
+      TEST(Traps(store, PAGE * 2 - 2, 1));
+
+#if defined(IN_PLATFORM_LINUX) && defined(IN_CPU_x86_64)
+      // A fault outside of every guard region isn't a webassembly trap, so it must reach the handler that was installed
+      // before the guard handler instead.
+      void* page = mmap(nullptr, 4096, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+      TEST(page != MAP_FAILED);
+      if(page != MAP_FAILED)
+      {
+        fault_expected = 1;
+        bool faulted   = sigsetjmp(fault_jump, 1) != 0;
+        if(!faulted)
+          *(volatile int*)page = 1;
+        fault_expected = 0;
+        TEST(faulted);
+        munmap(page, 4096);
+      }
+
+      // A trap inside a guard region must still be handled by the guard handler instead of the previous handler
+      TEST(Traps(load, PAGE * 2));
+#endif
+    }
+
+    (*_exports.FreeAssembly)(assembly);
+  }
+
+  remove(dll_path);
+}
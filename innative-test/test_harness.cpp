@@ -25,12 +25,29 @@ size_t TestHarness::Run(FILE* out)
                                                               { "queue.h", &TestHarness::test_queue },
                                                               { "stack.h", &TestHarness::test_stack },
                                                               { "stream.h", &TestHarness::test_stream },
+                                                              { "threadpool.h", &TestHarness::test_threadpool },
                                                               { "util.h", &TestHarness::test_util },
                                                               { "embedding", &TestHarness::test_embedding },
                                                               { "allocator", &TestHarness::test_allocator },
                                                               { "parallel parsing", &TestHarness::test_parallel_parsing },
                                                               { "whitelist", &TestHarness::test_whitelist },
                                                               { "serializer", &TestHarness::test_serializer },
+                                                              { "memory limit", &TestHarness::test_memory },
+                                                              { "fused validation", &TestHarness::test_validation },
+                                                              { "ssa locals", &TestHarness::test_locals },
+                                                              { "optimization hints", &TestHarness::test_optimize },
+                                                              { "parallel compile", &TestHarness::test_parallel_compile },
+                                                              { "guard pages", &TestHarness::test_guard_pages },
+                                                              { "instances", &TestHarness::test_instances },
+                                                              { "tiered compile", &TestHarness::test_tiered },
+                                                              { "link in memory", &TestHarness::test_link_memory },
+                                                              { "bounds check", &TestHarness::test_bounds_check },
+                                                              { "lazy compile", &TestHarness::test_lazy_compile },
+                                                              { "memory reserve", &TestHarness::test_memory_reserve },
+                                                              { "instruction stream", &TestHarness::test_instruction_stream },
+                                                              { "lazy decode", &TestHarness::test_lazy_decode },
+                                                              { "parallel codegen", &TestHarness::test_parallel_codegen },
+                                                              { "object cache", &TestHarness::test_object_cache },
                                                               { "errors", &TestHarness::test_errors } };
 
   static const size_t NUMTESTS    = sizeof(tests) / sizeof(decltype(tests[0]));
@@ -128,3 +145,41 @@ int TestHarness::CompileWASM(const path& file)
 
   return ERR_SUCCESS;
 }
+
+void* TestHarness::CompileModules(const std::vector<TestModule>& modules, uint64_t flags, uint64_t optimize,
+                                  const path& out, const std::function<void(Environment*)>& setup,
+                                  unsigned int maxthreads)
+{
+  Environment* env = (*_exports.CreateEnvironment)((unsigned int)modules.size(), maxthreads, 0);
+  TEST(env != nullptr);
+  if(!env)
+    return nullptr;
+
+  env->flags    = ENV_ENABLE_WAT | flags | (out.empty() ? 0 : ENV_LIBRARY);
+  env->optimize = optimize;
+  env->loglevel = LOG_FATAL;
+  if(setup)
+    setup(env);
+
+  int err = (*_exports.AddEmbedding)(env, 0, (void*)INNATIVE_DEFAULT_ENVIRONMENT, 0);
+  TEST(!err);
+  std::vector<int> errs(modules.size());
+  for(size_t i = 0; i < modules.size(); ++i)
+    (*_exports.AddModule)(env, modules[i].data, modules[i].size, modules[i].name, &errs[i]);
+  TEST((*_exports.FinalizeEnvironment)(env) == ERR_SUCCESS);
+  for(int e : errs)
+    TEST(e == ERR_SUCCESS);
+
+  void* assembly = nullptr;
+  if(out.empty())
+    err = (*_exports.CompileJIT)(env, &assembly);
+  else
+    err = (*_exports.Compile)(env, out.u8string().c_str());
+  TEST(err == ERR_SUCCESS);
+  (*_exports.DestroyEnvironment)(env);
+
+  if(err == ERR_SUCCESS && !out.empty())
+    assembly = (*_exports.LoadAssembly)(out.u8string().c_str());
+  TEST(assembly != nullptr);
+  return assembly;
+}
@@ -0,0 +1,145 @@
+// Copyright (c)2019 Black Sphere Studios
+// For conditions of distribution and use, see copyright notice in innative.h
+
+#include "test.h"
+#include "innative/export.h"
+#include <thread>
+#include <vector>
+
+void TestHarness::test_instances()
+{
+  static constexpr char MODULE[] =
+    "(module $instances"
+    "\n  (memory 1)"
+    "\n  (global $g (mut i32) (i32.const 5))"
+    "\n  (data (i32.const 4) \"\\07\")"
+    "\n  (func (export \"get\") (result i32) (global.get $g))"
+    "\n  (func (export \"set\") (param i32) (global.set $g (local.get 0)))"
+    "\n  (func (export \"load\") (param i32) (result i32) (i32.load8_u (local.get 0)))"
+    "\n  (func (export \"store\") (param i32 i32) (i32.store8 (local.get 0) (local.get 1)))"
+    "\n)";
+
+  path dll_path  = _folder / "instances" IN_LIBRARY_EXTENSION;
+  void* assembly = CompileModule(MODULE, "instances", ENV_INSTANCES, ENV_OPTIMIZE_O3, dll_path);
+  if(assembly)
+  {
+    auto get   = (int (*)())(*_exports.LoadFunction)(assembly, "instances", "get");
+    auto set   = (void (*)(int))(*_exports.LoadFunction)(assembly, "instances", "set");
+    auto load  = (int (*)(int))(*_exports.LoadFunction)(assembly, "instances", "load");
+    auto store = (void (*)(int, int))(*_exports.LoadFunction)(assembly, "instances", "store");
+    TEST(get && set && load && store);
+
+    if(get && set && load && store)
+    {
+      // The init function already entered the default instance on this thread
+      TEST((*get)() == 5);
+      TEST((*load)(4) == 7);
+      (*set)(1);
+      (*store)(0, 10);
+
+      void* a = (*_exports.CreateInstance)(assembly);
+      void* b = (*_exports.CreateInstance)(assembly);
+      TEST(a != nullptr);
+      TEST(b != nullptr);
+      TEST(a != b);
+
+      void* def = (*_exports.EnterInstance)(assembly, a);
+      TEST(def != nullptr);
+      TEST((*get)() == 5);
+      TEST((*load)(0) == 0);
+      TEST((*load)(4) == 7);
+      (*set)(2);
+      (*store)(0, 20);
+
+      TEST((*_exports.EnterInstance)(assembly, b) == a);
+      TEST((*get)() == 5);
+      TEST((*load)(0) == 0);
+      (*set)(3);
+      (*store)(0, 30);
+
+      (*_exports.EnterInstance)(assembly, a);
+      TEST((*get)() == 2);
+      TEST((*load)(0) == 20);
+
+      (*_exports.EnterInstance)(assembly, b);
+      TEST((*get)() == 3);
+      TEST((*load)(0) == 30);
+
+      // A thread that never entered an instance uses the default one
+      int global = 0;
+      int memory = 0;
+      std::thread([&]() {
+        global = (*get)();
+        memory = (*load)(0);
+      }).join();
+      TEST(global == 1);
+      TEST(memory == 10);
+
+      (*_exports.ResetInstance)(assembly, a);
+      TEST((*_exports.EnterInstance)(assembly, a) == b);
+      TEST((*get)() == 5);
+      TEST((*load)(0) == 0);
+      TEST((*load)(4) == 7);
+
+      (*_exports.EnterInstance)(assembly, def);
+      TEST((*get)() == 1);
+      TEST((*load)(0) == 10);
+
+      (*_exports.DestroyInstance)(assembly, a);
+      (*_exports.DestroyInstance)(assembly, b);
+      TEST((*_exports.EnterInstance)(assembly, nullptr) == def);
+      TEST((*get)() == 1);
+    }
+
+    (*_exports.FreeAssembly)(assembly);
+  }
+
+  remove(dll_path);
+
+  // Guarded memories each take a guard region, and there must be no limit on how many of those can exist at once
+  static constexpr int COUNT = 300;
+
+  assembly = CompileModule(MODULE, "instances", ENV_INSTANCES | ENV_MEMORY_GUARD_PAGES | ENV_CHECK_MEMORY_ACCESS,
+                           ENV_OPTIMIZE_O3, dll_path);
+  if(assembly)
+  {
+    auto set   = (void (*)(int))(*_exports.LoadFunction)(assembly, "instances", "set");
+    auto get   = (int (*)())(*_exports.LoadFunction)(assembly, "instances", "get");
+    auto load  = (int (*)(int))(*_exports.LoadFunction)(assembly, "instances", "load");
+    auto store = (void (*)(int, int))(*_exports.LoadFunction)(assembly, "instances", "store");
+    TEST(get && set && load && store);
+
+    if(get && set && load && store)
+    {
+      void* previous = (*_exports.EnterInstance)(assembly, nullptr);
+      std::vector<void*> instances;
+      for(int i = 0; i < COUNT; ++i)
+      {
+        void* instance = (*_exports.CreateInstance)(assembly);
+        TEST(instance != nullptr);
+        if(!instance)
+          break;
+        instances.push_back(instance);
+        (*_exports.EnterInstance)(assembly, instance);
+        (*set)(i);
+        (*store)(0, i & 0xFF);
+      }
+
+      for(int i = 0; i < (int)instances.size(); ++i)
+      {
+        (*_exports.EnterInstance)(assembly, instances[i]);
+        TEST((*get)() == i);
+        TEST((*load)(0) == (i & 0xFF));
+        TEST((*load)(4) == 7);
+      }
+
+      for(void* instance : instances)
+        (*_exports.DestroyInstance)(assembly, instance);
+      (*_exports.EnterInstance)(assembly, previous);
+    }
+
+    (*_exports.FreeAssembly)(assembly);
+  }
+
+  remove(dll_path);
+}
@@ -0,0 +1,129 @@
+// Copyright (c)2019 Black Sphere Studios
+// For conditions of distribution and use, see copyright notice in innative.h
+
+#include "test.h"
+#include "../innative/body.h"
+#include "innative/opcodes.h"
+
+using namespace innative;
+
+void TestHarness::test_instruction_stream()
+{
+  Environment* env = (*_exports.CreateEnvironment)(1, 0, 0);
+  env->flags       = ENV_ENABLE_WAT | ENV_DEBUG;
+  env->loglevel    = LOG_FATAL;
+
+  {
+    varuint32 targets[3] = { 2, 0, 300 };
+    Instruction ins[9]   = {};
+    ins[0].opcode        = OP_local_get;
+    ins[1].opcode        = OP_i32_const;
+    ins[2].opcode        = OP_i64_const;
+    ins[3].opcode        = OP_f64_const;
+    ins[4].opcode        = OP_br_table;
+    ins[5].opcode        = OP_i32_load16_u;
+    ins[6].opcode        = OP_call;
+    ins[7].opcode        = OP_i32_add;
+    ins[8].opcode        = OP_end;
+
+    ins[1].immediates[0]._varsint32 = -100000;
+    ins[2].immediates[0]._varsint64 = INT64_MIN;
+    ins[3].immediates[0]._float64   = -0.5;
+    ins[4].immediates[0].n_table    = 3;
+    ins[4].immediates[0].table      = targets;
+    ins[4].immediates[1]._varuint32 = 1;
+    ins[5].immediates[0]._varuint32 = 1;
+    ins[5].immediates[1]._varuptr   = 128;
+    for(unsigned int i = 0; i < 9; ++i)
+    {
+      ins[i].line   = i + 1;
+      ins[i].column = i * 2;
+    }
+
+    // Each instruction only takes as many bytes as its immediates need
+    static constexpr size_t SIZES[9] = { 2, 4, 11, 9, 7, 4, 1 + PATCH_ENCODED_SIZE, 1, 1 };
+
+    FunctionBody f = {};
+    varuint32 patch;
+    for(int i = 0; i < 9; ++i)
+    {
+      varuint32 n = f.n_bytes;
+      TEST(AppendInstruction(*env, f, ins[i], ins[i].opcode == OP_call ? &patch : nullptr) == ERR_SUCCESS);
+      TEST(f.n_bytes - n == SIZES[i]);
+    }
+    TEST(f.n_body == 9);
+    TEST(f.lines != nullptr);
+
+    // A padded immediate is patched in place without changing the size of the stream
+    varuint32 n = f.n_bytes;
+    PatchInstruction(f, patch, 0x12345);
+    TEST(f.n_bytes == n);
+
+    BodyReader reader(f, *env);
+    Instruction out;
+    for(int i = 0; i < 9; ++i)
+    {
+      TEST(!reader.End());
+      TEST(reader.Read(out) == ERR_SUCCESS);
+      TEST(out.opcode == ins[i].opcode);
+      TEST(out.line == ins[i].line);
+      TEST(out.column == ins[i].column);
+    }
+    TEST(reader.End());
+
+    BodyReader check(f, *env);
+    check.Read(out);
+    TEST(out.immediates[0]._varuint32 == 0);
+    check.Read(out);
+    TEST(out.immediates[0]._varsint32 == -100000);
+    check.Read(out);
+    TEST(out.immediates[0]._varsint64 == INT64_MIN);
+    check.Read(out);
+    TEST(out.immediates[0]._float64 == -0.5);
+    check.Read(out);
+    TEST(out.immediates[0].n_table == 3);
+    TEST(out.immediates[0].table[0] == 2 && out.immediates[0].table[1] == 0 && out.immediates[0].table[2] == 300);
+    TEST(out.immediates[1]._varuint32 == 1);
+    check.Read(out);
+    TEST(out.immediates[0]._varuint32 == 1);
+    TEST(out.immediates[1]._varuptr == 128);
+    check.Read(out);
+    TEST(out.immediates[0]._varuint32 == 0x12345);
+  }
+
+  {
+    // $first calls a function that hasn't been declared yet, so the parser has to patch the call afterwards
+    static constexpr char MODULE[] = "(module $stream"
+                                     "\n  (func $first (result i32) (call $second (i32.const 7)))"
+                                     "\n  (func $second (param i32) (result i32) (i32.add (local.get 0) (i32.const 1)))"
+                                     "\n)";
+
+    int err;
+    (*_exports.AddModule)(env, MODULE, sizeof(MODULE) - 1, "stream", &err);
+    TEST(err == ERR_SUCCESS);
+    TEST((*_exports.FinalizeEnvironment)(env) == ERR_SUCCESS);
+    TEST(env->n_modules == 1);
+
+    if(env->n_modules == 1 && env->modules[0].code.n_funcbody == 2)
+    {
+      static constexpr uint8_t FIRST[] = { OP_i32_const, OP_call, OP_end };
+      const FunctionBody& f            = env->modules[0].code.funcbody[0];
+      TEST(f.n_body == 3);
+
+      BodyReader reader(f, *env);
+      Instruction ins;
+      for(auto opcode : FIRST)
+      {
+        TEST(reader.Read(ins) == ERR_SUCCESS);
+        TEST(ins.opcode == opcode);
+        if(ins.opcode == OP_call)
+          TEST(ins.immediates[0]._varuint32 == 1);
+        if(ins.opcode != OP_end) // The implicit end has no source location of its own
+          TEST(ins.line == 2);
+      }
+      TEST(reader.End());
+    }
+  }
+
+  (*_exports.DestroyEnvironment)(env);
+}
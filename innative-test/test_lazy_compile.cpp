@@ -0,0 +1,54 @@
+// Copyright (c)2019 Black Sphere Studios
+// For conditions of distribution and use, see copyright notice in innative.h
+
+#include "test.h"
+#include "innative/export.h"
+
+void TestHarness::test_lazy_compile()
+{
+  // Calls reach each function directly, through the table, and through another function that hasn't been compiled yet
+  static constexpr char MODULE[] =
+    "(module $lazy"
+    "\n  (type $binary (func (param i32 i32) (result i32)))"
+    "\n  (table funcref (elem $add $mul))"
+    "\n  (func $add (type $binary) (i32.add (local.get 0) (local.get 1)))"
+    "\n  (func $mul (type $binary) (i32.mul (local.get 0) (local.get 1)))"
+    "\n  (func (export \"direct\") (param i32 i32) (result i32) (call $mul (local.get 0) (local.get 1)))"
+    "\n  (func (export \"indirect\") (param i32 i32 i32) (result i32)"
+    "\n    (call_indirect (type $binary) (local.get 1) (local.get 2) (local.get 0)))"
+    "\n  (func $fac (export \"fac\") (param i32) (result i32)"
+    "\n    (if (result i32) (i32.lt_u (local.get 0) (i32.const 2))"
+    "\n      (then (i32.const 1))"
+    "\n      (else (call $mul (local.get 0) (call $fac (i32.sub (local.get 0) (i32.const 1)))))))"
+    "\n  (func (export \"unused\") (result i32) (unreachable))"
+    "\n)";
+
+  const uint64_t OPTIMIZE[] = { ENV_OPTIMIZE_O0, ENV_OPTIMIZE_O3 };
+
+  for(uint64_t optimize : OPTIMIZE)
+  {
+    void* assembly = CompileModule(MODULE, "lazy", ENV_LAZY_COMPILE, optimize, path());
+    if(assembly)
+    {
+      auto direct   = (int (*)(int, int))(*_exports.LoadFunction)(assembly, "lazy", "direct");
+      auto indirect = (int (*)(int, int, int))(*_exports.LoadFunction)(assembly, "lazy", "indirect");
+      auto fac      = (int (*)(int))(*_exports.LoadFunction)(assembly, "lazy", "fac");
+      TEST(direct && indirect && fac);
+
+      if(direct && indirect && fac)
+      {
+        // The first call to each function compiles it, and every call after that must reach the same body
+        for(int i = 0; i < 2; ++i)
+        {
+          TEST((*indirect)(0, 3, 4) == 7);
+          TEST((*indirect)(1, 3, 4) == 12);
+          TEST((*direct)(5, 6) == 30);
+          TEST((*fac)(10) == 3628800);
+          TEST((*fac)(1) == 1);
+        }
+      }
+
+      (*_exports.FreeAssembly)(assembly);
+    }
+  }
+}
@@ -0,0 +1,97 @@
+// Copyright (c)2019 Black Sphere Studios
+// For conditions of distribution and use, see copyright notice in innative.h
+
+#include "test.h"
+#include "innative/export.h"
+
+void TestHarness::test_lazy_decode()
+{
+  // (func (export "inc") (param i32) (result i32) (i32.add (local.get 0) (i32.const 1)))
+  static constexpr uint8_t MODULE[] = { 0x00, 0x61, 0x73, 0x6d, 0x01, 0x00, 0x00, 0x00, 0x01, 0x06, 0x01, 0x60,
+                                        0x01, 0x7f, 0x01, 0x7f, 0x03, 0x02, 0x01, 0x00, 0x07, 0x07, 0x01, 0x03,
+                                        0x69, 0x6e, 0x63, 0x00, 0x00, 0x0a, 0x09, 0x01, 0x07, 0x00, 0x20, 0x00,
+                                        0x41, 0x01, 0x6a, 0x0b };
+
+  // The same module with i32.add replaced by an opcode that doesn't exist
+  static constexpr uint8_t BROKEN[] = { 0x00, 0x61, 0x73, 0x6d, 0x01, 0x00, 0x00, 0x00, 0x01, 0x06, 0x01, 0x60,
+                                        0x01, 0x7f, 0x01, 0x7f, 0x03, 0x02, 0x01, 0x00, 0x07, 0x07, 0x01, 0x03,
+                                        0x69, 0x6e, 0x63, 0x00, 0x00, 0x0a, 0x09, 0x01, 0x07, 0x00, 0x20, 0x00,
+                                        0x41, 0x01, 0xff, 0x0b };
+
+  path wasm_path = _folder / "lazy_decode.wasm";
+  path dll_path  = _folder / "lazy_decode" IN_LIBRARY_EXTENSION;
+
+  FILE* f = nullptr;
+  FOPEN(f, wasm_path.c_str(), "wb");
+  TEST(f != nullptr);
+  if(!f)
+    return;
+  fwrite(MODULE, 1, sizeof(MODULE), f);
+  fclose(f);
+
+  {
+    // Parsing only reads the locals, and leaves each body pointing at its instructions in the module source
+    Environment* env = (*_exports.CreateEnvironment)(1, 0, 0);
+    env->flags       = ENV_LAZY_DECODE;
+    env->loglevel    = LOG_FATAL;
+
+    int err;
+    (*_exports.AddModule)(env, MODULE, sizeof(MODULE), "buffer", &err);
+    TEST((*_exports.FinalizeEnvironment)(env) == ERR_SUCCESS);
+    TEST(err == ERR_SUCCESS);
+    TEST(env->n_modules == 1 && env->modules[0].code.n_funcbody == 1);
+    if(env->n_modules == 1 && env->modules[0].code.n_funcbody == 1)
+    {
+      TEST(env->modules[0].code.funcbody[0].n_body == 0);
+      TEST(env->modules[0].code.funcbody[0].n_bytes == 6);
+    }
+    (*_exports.DestroyEnvironment)(env);
+  }
+
+  {
+    void* assembly = CompileModules({ { MODULE, sizeof(MODULE), "buffer" },
+                                      { wasm_path.u8string().c_str(), 0, "file" } },
+                                    ENV_LAZY_DECODE, ENV_OPTIMIZE_O3, dll_path);
+    if(assembly)
+    {
+      auto buffer = (int (*)(int))(*_exports.LoadFunction)(assembly, "buffer", "inc");
+      auto file   = (int (*)(int))(*_exports.LoadFunction)(assembly, "file", "inc");
+      TEST(buffer && file);
+      if(buffer && file)
+      {
+        TEST((*buffer)(41) == 42);
+        TEST((*file)(-1) == 0);
+      }
+      (*_exports.FreeAssembly)(assembly);
+    }
+
+    remove(dll_path);
+  }
+
+  // A bad instruction is only found once the body is decoded, but it must still be rejected before compiling
+  const uint64_t FLAGS[] = { 0, ENV_LAZY_DECODE };
+
+  for(uint64_t flags : FLAGS)
+  {
+    Environment* env = (*_exports.CreateEnvironment)(1, 0, 0);
+    env->flags       = flags;
+    env->loglevel    = LOG_FATAL;
+
+    int err;
+    (*_exports.AddModule)(env, BROKEN, sizeof(BROKEN), "broken", &err);
+    (*_exports.FinalizeEnvironment)(env);
+    if(!flags)
+      TEST(err == ERR_FATAL_UNKNOWN_INSTRUCTION);
+    else
+    {
+      TEST(err == ERR_SUCCESS);
+      TEST((*_exports.Validate)(env) == ERR_VALIDATION_ERROR);
+      TEST(env->errors != nullptr);
+      if(env->errors)
+        TEST(env->errors->code == ERR_FATAL_UNKNOWN_INSTRUCTION);
+    }
+    (*_exports.DestroyEnvironment)(env);
+  }
+
+  remove(wasm_path);
+}
@@ -0,0 +1,38 @@
+// Copyright (c)2019 Black Sphere Studios
+// For conditions of distribution and use, see copyright notice in innative.h
+
+#include "test.h"
+#include "innative/export.h"
+#include <string>
+
+void TestHarness::test_link_memory()
+{
+  static constexpr char MODULE[] = "(module"
+                                   "\n  (func (export \"get\") (result i32) (i32.const 42))"
+                                   "\n)";
+
+#ifdef IN_PLATFORM_POSIX
+  // Longer than the 249 bytes an anonymous file name can have, but still short enough to be a file name
+  const std::string name(250, 'm');
+#else
+  const std::string name(64, 'm');
+#endif
+
+  const uint64_t FLAGS[] = { ENV_LINK_IN_MEMORY, ENV_LINK_IN_MEMORY | ENV_PARALLEL_CODEGEN | ENV_MULTITHREADED };
+
+  for(uint64_t flags : FLAGS)
+  {
+    path dll_path  = _folder / "link_memory" IN_LIBRARY_EXTENSION;
+    void* assembly = CompileModule(MODULE, name.c_str(), flags, ENV_OPTIMIZE_O3, dll_path);
+    if(assembly)
+    {
+      auto get = (int (*)())(*_exports.LoadFunction)(assembly, name.c_str(), "get");
+      TEST(get != nullptr);
+      if(get)
+        TEST((*get)() == 42);
+      (*_exports.FreeAssembly)(assembly);
+    }
+
+    remove(dll_path);
+  }
+}
@@ -0,0 +1,89 @@
+// Copyright (c)2019 Black Sphere Studios
+// For conditions of distribution and use, see copyright notice in innative.h
+
+#include "test.h"
+#include "innative/export.h"
+
+void TestHarness::test_locals()
+{
+  static constexpr char MODULE[] =
+    "(module $locals"
+    "\n  (func (export \"branches\") (param i32) (result i32) (local i32 i32)"
+    "\n    (block (result i32)"
+    "\n      (if (i32.lt_s (local.get 0) (i32.const 3))"
+    "\n        (then (local.set 1 (i32.const 10)))"
+    "\n        (else (local.set 2 (i32.const 20))))"
+    "\n      (local.set 1 (i32.add (local.get 1) (local.get 2)))"
+    "\n      (br_if 0 (local.get 1) (i32.eq (local.get 0) (i32.const 5)))"
+    "\n      drop"
+    "\n      (local.set 1 (i32.const 7))"
+    "\n      (local.get 1))"
+    "\n    local.get 1"
+    "\n    i32.add)"
+    "\n  (func (export \"table\") (param i32) (result i32) (local i32)"
+    "\n    (block"
+    "\n      (loop"
+    "\n        (block"
+    "\n          (block"
+    "\n            (br_table 0 1 2 3 (i32.and (local.tee 0 (i32.sub (local.get 0) (i32.const 1))) (i32.const 3))))"
+    "\n          (local.set 1 (i32.add (local.get 1) (i32.const 1)))"
+    "\n          (br 1))"
+    "\n        (local.set 1 (i32.add (local.get 1) (i32.const 100)))"
+    "\n        (br_if 1 (i32.eqz (local.get 0)))"
+    "\n        (br 0)))"
+    "\n    (i32.add (local.get 1) (i32.mul (local.get 0) (i32.const 1000))))"
+    "\n  (func (export \"loops\") (param i32) (result i32) (local i32 i32 i32)"
+    "\n    (loop"
+    "\n      (local.set 2 (i32.const 0))"
+    "\n      (loop"
+    "\n        (local.set 3 (i32.add (local.get 3) (i32.mul (local.get 1) (local.get 2))))"
+    "\n        (br_if 0 (i32.lt_s (local.tee 2 (i32.add (local.get 2) (i32.const 1))) (local.get 0))))"
+    "\n      (br_if 0 (i32.lt_s (local.tee 1 (i32.add (local.get 1) (i32.const 1))) (local.get 0))))"
+    "\n    (local.get 3))"
+    "\n)";
+
+  // Locals kept in SSA form must behave exactly like locals on the stack, at every optimization level
+  const int FLAGS[][2] = { { 0, ENV_OPTIMIZE_O0 },
+                           { 0, ENV_OPTIMIZE_BASELINE },
+                           { ENV_SSA_LOCALS, ENV_OPTIMIZE_O0 },
+                           { ENV_SSA_LOCALS, ENV_OPTIMIZE_BASELINE },
+                           { ENV_SSA_LOCALS, ENV_OPTIMIZE_O3 } };
+
+  for(auto& flags : FLAGS)
+  {
+    path dll_path  = _folder / "locals" IN_LIBRARY_EXTENSION;
+    void* assembly = CompileModule(MODULE, "locals", flags[0], flags[1], dll_path);
+    if(assembly)
+    {
+      auto branches = (int (*)(int))(*_exports.LoadFunction)(assembly, "locals", "branches");
+      auto table    = (int (*)(int))(*_exports.LoadFunction)(assembly, "locals", "table");
+      auto loops    = (int (*)(int))(*_exports.LoadFunction)(assembly, "locals", "loops");
+      TEST(branches != nullptr);
+      TEST(table != nullptr);
+      TEST(loops != nullptr);
+
+      if(branches)
+      {
+        TEST((*branches)(-1) == 14);
+        TEST((*branches)(3) == 14);
+        TEST((*branches)(5) == 40);
+      }
+      if(table)
+      {
+        TEST((*table)(1) == -999);
+        TEST((*table)(4) == 3000);
+        TEST((*table)(7) == 3101);
+        TEST((*table)(30) == 27101);
+      }
+      if(loops)
+      {
+        TEST((*loops)(3) == 9);
+        TEST((*loops)(6) == 225);
+      }
+
+      (*_exports.FreeAssembly)(assembly);
+    }
+
+    remove(dll_path);
+  }
+}
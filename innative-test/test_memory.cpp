@@ -0,0 +1,54 @@
+// Copyright (c)2019 Black Sphere Studios
+// For conditions of distribution and use, see copyright notice in innative.h
+
+#include "test.h"
+#include "innative/export.h"
+
+void TestHarness::test_memory()
+{
+  static constexpr char MODULE[] = "(module $memory (func $f (export \"f\") (param i32) (result i32) local.get 0))";
+
+  // A single function that declares 2^28 i32 locals, which needs far more memory than our limit allows
+  static constexpr uint8_t LOCALS[] = { 0x00, 0x61, 0x73, 0x6d, 0x01, 0x00, 0x00, 0x00, 0x01, 0x04, 0x01, 0x60,
+                                        0x00, 0x00, 0x03, 0x02, 0x01, 0x00, 0x0a, 0x0a, 0x01, 0x08, 0x01, 0x80,
+                                        0x80, 0x80, 0x80, 0x01, 0x7f, 0x0b };
+
+  {
+    Environment* env = (*_exports.CreateEnvironment)(1, 0, 0);
+    env->flags       = ENV_ENABLE_WAT;
+    env->loglevel    = LOG_FATAL;
+
+    int err;
+    (*_exports.AddModule)(env, MODULE, sizeof(MODULE) - 1, "memory", &err);
+    TEST((*_exports.FinalizeEnvironment)(env) == ERR_SUCCESS);
+    TEST(err == ERR_SUCCESS);
+
+    MemoryUsage usage;
+    TEST((*_exports.GetMemoryUsage)(env, &usage) == ERR_SUCCESS);
+    TEST(usage.arena > 0);
+    TEST(usage.modules >= sizeof(Module));
+    TEST(usage.hashes > 0);
+    TEST(usage.total >= usage.arena + usage.modules + usage.hashes);
+    TEST((*_exports.GetMemoryUsage)(env, nullptr) == ERR_FATAL_NULL_POINTER);
+    (*_exports.DestroyEnvironment)(env);
+  }
+
+  {
+    Environment* env = (*_exports.CreateEnvironment)(2, 0, 0);
+    env->flags       = ENV_ENABLE_WAT;
+    env->loglevel    = LOG_FATAL;
+    env->memlimit    = 1 << 22;
+
+    int err[2];
+    (*_exports.AddModule)(env, LOCALS, sizeof(LOCALS), "locals", &err[0]);
+    (*_exports.AddModule)(env, MODULE, sizeof(MODULE) - 1, "memory", &err[1]);
+    (*_exports.FinalizeEnvironment)(env);
+    TEST(err[0] == ERR_FATAL_OUT_OF_MEMORY);
+    TEST(err[1] == ERR_SUCCESS); // Smaller allocations must still succeed after hitting the limit
+
+    MemoryUsage usage;
+    TEST((*_exports.GetMemoryUsage)(env, &usage) == ERR_SUCCESS);
+    TEST(usage.arena + usage.modules <= env->memlimit);
+    (*_exports.DestroyEnvironment)(env);
+  }
+}
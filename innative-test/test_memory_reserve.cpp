@@ -0,0 +1,79 @@
+// Copyright (c)2019 Black Sphere Studios
+// For conditions of distribution and use, see copyright notice in innative.h
+
+#include "test.h"
+#include "innative/export.h"
+
+void TestHarness::test_memory_reserve()
+{
+  // Each iteration writes to the last word of the memory, grows it either directly or through an indirect call, then
+  // reads the word back and writes to the new last word, so any stale memory pointer would read or write the wrong place.
+  static constexpr char MODULE[] =
+    "(module $reserve"
+    "\n  (type $grow (func (param i32) (result i32)))"
+    "\n  (memory 1 16)"
+    "\n  (table funcref (elem $grow))"
+    "\n  (func $grow (type $grow) (memory.grow (local.get 0)))"
+    "\n  (func $top (result i32) (i32.sub (i32.mul (memory.size) (i32.const 65536)) (i32.const 4)))"
+    "\n  (func (export \"grow_loop\") (param i32 i32) (result i32) (local i32 i32)"
+    "\n    (block"
+    "\n      (loop"
+    "\n        (br_if 1 (i32.eqz (local.get 0)))"
+    "\n        (local.set 2 (call $top))"
+    "\n        (i32.store (local.get 2) (local.get 0))"
+    "\n        (if (local.get 1)"
+    "\n          (then (drop (call_indirect (type $grow) (i32.const 1) (i32.const 0))))"
+    "\n          (else (drop (memory.grow (i32.const 1)))))"
+    "\n        (local.set 3 (i32.add (local.get 3) (i32.load (local.get 2))))"
+    "\n        (i32.store (call $top) (i32.const -1))"
+    "\n        (local.set 0 (i32.sub (local.get 0) (i32.const 1)))"
+    "\n        (br 0)))"
+    "\n    (local.get 3))"
+    "\n  (func (export \"grow\") (param i32) (result i32) (memory.grow (local.get 0)))"
+    "\n  (func (export \"size\") (result i32) (memory.size))"
+    "\n  (func (export \"load\") (param i32) (result i32) (i32.load (local.get 0)))"
+    "\n)";
+
+  // The default memory growth behaves exactly the same, so it's also compiled to check the results against
+  const uint64_t FLAGS[] = { 0, ENV_MEMORY_RESERVE };
+
+  for(uint64_t flags : FLAGS)
+  {
+    path dll_path  = _folder / "memory_reserve" IN_LIBRARY_EXTENSION;
+    void* assembly = CompileModule(MODULE, "reserve", ENV_CHECK_MEMORY_ACCESS | flags, ENV_OPTIMIZE_O3, dll_path);
+    if(assembly)
+    {
+      auto grow_loop = (int (*)(int, int))(*_exports.LoadFunction)(assembly, "reserve", "grow_loop");
+      auto grow      = (int (*)(int))(*_exports.LoadFunction)(assembly, "reserve", "grow");
+      auto size      = (int (*)())(*_exports.LoadFunction)(assembly, "reserve", "size");
+      auto load      = (int (*)(int))(*_exports.LoadFunction)(assembly, "reserve", "load");
+      TEST(grow_loop && grow && size && load);
+
+      if(grow_loop && grow && size && load)
+      {
+        TEST((*size)() == 1);
+        TEST((*grow_loop)(7, 0) == 7 * 8 / 2);
+        TEST((*size)() == 8);
+        TEST((*grow_loop)(7, 1) == 7 * 8 / 2);
+        TEST((*size)() == 15);
+
+        // Every page boundary still holds the value written before the memory grew past it
+        TEST((*load)(65536 - 4) == 7);
+        TEST((*load)(65536 * 7 - 4) == 1);
+        TEST((*load)(65536 * 8 - 4) == 7);
+        TEST((*load)(65536 * 14 - 4) == 1);
+        TEST((*load)(65536 * 15 - 4) == -1);
+
+        TEST((*grow)(2) == -1); // Can't grow past the declared maximum
+        TEST((*grow)(1) == 15);
+        TEST((*size)() == 16);
+        TEST((*load)(65536 * 15 - 4) == -1);
+        TEST((*load)(65536 * 16 - 4) == 0);
+      }
+
+      (*_exports.FreeAssembly)(assembly);
+    }
+
+    remove(dll_path);
+  }
+}
@@ -0,0 +1,75 @@
+// Copyright (c)2019 Black Sphere Studios
+// For conditions of distribution and use, see copyright notice in innative.h
+
+#include "test.h"
+#include "innative/export.h"
+#include <map>
+
+void TestHarness::test_object_cache()
+{
+  // (func (export "get") (result i32) (i32.const 42)), which must be a binary module so parsing it can be skipped
+  static constexpr uint8_t MODULE[] = { 0x00, 0x61, 0x73, 0x6d, 0x01, 0x00, 0x00, 0x00, 0x01, 0x05, 0x01, 0x60,
+                                        0x00, 0x01, 0x7f, 0x03, 0x02, 0x01, 0x00, 0x07, 0x07, 0x01, 0x03, 0x67,
+                                        0x65, 0x74, 0x00, 0x00, 0x0a, 0x06, 0x01, 0x04, 0x00, 0x41, 0x2a, 0x0b };
+  static constexpr size_t CONSTANT = sizeof(MODULE) - 2; // The value that i32.const returns
+
+  path cache            = _folder / "object_cache";
+  path dll_path         = _folder / "object_cache" IN_LIBRARY_EXTENSION;
+  std::string cachepath = cache.u8string();
+  std::error_code ec;
+  remove_all(cache, ec);
+
+  // Returns what the compiled function returns, or -1 if it failed to compile
+  auto run = [&](const uint8_t* module, uint64_t optimize) -> int {
+    void* assembly = CompileModules({ { module, sizeof(MODULE), "cache" } }, 0, optimize, dll_path,
+                                    [&](Environment* env) { env->cachepath = cachepath.c_str(); });
+    int result = -1;
+    if(assembly)
+    {
+      auto get = (int (*)())(*_exports.LoadFunction)(assembly, "cache", "get");
+      TEST(get);
+      if(get)
+        result = (*get)();
+      (*_exports.FreeAssembly)(assembly);
+    }
+    remove(dll_path);
+    return result;
+  };
+
+  // Every file in the cache and when it was last written, which tells reusing objects apart from writing them again
+  auto snapshot = [&]() {
+    std::map<path, file_time_type> files;
+    for(auto& entry : recursive_directory_iterator(cache, ec))
+      files[entry.path()] = last_write_time(entry.path(), ec);
+    return files;
+  };
+
+  // Each directory in the cache holds the objects for a single set of inputs
+  auto entries = [&]() {
+    size_t n = 0;
+    for(auto& entry : directory_iterator(cache, ec))
+      n += is_directory(entry.path(), ec);
+    return n;
+  };
+
+  TEST(run(MODULE, ENV_OPTIMIZE_O3) == 42);
+  TEST(entries() == 1);
+
+  // The second compile must link the objects that the first one left behind without generating them again
+  auto cold = snapshot();
+  TEST(!cold.empty());
+  TEST(run(MODULE, ENV_OPTIMIZE_O3) == 42);
+  TEST(snapshot() == cold);
+
+  // Changing a single byte of the module or the optimization level must miss the cache
+  uint8_t changed[sizeof(MODULE)];
+  memcpy(changed, MODULE, sizeof(MODULE));
+  changed[CONSTANT] = 43;
+  TEST(run(changed, ENV_OPTIMIZE_O3) == 43);
+  TEST(entries() == 2);
+
+  TEST(run(MODULE, ENV_OPTIMIZE_O0) == 42);
+  TEST(entries() == 3);
+
+  remove_all(cache, ec);
+}
@@ -0,0 +1,113 @@
+// Copyright (c)2019 Black Sphere Studios
+// For conditions of distribution and use, see copyright notice in innative.h
+
+#include "test.h"
+#include "innative/export.h"
+#include <fstream>
+#include <sstream>
+
+// Checks whether a function in a printed LLVM module is marked optnone, which is how lower optimization levels are kept
+static bool HasOptNone(const std::string& ir, const std::string& fn)
+{
+  std::string group;
+  std::istringstream lines(ir);
+  for(std::string line; std::getline(lines, line);)
+  {
+    size_t name = line.find("@\"" + fn + "\"(");
+    if(!line.compare(0, 7, "define ") && name != std::string::npos)
+    {
+      size_t hash = line.find(" #", line.find(')', name));
+      if(hash == std::string::npos)
+        return false;
+      group = "attributes " + line.substr(hash + 1, line.find(' ', hash + 1) - hash - 1) + " = {";
+    }
+    else if(!group.empty() && !line.compare(0, group.size(), group))
+      return line.find("optnone") != std::string::npos;
+  }
+  return false;
+}
+
+void TestHarness::test_optimize()
+{
+  static constexpr char MODULE[] =
+    "(module $hints"
+    "\n  (func $helper (param i32) (result i32)"
+    "\n    (i32.add (i32.mul (local.get 0) (i32.const 3)) (i32.const 1)))"
+    "\n  (func (export \"sum\") (param i32) (result i32) (local i32)"
+    "\n    (block"
+    "\n      (loop"
+    "\n        (br_if 1 (i32.eqz (local.get 0)))"
+    "\n        (local.set 1 (i32.add (local.get 1) (call $helper (local.get 0))))"
+    "\n        (local.set 0 (i32.sub (local.get 0) (i32.const 1)))"
+    "\n        (br 0)))"
+    "\n    (local.get 1))"
+    "\n  (func (export \"fib\") (param i32) (result i32)"
+    "\n    (if (result i32) (i32.lt_u (local.get 0) (i32.const 2))"
+    "\n      (then (local.get 0))"
+    "\n      (else (i32.add (call 2 (i32.sub (local.get 0) (i32.const 1)))"
+    "\n                     (call 2 (i32.sub (local.get 0) (i32.const 2)))))))"
+    "\n)";
+
+  // Each case is the environment's level followed by the levels of helper, sum, and fib
+  const uint64_t LEVELS[][4] = {
+    { ENV_OPTIMIZE_O1, ENV_OPTIMIZE_O0, ENV_OPTIMIZE_O3, ENV_OPTIMIZE_Os },
+    { ENV_OPTIMIZE_O0, ENV_OPTIMIZE_BASELINE, ENV_OPTIMIZE_O2, ENV_OPTIMIZE_O0 },
+    { ENV_OPTIMIZE_O3, ENV_OPTIMIZE_O1, ENV_OPTIMIZE_BASELINE, ENV_OPTIMIZE_O3 },
+  };
+
+  // Functions that end up below the level of the module pipeline keep optnone only if they are unoptimized or baseline
+  const bool OPTNONE[][3] = {
+    { true, false, false },
+    { true, false, true },
+    { false, true, false },
+  };
+
+  for(size_t i = 0; i < sizeof(LEVELS) / sizeof(LEVELS[0]); ++i)
+  {
+    auto& levels  = LEVELS[i];
+    path dll_path = _folder / "hints" IN_LIBRARY_EXTENSION;
+    path ir_path  = _folder / "hints.llvm";
+
+    void* assembly = CompileModule(MODULE, "hints", ENV_EMIT_LLVM, levels[0], dll_path, [&](Environment* env) {
+      TEST((*_exports.AddOptimization)(env, "hints", "helper", levels[1]) == ERR_SUCCESS);
+      TEST((*_exports.AddOptimization)(env, "hints", "sum", levels[2]) == ERR_SUCCESS);
+      TEST((*_exports.AddOptimization)(env, "hints", "fib", levels[3]) == ERR_SUCCESS);
+      TEST((*_exports.AddOptimization)(env, "hints", "missing", ENV_OPTIMIZE_O3) == ERR_SUCCESS);
+      TEST((*_exports.AddOptimization)(env, nullptr, "fib", ENV_OPTIMIZE_O3) == ERR_PARSE_INVALID_NAME);
+      TEST((*_exports.AddOptimization)(env, "hints", nullptr, ENV_OPTIMIZE_O3) == ERR_PARSE_INVALID_NAME);
+      TEST((*_exports.AddOptimization)(env, "hints", "fib", ENV_OPTIMIZE_OMASK) == ERR_UNKNOWN_FLAG);
+    });
+
+    std::stringstream ir;
+    ir << std::ifstream(ir_path.u8string()).rdbuf();
+    TEST(HasOptNone(ir.str(), "helper#1|hints") == OPTNONE[i][0]);
+    TEST(HasOptNone(ir.str(), "func#2|hints") == OPTNONE[i][1]);
+    TEST(HasOptNone(ir.str(), "func#3|hints") == OPTNONE[i][2]);
+
+    if(assembly)
+    {
+      auto sum = (int (*)(int))(*_exports.LoadFunction)(assembly, "hints", "sum");
+      auto fib = (int (*)(int))(*_exports.LoadFunction)(assembly, "hints", "fib");
+      TEST(sum != nullptr);
+      TEST(fib != nullptr);
+
+      if(sum)
+      {
+        TEST((*sum)(0) == 0);
+        TEST((*sum)(4) == 34);
+        TEST((*sum)(100) == 15250);
+      }
+      if(fib)
+      {
+        TEST((*fib)(1) == 1);
+        TEST((*fib)(10) == 55);
+        TEST((*fib)(20) == 6765);
+      }
+
+      (*_exports.FreeAssembly)(assembly);
+    }
+
+    remove(dll_path);
+    remove(ir_path);
+  }
+}
@@ -0,0 +1,74 @@
+// Copyright (c)2019 Black Sphere Studios
+// For conditions of distribution and use, see copyright notice in innative.h
+
+#include "test.h"
+#include "innative/export.h"
+#include <string>
+
+void TestHarness::test_parallel_codegen()
+{
+  // Enough functions for at least two partitions, each calling the one before it either directly or through the table,
+  // so almost every call and every access to the shared globals crosses from one partition into another.
+  static constexpr int FUNCTIONS = 600;
+
+  std::string module = "(module $codegen"
+                       "\n  (type $t (func (param i32) (result i32)))"
+                       "\n  (global $base i32 (i32.const 1000))"
+                       "\n  (global $count (mut i32) (i32.const 0))"
+                       "\n  (table funcref (elem";
+  for(int i = 0; i < FUNCTIONS; ++i)
+    module += " $f" + std::to_string(i);
+  module += "))"
+            "\n  (func $f0 (type $t)"
+            "\n    (global.set $count (i32.add (global.get $count) (i32.const 1)))"
+            "\n    (i32.add (local.get 0) (global.get $base)))";
+  for(int i = 1; i < FUNCTIONS; ++i)
+  {
+    std::string prev = std::to_string(i - 1);
+    std::string call = (i % 2) ? "call_indirect (type $t) (local.get 0) (i32.const " + prev + ")" :
+                                 "call $f" + prev + " (local.get 0)";
+    module += "\n  (func $f" + std::to_string(i) + " (type $t)" +
+              "\n    (global.set $count (i32.add (global.get $count) (i32.const 1)))" + "\n    (i32.add (i32.mul (" +
+              call + ") (i32.const 3)) (i32.const " + std::to_string(i) + ")))";
+  }
+  module += "\n  (func (export \"run\") (param i32) (result i32) (call $f" + std::to_string(FUNCTIONS - 1) +
+            " (local.get 0)))"
+            "\n  (func (export \"count\") (result i32) (global.get $count))"
+            "\n)";
+
+  uint32_t expected = 7 + 1000;
+  for(uint32_t i = 1; i < FUNCTIONS; ++i)
+    expected = expected * 3 + i;
+
+  const uint64_t FLAGS[][2] = { { ENV_PARALLEL_CODEGEN, ENV_OPTIMIZE_O0 },
+                                { ENV_PARALLEL_CODEGEN, ENV_OPTIMIZE_O3 },
+                                { ENV_PARALLEL_CODEGEN | ENV_LINK_IN_MEMORY, ENV_OPTIMIZE_O3 } };
+
+  for(auto& flags : FLAGS)
+  {
+    path dll_path = _folder / "parallel_codegen" IN_LIBRARY_EXTENSION;
+
+    // Two threads split the module into two partitions, since it has more than twice the minimum number of functions
+    void* assembly = CompileModules({ { module.data(), module.size(), "codegen" } }, flags[0], flags[1], dll_path,
+                                    nullptr, 2);
+    if(assembly)
+    {
+      auto run   = (int (*)(int))(*_exports.LoadFunction)(assembly, "codegen", "run");
+      auto count = (int (*)())(*_exports.LoadFunction)(assembly, "codegen", "count");
+      TEST(run && count);
+
+      if(run && count)
+      {
+        TEST((*count)() == 0);
+        TEST((uint32_t)(*run)(7) == expected);
+        TEST((*count)() == FUNCTIONS);
+        TEST((uint32_t)(*run)(7) == expected);
+        TEST((*count)() == FUNCTIONS * 2);
+      }
+
+      (*_exports.FreeAssembly)(assembly);
+    }
+
+    remove(dll_path);
+  }
+}
@@ -0,0 +1,59 @@
+// Copyright (c)2019 Black Sphere Studios
+// For conditions of distribution and use, see copyright notice in innative.h
+
+#include "test.h"
+#include "innative/export.h"
+
+void TestHarness::test_parallel_compile()
+{
+  static constexpr char FIRST[] = "(module $first"
+                                  "\n  (memory (export \"memory\") 1)"
+                                  "\n  (global (export \"base\") i32 (i32.const 5))"
+                                  "\n  (func (export \"scale\") (param i32) (result i32)"
+                                  "\n    (i32.mul (local.get 0) (i32.const 3)))"
+                                  "\n  (func (export \"peek\") (result i32)"
+                                  "\n    (i32.load (i32.const 16)))"
+                                  "\n)";
+
+  static constexpr char SECOND[] = "(module $second"
+                                   "\n  (import \"first\" \"memory\" (memory 1))"
+                                   "\n  (import \"first\" \"base\" (global i32))"
+                                   "\n  (import \"first\" \"scale\" (func $scale (param i32) (result i32)))"
+                                   "\n  (func (export \"run\") (param i32) (result i32)"
+                                   "\n    (i32.store (i32.const 16) (call $scale (local.get 0)))"
+                                   "\n    (i32.add (i32.load (i32.const 16)) (global.get 0)))"
+                                   "\n)";
+
+  // Each module has its own LLVM context, and calls across them must work no matter how they were compiled or linked
+  const uint64_t FLAGS[][2] = { { 0, ENV_OPTIMIZE_O0 },
+                                { ENV_MULTITHREADED, ENV_OPTIMIZE_O0 },
+                                { ENV_MULTITHREADED, ENV_OPTIMIZE_O3 },
+                                { ENV_LTO, ENV_OPTIMIZE_O3 },
+                                { ENV_LTO | ENV_MULTITHREADED, ENV_OPTIMIZE_O3 } };
+
+  for(auto& flags : FLAGS)
+  {
+    path dll_path  = _folder / "parallel_compile" IN_LIBRARY_EXTENSION;
+    void* assembly = CompileModules({ { FIRST, sizeof(FIRST) - 1, "first" }, { SECOND, sizeof(SECOND) - 1, "second" } },
+                                    flags[0], flags[1], dll_path);
+    if(assembly)
+    {
+      auto run  = (int (*)(int))(*_exports.LoadFunction)(assembly, "second", "run");
+      auto peek = (int (*)())(*_exports.LoadFunction)(assembly, "first", "peek");
+      TEST(run != nullptr);
+      TEST(peek != nullptr);
+
+      if(run && peek)
+      {
+        TEST((*run)(4) == 17);
+        TEST((*peek)() == 12);
+        TEST((*run)(10) == 35);
+        TEST((*peek)() == 30); // Both modules must share the same linear memory
+      }
+
+      (*_exports.FreeAssembly)(assembly);
+    }
+
+    remove(dll_path);
+  }
+}
@@ -49,4 +49,49 @@ void TestHarness::test_stream()
   s.pos = 15;
   TEST(!s.End());
   TEST(s.ReadVarUInt32(err) == 9);
+
+  uint8_t u64[] = { 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x80, 0x01 };
+  s             = { u64, sizeof(u64), 0 };
+  TEST(s.ReadVarUInt64(err) == (1ULL << 63));
+  TEST(err == ERR_SUCCESS);
+  s.pos = 0;
+  TEST(s.ReadVarUInt32(err) == 0);
+  TEST(err == ERR_FATAL_OVERLONG_ENCODING);
+
+  uint8_t s64[] = { 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0x7F, 0xC0, 0xBB, 0x78, 0x80, 0x7F };
+  s             = { s64, sizeof(s64), 0 };
+  TEST(s.ReadVarInt64(err) == -1);
+  TEST(s.ReadVarInt32(err) == -123456);
+  TEST(s.ReadVarInt32(err) == -128);
+  TEST(s.End());
+
+  uint8_t overlong[] = { 0xFF, 0xFF, 0xFF, 0xFF, 0x7F };
+  s                  = { overlong, sizeof(overlong), 0 };
+  s.ReadVarUInt32(err);
+  TEST(err == ERR_FATAL_INVALID_ENCODING);
+  s.pos = 0;
+  TEST(s.ReadVarUInt64(err) == 0x7FFFFFFFFULL);
+
+  std::vector<uint8_t> leb;
+  std::vector<varuint32> values;
+  for(varuint32 i = 0; i < 200; ++i)
+  {
+    varuint32 v = (i % 5) ? i : (i * 2654435761U);
+    values.push_back(v);
+    do
+    {
+      leb.push_back((v & 0x7F) | (v > 0x7F ? 0x80 : 0));
+      v >>= 7;
+    } while(v != 0);
+  }
+
+  std::vector<varuint32> decoded(values.size() + 1);
+  s = { leb.data(), leb.size(), 0 };
+  s.ReadVarUInt32Array(decoded.data(), values.size(), err);
+  TEST(err == ERR_SUCCESS);
+  TEST(s.End());
+  TEST(!memcmp(decoded.data(), values.data(), values.size() * sizeof(varuint32)));
+  s.pos = 0;
+  s.ReadVarUInt32Array(decoded.data(), decoded.size(), err);
+  TEST(err == ERR_PARSE_UNEXPECTED_EOF);
 }
\ No newline at end of file
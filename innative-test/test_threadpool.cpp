@@ -0,0 +1,42 @@
+// Copyright (c)2019 Black Sphere Studios
+// For conditions of distribution and use, see copyright notice in innative.h
+
+#include "../innative/threadpool.h"
+#include "test.h"
+#include <atomic>
+
+void TestHarness::test_threadpool()
+{
+  for(unsigned int threads : { 1, 2, 0 })
+  {
+    std::atomic_size_t count(0);
+    {
+      IN_WASM_THREADPOOL pool(threads);
+      TEST(pool.Size() > 0);
+
+      auto f = pool.Submit([&]() { ++count; });
+      pool.Wait(f);
+      TEST(count.load() == 1);
+
+      // Tasks that wait on other tasks must not deadlock, even with a single thread
+      auto nested = pool.Submit([&]() {
+        std::vector<std::future<void>> tasks;
+        for(int i = 0; i < 10; ++i)
+          tasks.push_back(pool.Submit([&]() { ++count; }));
+        for(auto& t : tasks)
+          pool.Wait(t);
+      });
+      pool.Wait(nested);
+      TEST(count.load() == 11);
+
+      for(int i = 0; i < 100; ++i)
+        pool.Defer([&]() { pool.Defer([&]() { ++count; }); });
+      pool.WaitDeferred();
+      TEST(count.load() == 111);
+
+      for(int i = 0; i < 100; ++i)
+        pool.Defer([&]() { ++count; });
+    }
+    TEST(count.load() == 211); // Destroying the pool finishes all remaining tasks
+  }
+}
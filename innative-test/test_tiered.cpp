@@ -0,0 +1,85 @@
+// Copyright (c)2019 Black Sphere Studios
+// For conditions of distribution and use, see copyright notice in innative.h
+
+#include "test.h"
+#include "innative/export.h"
+#include <chrono>
+#include <string>
+#include <thread>
+
+void TestHarness::test_tiered()
+{
+  static constexpr char MODULE[] =
+    "(module $tiered"
+    "\n  (func $step (param i32 i32) (result i32)"
+    "\n    (i32.add (i32.mul (local.get 0) (i32.const 31)) (i32.mul (local.get 1) (local.get 1))))"
+    "\n  (func $sum (export \"sum\") (param i32) (result i32) (local i32)"
+    "\n    (block"
+    "\n      (loop"
+    "\n        (br_if 1 (i32.eqz (local.get 0)))"
+    "\n        (local.set 1 (call $step (local.get 1) (local.get 0)))"
+    "\n        (local.set 0 (i32.sub (local.get 0) (i32.const 1)))"
+    "\n        (br 0)))"
+    "\n    (local.get 1))"
+    "\n)";
+
+  static constexpr int N = 100000; // Enough loop iterations to make sum hot during the first call
+
+  uint32_t expected = 0;
+  for(uint32_t i = N; i > 0; --i)
+    expected = expected * 31 + i * i;
+
+  path log_path = _folder / "tiered.log";
+  FILE* log     = nullptr;
+  FOPEN(log, log_path.c_str(), "wb");
+  TEST(log != nullptr);
+  if(!log)
+    return;
+
+  void* assembly = CompileModule(MODULE, "tiered", ENV_TIERED_COMPILE, ENV_OPTIMIZE_O3, path(), [&](Environment* env) {
+    env->loglevel = LOG_NOTICE;
+    env->log      = log;
+  });
+  if(assembly)
+  {
+    auto sum = (int (*)(int))(*_exports.LoadFunction)(assembly, "tiered", "sum");
+    TEST(sum != nullptr);
+
+    if(sum)
+    {
+      // The optimized version is compiled in the background, so keep calling until the switch has been logged
+      bool tiered = false;
+      auto start  = std::chrono::steady_clock::now();
+      while(!tiered && std::chrono::steady_clock::now() - start < std::chrono::seconds(30))
+      {
+        TEST((uint32_t)(*sum)(N) == expected);
+
+        FILE* f = nullptr;
+        FOPEN(f, log_path.c_str(), "rb");
+        if(f)
+        {
+          std::string text;
+          char buf[256];
+          for(size_t n; (n = fread(buf, 1, sizeof(buf), f)) > 0;)
+            text.append(buf, n);
+          fclose(f);
+          for(size_t i = text.find("Tiered up "); !tiered && i != std::string::npos; i = text.find("Tiered up ", i + 1))
+            tiered = text.substr(i, text.find('\n', i) - i).find("sum") != std::string::npos;
+        }
+        if(!tiered)
+          std::this_thread::sleep_for(std::chrono::milliseconds(10));
+      }
+      TEST(tiered);
+
+      for(int i = 0; i < 10; ++i)
+        TEST((uint32_t)(*sum)(N) == expected);
+      TEST((*sum)(0) == 0);
+      TEST((*sum)(1) == 1);
+    }
+
+    (*_exports.FreeAssembly)(assembly);
+  }
+
+  fclose(log);
+  remove(log_path);
+}
@@ -0,0 +1,133 @@
+// Copyright (c)2019 Black Sphere Studios
+// For conditions of distribution and use, see copyright notice in innative.h
+
+#include "test.h"
+#include "innative/export.h"
+#include <algorithm>
+#include <vector>
+
+void TestHarness::test_validation()
+{
+  // (func (i32.const 1) drop), with the last byte of the body being the drop instruction
+  static constexpr uint8_t VALID[] = { 0x00, 0x61, 0x73, 0x6d, 0x01, 0x00, 0x00, 0x00, 0x01, 0x04, 0x01, 0x60, 0x00,
+                                       0x00, 0x03, 0x02, 0x01, 0x00, 0x0a, 0x07, 0x01, 0x05, 0x00, 0x41, 0x01, 0x1a,
+                                       0x0b };
+
+  // Fused validation must report exactly the same errors that a separate validation pass does
+  const uint64_t FLAGS[] = { 0, ENV_FUSED_VALIDATION, ENV_FUSED_VALIDATION | ENV_LAZY_DECODE,
+                             ENV_FUSED_VALIDATION | ENV_MULTITHREADED };
+
+  for(auto flags : FLAGS)
+  {
+    for(int invalid = 0; invalid < 2; ++invalid)
+    {
+      uint8_t module[sizeof(VALID)];
+      memcpy(module, VALID, sizeof(VALID));
+      if(invalid)
+        module[sizeof(VALID) - 2] = 0x01; // Replace drop with nop, which leaves a value on the stack of a void function
+
+      Environment* env = (*_exports.CreateEnvironment)(1, 0, 0);
+      env->flags       = flags;
+      env->loglevel    = LOG_FATAL;
+
+      int err;
+      (*_exports.AddModule)(env, module, sizeof(module), "validation", &err);
+      TEST((*_exports.FinalizeEnvironment)(env) == ERR_SUCCESS);
+      TEST(err == ERR_SUCCESS);
+
+      if(!invalid)
+      {
+        TEST((*_exports.Validate)(env) == ERR_SUCCESS);
+        TEST(!env->errors);
+      }
+      else
+      {
+        TEST((*_exports.Validate)(env) == ERR_VALIDATION_ERROR);
+        TEST(env->errors != nullptr);
+        if(env->errors)
+        {
+          TEST(env->errors->code == ERR_INVALID_BLOCK_SIGNATURE);
+          TEST(!env->errors->next);
+        }
+      }
+
+      (*_exports.DestroyEnvironment)(env);
+    }
+  }
+
+  // Large modules are parsed and validated in parallel, which must report the same errors as a serial run. Each case
+  // generates a module with enough bodies to be split across threads and replaces two bodies in the middle of it.
+  static constexpr varuint32 BODIES = 300;
+  static const std::vector<uint8_t> VALID_BODY    = { 0x05, 0x00, 0x41, 0x01, 0x1a, 0x0b }; // (i32.const 1) drop
+  static const std::vector<uint8_t> UNKNOWN_BODY  = { 0x05, 0x00, 0x41, 0x01, 0xff, 0x0b }; // Unknown opcode
+  static const std::vector<uint8_t> RESERVED_BODY = { 0x05, 0x00, 0x3f, 0x01, 0x1a, 0x0b }; // memory.size 1
+  static const std::vector<uint8_t> INVALID_BODY  = { 0x05, 0x00, 0x41, 0x01, 0x01, 0x0b }; // Leaves an i32 behind
+
+  struct BodyCase
+  {
+    varuint32 first;
+    const std::vector<uint8_t>& a;
+    varuint32 second;
+    const std::vector<uint8_t>& b;
+  };
+  const BodyCase CASES[] = { { 150, UNKNOWN_BODY, 200, RESERVED_BODY },
+                             { 150, RESERVED_BODY, 200, UNKNOWN_BODY },
+                             { 100, INVALID_BODY, 250, INVALID_BODY } };
+
+  auto leb = [](std::vector<uint8_t>& out, varuint32 v) {
+    do
+    {
+      out.push_back((v & 0x7F) | (v > 0x7F ? 0x80 : 0));
+      v >>= 7;
+    } while(v);
+  };
+
+  for(auto& c : CASES)
+  {
+    std::vector<uint8_t> funcs;
+    leb(funcs, BODIES);
+    funcs.insert(funcs.end(), BODIES, 0x00);
+
+    std::vector<uint8_t> code;
+    leb(code, BODIES);
+    for(varuint32 i = 0; i < BODIES; ++i)
+    {
+      auto& body = (i == c.first) ? c.a : (i == c.second) ? c.b : VALID_BODY;
+      code.insert(code.end(), body.begin(), body.end());
+    }
+
+    std::vector<uint8_t> module(VALID, VALID + 14); // Header and type section
+    module.push_back(0x03);
+    leb(module, (varuint32)funcs.size());
+    module.insert(module.end(), funcs.begin(), funcs.end());
+    module.push_back(0x0a);
+    leb(module, (varuint32)code.size());
+    module.insert(module.end(), code.begin(), code.end());
+
+    int results[2];
+    std::vector<int> errors[2];
+    const uint64_t THREADING[2] = { 0, ENV_MULTITHREADED };
+
+    for(int i = 0; i < 2; ++i)
+    {
+      Environment* env = (*_exports.CreateEnvironment)(1, 4, 0);
+      env->flags       = THREADING[i];
+      env->loglevel    = LOG_FATAL;
+
+      (*_exports.AddModule)(env, module.data(), module.size(), "parallel", &results[i]);
+      (*_exports.FinalizeEnvironment)(env);
+      if(results[i] == ERR_SUCCESS)
+        results[i] = (*_exports.Validate)(env);
+
+      for(ValidationError* e = env->errors; e != nullptr; e = e->next)
+        errors[i].push_back(e->code);
+      std::sort(errors[i].begin(), errors[i].end()); // Bodies validated in parallel report errors in any order
+
+      (*_exports.DestroyEnvironment)(env);
+    }
+
+    TEST(results[0] != ERR_SUCCESS);
+    TEST(results[0] == results[1]);
+    TEST(errors[0] == errors[1]);
+  }
+}
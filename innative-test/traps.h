@@ -0,0 +1,42 @@
+// Copyright (c)2019 Black Sphere Studios
+// For conditions of distribution and use, see copyright notice in innative.h
+
+#ifndef IN__TRAPS_H
+#define IN__TRAPS_H
+
+#include "test.h"
+#include <signal.h>
+#include <setjmp.h>
+
+#ifdef IN_PLATFORM_WIN32
+#include "../innative/win32.h"
+#else
+static sigjmp_buf trap_jump;
+
+static void TrapHandler(int) { siglongjmp(trap_jump, 1); }
+#endif
+
+// Returns true if the call raised the illegal instruction that every webassembly trap does
+template<typename R, typename... Args> static bool Traps(R (*f)(Args...), Args... args)
+{
+#ifdef IN_COMPILER_MSC
+  __try
+  {
+    (*f)(args...);
+  }
+  __except(GetExceptionCode() == EXCEPTION_ILLEGAL_INSTRUCTION)
+  {
+    return true;
+  }
+  return false;
+#else
+  signal(SIGILL, TrapHandler);
+  bool trapped = sigsetjmp(trap_jump, 1) != 0;
+  if(!trapped)
+    (*f)(args...);
+  signal(SIGILL, SIG_DFL);
+  return trapped;
+#endif
+}
+
+#endif
@@ -0,0 +1,246 @@
+// Copyright (c)2019 Black Sphere Studios
+// For conditions of distribution and use, see copyright notice in innative.h
+
+#include "body.h"
+#include "parse.h"
+#include "util.h"
+
+using namespace innative;
+using namespace utility;
+
+namespace innative {
+  namespace internal {
+    IN_FORCEINLINE uint8_t* EncodeVarUInt(uint8_t* out, uint64_t v)
+    {
+      do
+      {
+        uint8_t byte = v & 0x7F;
+        v >>= 7;
+        *out++ = byte | (v != 0 ? 0x80 : 0);
+      } while(v != 0);
+      return out;
+    }
+
+    IN_FORCEINLINE uint8_t* EncodeVarInt(uint8_t* out, int64_t v)
+    {
+      for(;;)
+      {
+        uint8_t byte = v & 0x7F;
+        v >>= 7; // Arithmetic shift, so v eventually becomes 0 or -1
+        if((v == 0 && !(byte & 0x40)) || (v == -1 && (byte & 0x40)))
+        {
+          *out++ = byte;
+          return out;
+        }
+        *out++ = byte | 0x80;
+      }
+    }
+
+    IN_FORCEINLINE uint8_t* EncodePaddedVarUInt(uint8_t* out, varuint32 v)
+    {
+      for(size_t i = 1; i < PATCH_ENCODED_SIZE; ++i, v >>= 7)
+        *out++ = (v & 0x7F) | 0x80;
+      *out++ = v & 0x7F;
+      return out;
+    }
+
+    template<class T> IN_FORCEINLINE uint8_t* EncodeRaw(uint8_t* out, T v)
+    {
+      memcpy(out, &v, sizeof(T));
+      return out + sizeof(T);
+    }
+
+    // Grows an array allocated from the greedy allocator in power of two chunks, never freeing the old array.
+    template<class T> inline T* GrowArray(const Environment& env, T* a, size_t size, size_t required)
+    {
+      size_t capacity = !size ? 0 : NextPow2((varuint32)size);
+      if(required <= capacity && a != nullptr)
+        return a;
+
+      T* n = tmalloc<T>(env, NextPow2((varuint32)required));
+      if(n != nullptr && a != nullptr)
+        tmemcpy<T>(n, NextPow2((varuint32)required), a, size);
+      return n;
+    }
+  }
+}
+
+size_t innative::MaxEncodedSize(const Instruction& ins)
+{
+  if(ins.opcode == OP_br_table)
+    return MAX_ENCODED_INSTRUCTION + (ins.immediates[0].n_table * PATCH_ENCODED_SIZE);
+  return MAX_ENCODED_INSTRUCTION;
+}
+
+size_t innative::EncodeInstruction(uint8_t* out, const Instruction& ins, bool pad)
+{
+  uint8_t* start = out;
+  *out++         = ins.opcode;
+
+  switch(ins.opcode)
+  {
+  case OP_block:
+  case OP_loop:
+  case OP_if: *out++ = static_cast<uint8_t>(ins.immediates[0]._varsint7); break;
+  case OP_br:
+  case OP_br_if:
+  case OP_local_get:
+  case OP_local_set:
+  case OP_local_tee:
+  case OP_global_get:
+  case OP_global_set:
+  case OP_call:
+    out = pad ? internal::EncodePaddedVarUInt(out, ins.immediates[0]._varuint32) :
+                internal::EncodeVarUInt(out, ins.immediates[0]._varuint32);
+    break;
+  case OP_call_indirect: // Reserved immediates must be 0 or parsing would have failed, so they aren't stored
+    out = internal::EncodeVarUInt(out, ins.immediates[0]._varuint32);
+    break;
+  case OP_i32_const: out = internal::EncodeVarInt(out, ins.immediates[0]._varsint32); break;
+  case OP_i64_const: out = internal::EncodeVarInt(out, ins.immediates[0]._varsint64); break;
+  case OP_f32_const: out = internal::EncodeRaw<float32>(out, ins.immediates[0]._float32); break;
+  case OP_f64_const: out = internal::EncodeRaw<float64>(out, ins.immediates[0]._float64); break;
+  case OP_br_table:
+    out = internal::EncodeVarUInt(out, ins.immediates[0].n_table);
+    for(varuint32 i = 0; i < ins.immediates[0].n_table; ++i)
+      out = internal::EncodeVarUInt(out, ins.immediates[0].table[i]);
+    out = internal::EncodeVarUInt(out, ins.immediates[1]._varuint32);
+    break;
+  case OP_i32_load:
+  case OP_i64_load:
+  case OP_f32_load:
+  case OP_f64_load:
+  case OP_i32_store:
+  case OP_i64_store:
+  case OP_f32_store:
+  case OP_f64_store:
+  case OP_i32_load8_s:
+  case OP_i32_load16_s:
+  case OP_i64_load8_s:
+  case OP_i64_load16_s:
+  case OP_i64_load32_s:
+  case OP_i32_load8_u:
+  case OP_i32_load16_u:
+  case OP_i64_load8_u:
+  case OP_i64_load16_u:
+  case OP_i64_load32_u:
+  case OP_i32_store8:
+  case OP_i32_store16:
+  case OP_i64_store8:
+  case OP_i64_store16:
+  case OP_i64_store32:
+    out = internal::EncodeVarUInt(out, ins.immediates[0]._varuint32);
+    out = internal::EncodeVarUInt(out, ins.immediates[1]._varuptr);
+    break;
+  }
+
+  return out - start;
+}
+
+IN_ERROR innative::AppendInstruction(const Environment& env, FunctionBody& f, const Instruction& ins, varuint32* patch)
+{
+  uint8_t* body = internal::GrowArray<uint8_t>(env, f.body, f.n_bytes, f.n_bytes + MaxEncodedSize(ins));
+  if(!body)
+    return ERR_FATAL_OUT_OF_MEMORY;
+  f.body = body;
+
+  if(env.flags & ENV_DEBUG)
+  {
+    unsigned int* lines = internal::GrowArray<unsigned int>(env, f.lines, f.n_body * 2, (f.n_body + 1) * 2);
+    if(!lines)
+      return ERR_FATAL_OUT_OF_MEMORY;
+    f.lines                   = lines;
+    f.lines[f.n_body * 2]     = ins.line;
+    f.lines[f.n_body * 2 + 1] = ins.column;
+  }
+
+  if(patch)
+    *patch = f.n_bytes + 1; // The immediate always follows the opcode
+  f.n_bytes += (varuint32)EncodeInstruction(f.body + f.n_bytes, ins, patch != nullptr);
+  ++f.n_body;
+  return ERR_SUCCESS;
+}
+
+void innative::PatchInstruction(FunctionBody& f, varuint32 offset, varuint32 value)
+{
+  assert(offset + PATCH_ENCODED_SIZE <= f.n_bytes);
+  internal::EncodePaddedVarUInt(f.body + offset, value);
+}
+
+IN_ERROR BodyReader::ReadBinary(Instruction& ins)
+{
+  Stream s     = { const_cast<uint8_t*>(pos), static_cast<size_t>(end - pos), 0 };
+  IN_ERROR err = ParseInstruction(s, ins, env, table); // Decode br_table targets into our own buffer
+
+  pos += s.pos;
+  return err;
+}
+
+IN_ERROR BodyReader::Read(Instruction& ins)
+{
+  if(binary)
+    return ReadBinary(ins);
+
+  ins.opcode                   = *pos++;
+  ins.line                     = !lines ? 0 : lines[index * 2];
+  ins.column                   = !lines ? 0 : lines[index * 2 + 1];
+  ins.immediates[0]._varuint64 = 0;
+  ins.immediates[1]._varuint64 = 0;
+  ++index;
+
+  switch(ins.opcode)
+  {
+  case OP_block:
+  case OP_loop:
+  case OP_if: ins.immediates[0]._varsint7 = static_cast<varsint7>(*pos++); break;
+  case OP_br:
+  case OP_br_if:
+  case OP_local_get:
+  case OP_local_set:
+  case OP_local_tee:
+  case OP_global_get:
+  case OP_global_set:
+  case OP_call: ins.immediates[0]._varuint32 = static_cast<varuint32>(ReadVarUInt()); break;
+  case OP_call_indirect: ins.immediates[0]._varuint32 = static_cast<varuint32>(ReadVarUInt()); break;
+  case OP_i32_const: ins.immediates[0]._varsint32 = static_cast<varsint32>(ReadVarInt()); break;
+  case OP_i64_const: ins.immediates[0]._varsint64 = ReadVarInt(); break;
+  case OP_f32_const: ins.immediates[0]._float32 = ReadRaw<float32>(); break;
+  case OP_f64_const: ins.immediates[0]._float64 = ReadRaw<float64>(); break;
+  case OP_br_table:
+    table.resize(static_cast<size_t>(ReadVarUInt()));
+    for(auto& target : table)
+      target = static_cast<varuint32>(ReadVarUInt());
+    ins.immediates[0].n_table    = static_cast<varuint32>(table.size());
+    ins.immediates[0].table      = table.data();
+    ins.immediates[1]._varuint32 = static_cast<varuint32>(ReadVarUInt());
+    break;
+  case OP_i32_load:
+  case OP_i64_load:
+  case OP_f32_load:
+  case OP_f64_load:
+  case OP_i32_store:
+  case OP_i64_store:
+  case OP_f32_store:
+  case OP_f64_store:
+  case OP_i32_load8_s:
+  case OP_i32_load16_s:
+  case OP_i64_load8_s:
+  case OP_i64_load16_s:
+  case OP_i64_load32_s:
+  case OP_i32_load8_u:
+  case OP_i32_load16_u:
+  case OP_i64_load8_u:
+  case OP_i64_load16_u:
+  case OP_i64_load32_u:
+  case OP_i32_store8:
+  case OP_i32_store16:
+  case OP_i64_store8:
+  case OP_i64_store16:
+  case OP_i64_store32:
+    ins.immediates[0]._varuint32 = static_cast<varuint32>(ReadVarUInt());
+    ins.immediates[1]._varuptr   = ReadVarUInt();
+    break;
+  }
+
+  return ERR_SUCCESS;
+}
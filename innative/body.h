@@ -0,0 +1,109 @@
+// Copyright (c)2019 Black Sphere Studios
+// For conditions of distribution and use, see copyright notice in innative.h
+
+#ifndef IN__BODY_H
+#define IN__BODY_H
+
+#include "innative/schema.h"
+#include <string.h>
+#include <vector>
+
+namespace innative {
+  // Function bodies are stored as a compact instruction stream instead of an array of Instruction structs. Each opcode
+  // byte is followed only by the immediates that opcode actually has: integers are stored as canonical LEB128, floats
+  // as raw bytes, block signatures as a single byte, reserved bytes are dropped, and br_table stores its targets inline.
+  // Line and column numbers are kept in a separate array that only exists if ENV_DEBUG was set.
+
+  // Worst case encoded size of an instruction, excluding br_table targets
+  static const size_t MAX_ENCODED_INSTRUCTION = 1 + 10 + 10;
+  // Size of an immediate that is reserved so it can be patched later, see PatchInstruction
+  static const size_t PATCH_ENCODED_SIZE = 5;
+
+  // Encodes an instruction into out, which must have room for MaxEncodedSize(ins) bytes, and returns the number of bytes
+  // written. If pad is true, the first immediate is always PATCH_ENCODED_SIZE bytes long so it can be patched later.
+  size_t EncodeInstruction(uint8_t* out, const Instruction& ins, bool pad = false);
+  size_t MaxEncodedSize(const Instruction& ins);
+
+  // Appends an instruction to a body, growing the instruction stream (and the debug location array if ENV_DEBUG is set).
+  // If patch is not null, the first immediate is padded and its byte offset is returned in patch.
+  IN_ERROR AppendInstruction(const Environment& env, FunctionBody& f, const Instruction& ins, varuint32* patch = nullptr);
+
+  // Overwrites a padded immediate that was reserved by AppendInstruction
+  void PatchInstruction(FunctionBody& f, varuint32 offset, varuint32 value);
+
+  // Returns true if the body still points at the binary encoding in the module source, see ENV_LAZY_DECODE
+  IN_FORCEINLINE bool IsUndecodedBody(const FunctionBody& f) { return !f.n_body && f.n_bytes > 0; }
+
+  // Decodes instructions one at a time from a function body, which is either a compact instruction stream or, with
+  // ENV_LAZY_DECODE, the original binary encoding. br_table targets are decoded into a buffer owned by the reader, so
+  // they are only valid until the next call to Read.
+  struct BodyReader
+  {
+    BodyReader(const FunctionBody& body, const Environment& env) :
+      pos(body.body),
+      end(body.body + body.n_bytes),
+      lines(body.lines),
+      index(0),
+      binary(IsUndecodedBody(body)),
+      env(env)
+    {}
+
+    IN_FORCEINLINE bool End() const { return pos >= end; }
+
+    // Decodes the next instruction into ins. A compact instruction stream has already been parsed, so this can only
+    // fail when decoding the binary encoding, in which case it returns the same error ParseInstruction would have.
+    IN_ERROR Read(Instruction& ins);
+
+  protected:
+    IN_ERROR ReadBinary(Instruction& ins);
+
+    IN_FORCEINLINE uint64_t ReadVarUInt()
+    {
+      uint64_t r     = 0;
+      unsigned shift = 0;
+      uint8_t byte;
+      do
+      {
+        byte = *pos++;
+        r |= uint64_t(byte & 0x7F) << shift;
+        shift += 7;
+      } while(byte & 0x80);
+      return r;
+    }
+
+    IN_FORCEINLINE int64_t ReadVarInt()
+    {
+      uint64_t r     = 0;
+      unsigned shift = 0;
+      uint8_t byte;
+      do
+      {
+        byte = *pos++;
+        r |= uint64_t(byte & 0x7F) << shift;
+        shift += 7;
+      } while(byte & 0x80);
+
+      if(shift < 64 && (byte & 0x40))
+        r |= ~uint64_t(0) << shift;
+      return static_cast<int64_t>(r);
+    }
+
+    template<class T> IN_FORCEINLINE T ReadRaw()
+    {
+      T r;
+      memcpy(&r, pos, sizeof(T));
+      pos += sizeof(T);
+      return r;
+    }
+
+    const uint8_t* pos;
+    const uint8_t* end;
+    const unsigned int* lines;
+    varuint32 index;
+    bool binary;
+    const Environment& env;
+    std::vector<varuint32> table;
+  };
+}
+
+#endif
@@ -0,0 +1,344 @@
+// Copyright (c)2019 Black Sphere Studios
+// For conditions of distribution and use, see copyright notice in innative.h
+
+#include "bounds.h"
+#pragma warning(push)
+#pragma warning(disable : 4146 4267 4141 4244 4624)
+#include "llvm/IR/Dominators.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/Analysis/AssumptionCache.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/ScalarEvolution.h"
+#include "llvm/Analysis/ScalarEvolutionExpander.h"
+#include "llvm/Analysis/ScalarEvolutionExpressions.h"
+#include "llvm/Analysis/ValueTracking.h"
+#include "llvm/Support/KnownBits.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm/Transforms/Utils/LoopSimplify.h"
+#include "llvm/Transforms/Utils/LoopUtils.h"
+#pragma warning(pop)
+
+using namespace innative;
+
+namespace {
+  // A bounds check of the form "trap if index + offset > end", where end is the size of a linear memory
+  struct BoundsCheck
+  {
+    llvm::BranchInst* br;
+    llvm::BasicBlock* trap;
+    llvm::BasicBlock* cont;
+    llvm::Value* upper; // index + offset
+    llvm::Value* index;
+    uint64_t offset;
+    llvm::LoadInst* end;
+  };
+
+  bool IsTrapBlock(llvm::BasicBlock* bb)
+  {
+    // Dedicated loop exits are empty blocks that forward to the shared trap block, so follow a few of those
+    for(int i = 0; i < 4; ++i)
+    {
+      llvm::Instruction* inst = bb->getFirstNonPHIOrDbg();
+      if(auto call = llvm::dyn_cast_or_null<llvm::IntrinsicInst>(inst))
+        return call->getIntrinsicID() == llvm::Intrinsic::trap;
+      auto br = llvm::dyn_cast_or_null<llvm::BranchInst>(inst);
+      if(!br || !br->isUnconditional())
+        return false;
+      bb = br->getSuccessor(0);
+    }
+    return false;
+  }
+
+  // GetMemSize loads the size of a linear memory from the 8 bytes in front of it. The size only ever grows, so any
+  // earlier load of it is a safe lower bound for a later one.
+  llvm::LoadInst* GetMemSizeLoad(llvm::Value* v, const llvm::DataLayout& dl)
+  {
+    auto load = llvm::dyn_cast<llvm::LoadInst>(v);
+    if(!load || load->isVolatile() || !load->getType()->isIntegerTy(64))
+      return nullptr;
+
+    int64_t offset = 0;
+    llvm::GetPointerBaseWithConstantOffset(load->getPointerOperand(), offset, dl);
+    return offset == -8 ? load : nullptr;
+  }
+
+  bool MatchBoundsCheck(llvm::Instruction* term, BoundsCheck& check, const llvm::DataLayout& dl)
+  {
+    auto br = llvm::dyn_cast<llvm::BranchInst>(term);
+    if(!br || !br->isConditional())
+      return false;
+
+    auto cmp = llvm::dyn_cast<llvm::ICmpInst>(br->getCondition());
+    if(!cmp)
+      return false;
+
+    llvm::CmpInst::Predicate pred = cmp->getPredicate();
+    if(IsTrapBlock(br->getSuccessor(0)))
+    {
+      check.trap = br->getSuccessor(0);
+      check.cont = br->getSuccessor(1);
+    }
+    else if(IsTrapBlock(br->getSuccessor(1)))
+    {
+      check.trap = br->getSuccessor(1);
+      check.cont = br->getSuccessor(0);
+      pred       = llvm::CmpInst::getInversePredicate(pred);
+    }
+    else
+      return false;
+
+    if(pred == llvm::CmpInst::ICMP_UGT)
+    {
+      check.upper = cmp->getOperand(0);
+      check.end   = GetMemSizeLoad(cmp->getOperand(1), dl);
+    }
+    else if(pred == llvm::CmpInst::ICMP_ULT)
+    {
+      check.upper = cmp->getOperand(1);
+      check.end   = GetMemSizeLoad(cmp->getOperand(0), dl);
+    }
+    else
+      return false;
+
+    if(!check.end)
+      return false;
+
+    // Split the constant offset off the index so checks that only differ by their offset can be merged
+    check.br     = br;
+    check.index  = check.upper;
+    check.offset = 0;
+    while(auto add = llvm::dyn_cast<llvm::BinaryOperator>(check.index))
+    {
+      auto c = llvm::dyn_cast<llvm::ConstantInt>(add->getOperand(1));
+      if(add->getOpcode() != llvm::Instruction::Add || !c || c->getValue().getActiveBits() > 32)
+        break;
+      check.offset += c->getZExtValue();
+      check.index = add->getOperand(0);
+    }
+
+    return true;
+  }
+
+  // Removes the trapping edge of a check, leaving an unconditional branch to its continuation
+  void RemoveBoundsCheck(BoundsCheck& check, llvm::DominatorTree* dt)
+  {
+    llvm::BasicBlock* bb = check.br->getParent();
+    check.trap->removePredecessor(bb);
+    llvm::BranchInst::Create(check.cont, check.br);
+    check.br->eraseFromParent();
+    if(dt)
+      dt->deleteEdge(bb, check.trap);
+  }
+
+  bool HasSideEffects(llvm::BasicBlock* bb)
+  {
+    for(auto& inst : *bb)
+      if(&inst != bb->getTerminator() && inst.mayHaveSideEffects())
+        return true;
+    return false;
+  }
+
+  bool SameMemSize(llvm::LoadInst* a, llvm::LoadInst* b)
+  {
+    return a == b || a->getPointerOperand() == b->getPointerOperand();
+  }
+
+  // Follows straight-line code after each check, and folds any later check against the same index and memory into it by
+  // widening it to the largest offset. This only crosses instructions without side effects, so trapping at the first
+  // check instead of a later one can't be observed.
+  bool MergeBoundsChecks(llvm::Function& fn, const llvm::DataLayout& dl)
+  {
+    bool changed = false;
+
+    for(auto& bb : fn)
+    {
+      BoundsCheck first;
+      if(!MatchBoundsCheck(bb.getTerminator(), first, dl))
+        continue;
+
+      // The widened check must not overflow, so we need a couple of spare bits above the index
+      if(llvm::computeKnownBits(first.index, dl).countMinLeadingZeros() < 2)
+        continue;
+
+      llvm::SmallVector<BoundsCheck, 4> redundant;
+      uint64_t widest  = first.offset;
+      llvm::BasicBlock* prev = &bb;
+      llvm::BasicBlock* cur  = first.cont;
+
+      while(cur != &bb && cur->getSinglePredecessor() == prev && !HasSideEffects(cur))
+      {
+        BoundsCheck next;
+        llvm::Instruction* term = cur->getTerminator();
+        if(MatchBoundsCheck(term, next, dl) && next.index == first.index && SameMemSize(first.end, next.end))
+        {
+          widest = std::max(widest, next.offset);
+          redundant.push_back(next);
+          prev = cur;
+          cur  = next.cont;
+        }
+        else if(llvm::isa<llvm::BranchInst>(term) && llvm::cast<llvm::BranchInst>(term)->isUnconditional())
+        {
+          prev = cur;
+          cur  = term->getSuccessor(0);
+        }
+        else
+          break;
+      }
+
+      if(redundant.empty())
+        continue;
+
+      if(widest > first.offset)
+      {
+        llvm::IRBuilder<> builder(first.br);
+        llvm::Value* upper =
+          builder.CreateAdd(first.index, llvm::ConstantInt::get(first.index->getType(), widest), "", true, true);
+        builder.CreateCondBr(builder.CreateICmpUGT(upper, first.end, "invalid_mem_access_cond"), first.trap,
+                             first.cont);
+        first.br->eraseFromParent();
+      }
+
+      for(auto& check : redundant)
+        RemoveBoundsCheck(check, nullptr);
+      changed = true;
+    }
+
+    return changed;
+  }
+
+  // Finds every check in an innermost loop whose index is either invariant or a non-wrapping affine recurrence, and
+  // replaces them with one range check in the preheader. If that passes, execution continues into the original loop
+  // with those checks removed, otherwise it runs an unmodified copy of the loop, so out of bounds accesses still trap
+  // at exactly the same point.
+  bool HoistBoundsChecks(llvm::Loop* loop, llvm::DominatorTree& dt, llvm::LoopInfo& li, llvm::ScalarEvolution& se,
+                         llvm::AssumptionCache& ac, const llvm::DataLayout& dl)
+  {
+    bool changed = llvm::simplifyLoop(loop, &dt, &li, &se, &ac, nullptr, false);
+    if(!loop->getLoopPreheader() || !loop->hasDedicatedExits() || !loop->getLoopLatch())
+      return changed;
+    changed |= llvm::formLCSSA(*loop, dt, &li, &se);
+
+    // The loop can always leave early through a trap, so it never has an exact trip count. Instead, any exit that runs
+    // on every iteration bounds how many times the backedge can be taken.
+    const llvm::SCEV* count = nullptr;
+    llvm::SmallVector<llvm::BasicBlock*, 4> exiting;
+    loop->getExitingBlocks(exiting);
+    for(auto bb : exiting)
+    {
+      const llvm::SCEV* c = se.getExitCount(loop, bb);
+      if(!llvm::isa<llvm::SCEVCouldNotCompute>(c) && dt.dominates(bb, loop->getLoopLatch()))
+        count = !count ? c : se.getUMinFromMismatchedTypes(count, c);
+    }
+    if(!count)
+      return changed;
+
+    llvm::SmallVector<BoundsCheck, 8> checks;
+    llvm::SmallVector<const llvm::SCEV*, 8> uppers;
+    for(auto bb : loop->blocks())
+    {
+      BoundsCheck check;
+      if(!MatchBoundsCheck(bb->getTerminator(), check, dl) || !loop->isLoopInvariant(check.end->getPointerOperand()))
+        continue;
+
+      const llvm::SCEV* upper = se.getSCEV(check.upper);
+      if(!se.isLoopInvariant(upper, loop))
+      {
+        auto rec = llvm::dyn_cast<llvm::SCEVAddRecExpr>(upper);
+        if(!rec || rec->getLoop() != loop || !rec->isAffine() || !rec->hasNoUnsignedWrap())
+          continue;
+        upper = rec->evaluateAtIteration(count, se); // A non-wrapping recurrence is largest on its last iteration
+      }
+
+      if(!llvm::isSafeToExpand(upper, se))
+        continue;
+      checks.push_back(check);
+      uppers.push_back(upper);
+    }
+
+    if(checks.empty())
+      return changed;
+
+    llvm::BasicBlock* guard = loop->getLoopPreheader();
+    llvm::Instruction* term = guard->getTerminator();
+    llvm::Value* inbounds   = nullptr;
+    llvm::IRBuilder<> builder(term);
+    llvm::SCEVExpander expander(se, dl, "bounds");
+
+    for(size_t i = 0; i < checks.size(); ++i)
+    {
+      llvm::Value* upper = expander.expandCodeFor(uppers[i], checks[i].upper->getType(), term);
+      llvm::Value* end   = checks[i].end;
+      if(!loop->isLoopInvariant(end)) // Read the size of the memory before entering the loop, which is a lower bound
+      {
+        llvm::Instruction* load = checks[i].end->clone();
+        load->insertBefore(term);
+        end = load;
+      }
+
+      llvm::Value* cond = builder.CreateICmpULE(upper, end, "mem_range_check");
+      inbounds          = !inbounds ? cond : builder.CreateAnd(inbounds, cond);
+    }
+
+    se.forgetLoop(loop);
+
+    // Split the preheader so the check ends up in its own block, then clone the loop for the checked path
+    llvm::BasicBlock* preheader = llvm::SplitBlock(guard, term, &dt, &li);
+    llvm::SmallVector<llvm::BasicBlock*, 8> exits;
+    loop->getExitBlocks(exits);
+
+    llvm::ValueToValueMapTy vmap;
+    llvm::SmallVector<llvm::BasicBlock*, 16> blocks;
+    llvm::Loop* checked = llvm::cloneLoopWithPreheader(preheader, guard, loop, vmap, ".checked", &li, &dt, blocks);
+    llvm::remapInstructionsInBlocks(blocks, vmap);
+
+    term = guard->getTerminator();
+    llvm::BranchInst::Create(preheader, checked->getLoopPreheader(), inbounds, term);
+    term->eraseFromParent();
+
+    // Both loops now branch to the same exits, so every LCSSA phi needs the matching values from the copy
+    for(auto exit : exits)
+    {
+      for(auto& phi : exit->phis())
+      {
+        for(unsigned i = 0, n = phi.getNumIncomingValues(); i < n; ++i)
+        {
+          if(!loop->contains(phi.getIncomingBlock(i)))
+            continue;
+          llvm::Value* v = phi.getIncomingValue(i);
+          if(vmap.count(v))
+            v = vmap[v];
+          phi.addIncoming(v, llvm::cast<llvm::BasicBlock>(vmap[phi.getIncomingBlock(i)]));
+        }
+      }
+      dt.changeImmediateDominator(exit, guard);
+    }
+
+    for(auto& check : checks)
+      RemoveBoundsCheck(check, &dt);
+
+    return true;
+  }
+}
+
+llvm::PreservedAnalyses innative::BoundsCheckPass::run(llvm::Function& F, llvm::FunctionAnalysisManager& AM)
+{
+  const llvm::DataLayout& dl = F.getParent()->getDataLayout();
+  auto& dt                   = AM.getResult<llvm::DominatorTreeAnalysis>(F);
+  auto& li                   = AM.getResult<llvm::LoopAnalysis>(F);
+  auto& se                   = AM.getResult<llvm::ScalarEvolutionAnalysis>(F);
+  auto& ac                   = AM.getResult<llvm::AssumptionAnalysis>(F);
+  bool changed               = false;
+
+  // Collect the loops first, because versioning adds new ones
+  llvm::SmallVector<llvm::Loop*, 8> loops;
+  for(auto loop : li.getLoopsInPreorder())
+    if(loop->getSubLoops().empty())
+      loops.push_back(loop);
+
+  for(auto loop : loops)
+    changed |= HoistBoundsChecks(loop, dt, li, se, ac, dl);
+
+  changed |= MergeBoundsChecks(F, dl);
+  return changed ? llvm::PreservedAnalyses::none() : llvm::PreservedAnalyses::all();
+}
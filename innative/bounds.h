@@ -0,0 +1,23 @@
+// Copyright (c)2019 Black Sphere Studios
+// For conditions of distribution and use, see copyright notice in innative.h
+
+#ifndef IN__BOUNDS_H
+#define IN__BOUNDS_H
+
+#include "llvm.h"
+#pragma warning(push)
+#pragma warning(disable : 4146 4267 4141 4244 4624)
+#include "llvm/IR/PassManager.h"
+#pragma warning(pop)
+
+namespace innative {
+  // Removes redundant linear memory bounds checks emitted by GetMemPointer. Checks against the same base in straight-line
+  // code are merged into the first one, and checks inside innermost loops are hoisted into a single range check in the
+  // preheader, which selects between an unchecked copy of the loop and the original.
+  struct BoundsCheckPass : llvm::PassInfoMixin<BoundsCheckPass>
+  {
+    llvm::PreservedAnalyses run(llvm::Function& F, llvm::FunctionAnalysisManager& AM);
+  };
+}
+
+#endif
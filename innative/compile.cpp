@@ -2,6 +2,7 @@
 // For conditions of distribution and use, see copyright notice in innative.h
 
 #include "util.h"
+#include "body.h"
 #include "validate.h"
 #include "optimize.h"
 #include "intrinsic.h"
@@ -25,6 +26,10 @@
 #pragma warning(pop)
 #include <iostream>
 #include <sstream>
+#include <unordered_map>
+#include <functional>
+#include <algorithm>
+#include <map>
 
 using namespace innative;
 using namespace utility;
@@ -373,6 +378,12 @@ IN_ERROR PopType(varsint7 ty, code::Context& context, llvmVal*& v, bool peek = f
     v = context.builder.CreateIntToPtr(v, GetLLVMType(TE_cref, context));
     return ERR_SUCCESS;
   }
+  else if(context.m.code.validated) // Validation already type checked every instruction in this body
+  {
+    assert(CheckType(ty, context.values.Peek()));
+    v = peek ? context.values.Peek() : context.values.Pop();
+    return ERR_SUCCESS;
+  }
   else if(!CheckType(ty, context.values.Peek()))
     return ERR_INVALID_TYPE;
   else if(peek)
@@ -534,7 +545,14 @@ BB* PushLabel(const char* name, varsint7 sig, uint8_t opcode, Func* fnptr, code:
     scope = context.dbuilder->createLexicalBlock(scope, context.dunit, context.builder.getCurrentDebugLocation().getLine(),
                                                  context.builder.getCurrentDebugLocation().getCol());
 
-  context.control.Push(code::Block{ bb, 0, context.values.Limit(), sig, opcode, scope });
+  code::LocalWrites written = { 0, 0 };
+  if(context.ssa && opcode != OP_return) // Blocks are opened in the same order ScanLocalWrites found them
+  {
+    assert(context.nextblock < context.writes.size());
+    written = context.writes[context.nextblock++];
+  }
+
+  context.control.Push(code::Block{ bb, 0, context.values.Limit(), sig, opcode, scope, 0, written, 0 });
   context.values.SetLimit(
     context.values.Size() +
     context.values.Limit()); // Set limit to current stack size to prevent a block from popping past this
@@ -558,31 +576,80 @@ BB* BindLabel(BB* block, code::Context& context)
   return block;
 }
 
-IN_ERROR PushResult(code::BlockResult** root, llvmVal* result, BB* block, const Environment& env)
+// Copies the current values of every local written inside the target block, which is all a branch to it can change
+llvmVal** SaveLocals(const code::Block& target, code::Context& context)
 {
-  code::BlockResult* next = *root;
-  *root                   = tmalloc<code::BlockResult>(env, 1);
-  if(!*root)
+  if(!target.written.n_locals)
+    return nullptr;
+
+  auto values =
+    reinterpret_cast<llvmVal**>(ScratchArena::Get().Allocate(sizeof(llvmVal*) * target.written.n_locals));
+  if(values)
+    for(varuint32 i = 0; i < target.written.n_locals; ++i)
+      values[i] = context.ssalocals[target.written.locals[i]];
+  return values;
+}
+
+// Results only live until their block is popped, so they come from the ScratchScope around the whole function body
+IN_ERROR PushResult(code::Block& target, llvmVal* result, BB* block, code::Context& context)
+{
+  code::BlockResult* next = target.results;
+  llvmVal** locals        = SaveLocals(target, context);
+  if(target.written.n_locals > 0 && !locals)
+    return ERR_FATAL_OUT_OF_MEMORY;
+
+  target.results = reinterpret_cast<code::BlockResult*>(ScratchArena::Get().Allocate(sizeof(code::BlockResult)));
+  if(!target.results)
     return ERR_FATAL_OUT_OF_MEMORY;
 
-  new(*root) code::BlockResult{ result, block, next };
+  new(target.results) code::BlockResult{ result, block, locals, next };
   return ERR_SUCCESS;
 }
 
 // Adds current value stack to target branch according to that branch's signature.
 IN_ERROR AddBranch(code::Block& target, code::Context& context)
 {
-  IN_ERROR err = ERR_SUCCESS;
-  if(target.sig != TE_void)
+  if(target.op == OP_loop) // Branches targeting loops throw all their values away, but must still pass on their locals
   {
-    llvmVal* value;
-    err = PopType(target.sig, context, value, true);
-    if(!err)
-      err = PushResult(&target.results, value, context.builder.GetInsertBlock(), context.env); // Push result
+    for(varuint32 i = 0; i < target.written.n_locals; ++i)
+      llvm::cast<llvm::PHINode>(target.entry[i])
+        ->addIncoming(context.ssalocals[target.written.locals[i]], context.builder.GetInsertBlock());
+    return ERR_SUCCESS;
   }
+
+  IN_ERROR err   = ERR_SUCCESS;
+  llvmVal* value = nullptr;
+  if(target.sig != TE_void)
+    err = PopType(target.sig, context, value, true);
+  if(!err && (target.sig != TE_void || target.written.n_locals > 0))
+    err = PushResult(target, value, context.builder.GetInsertBlock(), context); // Push result
   return err;
 }
 
+// Builds PHI nodes for every local written inside a block that doesn't have the same value on every incoming branch
+void MergeLocals(code::Block& target, BB* block, code::Context& context)
+{
+  for(varuint32 i = 0; i < target.written.n_locals; ++i)
+  {
+    llvmVal*& local    = context.ssalocals[target.written.locals[i]];
+    unsigned int count = 1;
+    bool merge         = (target.op == OP_if && target.entry[i] != local);
+    for(auto r = target.results; r != nullptr; r = r->next, ++count)
+      merge |= (r->locals[i] != local);
+
+    if(!merge)
+      continue;
+
+    llvm::PHINode* phi = context.builder.CreatePHI(local->getType(), count + (target.op == OP_if), "phi");
+    phi->addIncoming(local, block);
+    if(target.op == OP_if) // An if without an else falls through from the else stub with the values it was entered with
+      phi->addIncoming(target.entry[i], target.ifelse);
+    for(auto r = target.results; r != nullptr; r = r->next)
+      phi->addIncoming(r->locals[i], r->b);
+    local = phi;
+  }
+}
+
 // Pops a label off the control stack, verifying that the value stack matches the signature and building PHI nodes as
 // necessary
 IN_ERROR PopLabel(code::Context& context, BB* block)
@@ -611,9 +678,12 @@ IN_ERROR PopLabel(code::Context& context, BB* block)
       push = phi; // Push phi nodes on to stack
     }
   }
-  else if(context.control.Peek().results != nullptr)
+  else if(context.control.Peek().results != nullptr && context.control.Peek().results->v != nullptr)
     return ERR_INVALID_VALUE_STACK;
 
+  if(context.control.Peek().op != OP_loop) // The PHI nodes of a loop are at the start of the loop, not the end
+    MergeLocals(context.control.Peek(), block, context);
+
   if(context.values.Size() > 0 && !context.values.Peek()) // Pop at most 1 polymorphic type off the stack.
     context.values.Pop();
   if(context.values.Size() > 0) // value stack should be completely empty now
@@ -643,6 +713,9 @@ IN_ERROR CompileIfBlock(varsint7 sig, code::Context& context)
   BB* fblock                    = BB::Create(context.context, "if_else", parent); // Create else stub
   BB* endblock                  = PushLabel("if_end", sig, OP_if, nullptr, context, context.control.Peek().scope);
   context.control.Peek().ifelse = fblock;
+  context.control.Peek().entry  = SaveLocals(context.control.Peek(), context);
+  if(context.control.Peek().written.n_locals > 0 && !context.control.Peek().entry)
+    return ERR_FATAL_OUT_OF_MEMORY;
 
   context.builder.CreateCondBr(cmp, tblock, fblock); // Insert branch in current block
   context.builder.SetInsertPoint(fblock);            // Point else stub at end block
@@ -652,6 +725,34 @@ IN_ERROR CompileIfBlock(varsint7 sig, code::Context& context)
   return ERR_SUCCESS;
 }
 
+IN_ERROR CompileLoopBlock(varsint7 sig, code::Context& context)
+{
+  BB* preheader = context.builder.GetInsertBlock();
+  PushLabel("loop", sig, OP_loop, nullptr, context, context.control.Peek().scope);
+  context.builder.CreateBr(context.control.Peek().block); // Branch into next block
+  BindLabel(context.control.Peek().block, context);
+
+  // Every local written inside the loop gets a PHI node at the start of it, which each branch back to the loop adds to
+  code::Block& loop = context.control.Peek();
+  if(loop.written.n_locals > 0)
+  {
+    loop.entry = reinterpret_cast<llvmVal**>(ScratchArena::Get().Allocate(sizeof(llvmVal*) * loop.written.n_locals));
+    if(!loop.entry)
+      return ERR_FATAL_OUT_OF_MEMORY;
+  }
+
+  for(varuint32 i = 0; i < loop.written.n_locals; ++i)
+  {
+    llvmVal*& local    = context.ssalocals[loop.written.locals[i]];
+    llvm::PHINode* phi = context.builder.CreatePHI(local->getType(), 2, "loop_phi");
+    phi->addIncoming(local, preheader);
+    context.loopphis.push_back(phi);
+    loop.entry[i] = local = phi;
+  }
+
+  return ERR_SUCCESS;
+}
+
 void PolymorphicStack(code::Context& context)
 {
   while(context.values.Size() > 0)
@@ -670,17 +771,20 @@ IN_ERROR CompileElseBlock(code::Context& context)
 
   // Instead of popping and pushing a new control label, we just re-purpose the existing one. This preserves the value
   // stack results.
-  if(context.control.Peek().sig != TE_void)
+  code::Block& block = context.control.Peek();
+  if(block.sig != TE_void || block.written.n_locals > 0)
   {
     IN_ERROR err;
-    llvmVal* value;
-    if(err = PopType(context.control.Peek().sig, context, value))
+    llvmVal* value = nullptr;
+    if(block.sig != TE_void && (err = PopType(block.sig, context, value)))
       return err;
-    if(err =
-         PushResult(&context.control.Peek().results, value, context.builder.GetInsertBlock(), context.env)) // Push result
+    if(err = PushResult(block, value, context.builder.GetInsertBlock(), context)) // Push result
       return err;
   }
 
+  for(varuint32 i = 0; i < block.written.n_locals; ++i) // The else branch starts with the values the if was entered with
+    context.ssalocals[block.written.locals[i]] = block.entry[i];
+
   // Reset value stack, but ensure that we preserve a polymorphic value if we had pushed one before
   while(context.values.Size() > 1)
     context.values.Pop();
@@ -777,10 +881,7 @@ IN_ERROR CompileBranch(varuint32 depth, code::Context& context)
 
   code::Block& target = context.control[depth];
   context.builder.CreateBr(target.block);
-  IN_ERROR err =
-    (target.op != OP_loop) ?
-      AddBranch(target, context) :
-      ERR_SUCCESS; // Branches targeting loops just throw all their values away, so we don't need to build PHI nodes.
+  IN_ERROR err = AddBranch(target, context);
   PolymorphicStack(context);
   return err;
 }
@@ -802,14 +903,11 @@ IN_ERROR CompileIfBranch(varuint32 depth, code::Context& context)
 
   code::Block& target = context.control[depth];
   context.builder.CreateCondBr(cmp, target.block, block);
-  if(target.op != OP_loop)
-  {
-    if(err = AddBranch(target, context))
-      return err;
-  }
+  if(err = AddBranch(target, context))
+    return err;
   context.builder.SetInsertPoint(
     block); // Start inserting code into continuation AFTER we add the branch, so the branch goes to the right place
-  return ERR_SUCCESS; // Branches targeting loops just throw all their values away, so we don't need to build PHI nodes.
+  return ERR_SUCCESS;
 }
 IN_ERROR CompileBranchTable(varuint32 n_table, varuint32* table, varuint32 def, code::Context& context)
 {
@@ -822,7 +920,7 @@ IN_ERROR CompileBranchTable(varuint32 n_table, varuint32* table, varuint32 def,
     return ERR_INVALID_BRANCH_DEPTH;
 
   llvm::SwitchInst* s = context.builder.CreateSwitch(index, context.control[def].block, n_table);
-  err                 = (context.control[def].op != OP_loop) ? AddBranch(context.control[def], context) : ERR_SUCCESS;
+  err                 = AddBranch(context.control[def], context);
 
   for(varuint32 i = 0; i < n_table && err == ERR_SUCCESS; ++i)
   {
@@ -831,7 +929,7 @@ IN_ERROR CompileBranchTable(varuint32 n_table, varuint32* table, varuint32 def,
 
     code::Block& target = context.control[table[i]];
     s->addCase(context.builder.getInt32(i), target.block);
-    err = (target.op != OP_loop) ? AddBranch(target, context) : ERR_SUCCESS;
+    err = AddBranch(target, context);
   }
 
   PolymorphicStack(context);
@@ -848,8 +946,9 @@ IN_ERROR CompileCall(varuint32 index, code::Context& context)
   if(context.functions[index].intrinsic != nullptr)
   {
     IN_ERROR err;
+    ScratchScope scratch(context.env);
     int num         = context.functions[index].intrinsic->num;
-    llvmVal** ArgsV = tmalloc<llvmVal*>(context.env, num);
+    llvmVal** ArgsV = scratch.alloc<llvmVal*>(num);
     if(num > 0 && !ArgsV)
       return ERR_FATAL_OUT_OF_MEMORY;
 
@@ -874,7 +973,8 @@ IN_ERROR CompileCall(varuint32 index, code::Context& context)
 
   // Pop arguments in reverse order
   IN_ERROR err;
-  llvmVal** ArgsV = tmalloc<llvmVal*>(context.env, num);
+  ScratchScope scratch(context.env);
+  llvmVal** ArgsV = scratch.alloc<llvmVal*>(num);
   if(num > 0 && !ArgsV)
     return ERR_FATAL_OUT_OF_MEMORY;
 
@@ -896,6 +996,34 @@ IN_ERROR CompileCall(varuint32 index, code::Context& context)
   return ERR_SUCCESS;
 }
 
+// Guard pages let us drop explicit bounds checks, but the runtime can only turn the resulting faults into traps on 64-bit
+// linux.
+bool UsesGuardPages(const Environment& env)
+{
+#if defined(IN_PLATFORM_LINUX) && defined(IN_CPU_x86_64)
+  return (env.flags & ENV_MEMORY_GUARD_PAGES) != 0;
+#else
+  return false;
+#endif
+}
+
+// Returns true if linear memories reserve their address space up front and grow in place. Their base pointer never changes
+// after the init function allocates them, so nothing has to reload it after calls that might grow memory.
+bool UsesReservedMemory(const Environment& env)
+{
+  return (env.flags & ENV_MEMORY_RESERVE) || UsesGuardPages(env);
+}
+
+// Returns how much address space a linear memory with the given maximum size must reserve to grow in place
+llvmVal* GetMemoryReservation(code::Context& context, llvmVal* max)
+{
+  return UsesGuardPages(context.env) ? context.builder.getInt64(IN_MEMORY_GUARD_RESERVE) : max;
+}
+
+// Tells the runtime whether a reserved memory needs a guard region. Only memories without bounds checks need one, and
+// there is a limited number of them, so memories that still check every access must never take one.
+llvmVal* GetMemoryGuard(code::Context& context) { return context.builder.getInt32(UsesGuardPages(context.env)); }
+
 llvmVal* GetMemSize(llvmVal* target, code::Context& context)
 {
   return context.builder.CreateLoad(context.builder.CreateGEP(
@@ -932,7 +1060,8 @@ IN_ERROR CompileIndirectCall(varuint32 index, code::Context& context)
     return ERR_INVALID_TABLE_INDEX;
 
   // Pop arguments in reverse order
-  llvmVal** ArgsV = tmalloc<llvmVal*>(context.env, ftype.n_params);
+  ScratchScope scratch(context.env);
+  llvmVal** ArgsV = scratch.alloc<llvmVal*>(ftype.n_params);
   if(ftype.n_params > 0 && !ArgsV)
     return ERR_FATAL_OUT_OF_MEMORY;
 
@@ -983,7 +1112,7 @@ IN_ERROR CompileIndirectCall(varuint32 index, code::Context& context)
 
   // CreateCall will then do the final dereference of the function pointer to make the indirect call
   CallInst* call = context.builder.CreateCall(funcptr, llvm::makeArrayRef(ArgsV, ftype.n_params));
-  if(context.memories.size() > 0)
+  if(context.memories.size() > 0 && !UsesReservedMemory(context.env))
     context.builder.CreateStore(context.builder.CreateLoad(context.memories[0]), context.memlocal);
   context.builder.GetInsertBlock()->getParent()->setMetadata(IN_MEMORY_GROW_METADATA,
                                                              llvm::MDNode::get(context.context, {}));
@@ -1029,8 +1158,9 @@ llvmVal* GetMemPointer(code::Context& context, llvmVal* base, llvm::PointerType*
   base        = context.builder.CreateZExtOrTrunc(base, ty);
 
   llvmVal* loc;
-  if(context.env.flags &
-     ENV_CHECK_MEMORY_ACCESS) // In strict mode, generate a check that traps if this is an invalid memory access
+  if((context.env.flags & ENV_CHECK_MEMORY_ACCESS) &&
+     !(bypass && UsesGuardPages(context.env))) // In strict mode, generate a check that traps if this is an invalid memory
+                                               // access, unless the guard region will fault instead
   {
     llvmVal* end = context.builder.CreateIntCast(GetMemSize(src, context), ty, false);
     llvmVal* cond;
@@ -1134,11 +1264,18 @@ IN_ERROR CompileMemGrow(code::Context& context, const char* name)
 
   auto max = llvm::cast<llvm::ConstantAsMetadata>(context.memories[0]->getMetadata(IN_MEMORY_MAX_METADATA)->getOperand(0))
                ->getValue();
+  std::vector<llvmVal*> args = { context.builder.CreateLoad(context.memories[0]),
+                                 context.builder.CreateShl(context.builder.CreateZExt(delta, context.builder.getInt64Ty()),
+                                                           16),
+                                 max };
+  if(UsesReservedMemory(context.env))
+  {
+    args.push_back(GetMemoryReservation(context, max));
+    args.push_back(GetMemoryGuard(context));
+  }
+
   CallInst* call = context.builder.CreateCall(
-    context.memgrow,
-    { context.builder.CreateLoad(context.memories[0]),
-      context.builder.CreateShl(context.builder.CreateZExt(delta, context.builder.getInt64Ty()), 16), max },
-    name);
+    UsesReservedMemory(context.env) ? context.memgrowreserved : context.memgrow, args, name);
 
   llvmVal* success =
     context.builder.CreateICmpNE(context.builder.CreatePtrToInt(call, context.intptrty), CInt::get(context.intptrty, 0));
@@ -1150,7 +1287,8 @@ IN_ERROR CompileMemGrow(code::Context& context, const char* name)
   context.builder.CreateCondBr(success, successblock, contblock);
   context.builder.SetInsertPoint(successblock); // Only set new memory if call succeeded
   context.builder.CreateAlignedStore(call, context.memories[0], context.builder.getInt64Ty()->getPrimitiveSizeInBits() / 8);
-  context.builder.CreateStore(context.builder.CreateLoad(context.memories[0]), context.memlocal);
+  if(!UsesReservedMemory(context.env))
+    context.builder.CreateStore(context.builder.CreateLoad(context.memories[0]), context.memlocal);
   context.builder.CreateBr(contblock);
 
   context.builder.SetInsertPoint(contblock);
@@ -1316,11 +1454,7 @@ IN_ERROR CompileInstruction(Instruction& ins, code::Context& context)
   case OP_block:
     PushLabel("block", ins.immediates[0]._varsint7, OP_block, nullptr, context, context.control.Peek().scope);
     return ERR_SUCCESS;
-  case OP_loop:
-    PushLabel("loop", ins.immediates[0]._varsint7, OP_loop, nullptr, context, context.control.Peek().scope);
-    context.builder.CreateBr(context.control.Peek().block); // Branch into next block
-    BindLabel(context.control.Peek().block, context);
-    return ERR_SUCCESS;
+  case OP_loop: return CompileLoopBlock(ins.immediates[0]._varsint7, context);
   case OP_if: return CompileIfBlock(ins.immediates[0]._varsint7, context);
   case OP_else: return CompileElseBlock(context);
   case OP_end: return CompileEndBlock(context);
@@ -1352,6 +1486,13 @@ IN_ERROR CompileInstruction(Instruction& ins, code::Context& context)
 
     // Variable access
   case OP_local_get:
+    if(context.ssa)
+    {
+      if(ins.immediates[0]._varuint32 >= context.ssalocals.size())
+        return ERR_INVALID_LOCAL_INDEX;
+      PushReturn(context, context.ssalocals[ins.immediates[0]._varuint32]);
+      return ERR_SUCCESS;
+    }
     if(ins.immediates[0]._varuint32 >= context.locals.size())
       return ERR_INVALID_LOCAL_INDEX;
     PushReturn(context, context.builder.CreateLoad(context.locals[ins.immediates[0]._varuint32]));
@@ -1359,15 +1500,24 @@ IN_ERROR CompileInstruction(Instruction& ins, code::Context& context)
   case OP_local_set:
   case OP_local_tee:
   {
-    if(ins.immediates[0]._varuint32 >= context.locals.size())
+    if(ins.immediates[0]._varuint32 >= (context.ssa ? context.ssalocals.size() : context.locals.size()))
       return ERR_INVALID_LOCAL_INDEX;
     if(context.values.Size() < 1)
       return ERR_INVALID_VALUE_STACK;
-    context.builder.CreateStore(!context.values.Peek() ?
-                                  llvm::Constant::getAllOnesValue(
-                                    context.locals[ins.immediates[0]._varuint32]->getType()->getElementType()) :
-                                  context.values.Peek(),
-                                context.locals[ins.immediates[0]._varuint32]);
+    if(context.ssa)
+    {
+      llvmVal*& local = context.ssalocals[ins.immediates[0]._varuint32];
+      if(!context.values.Peek())
+        local = llvm::Constant::getAllOnesValue(local->getType());
+      else
+        local = context.values.Peek();
+    }
+    else
+      context.builder.CreateStore(!context.values.Peek() ?
+                                    llvm::Constant::getAllOnesValue(
+                                      context.locals[ins.immediates[0]._varuint32]->getType()->getElementType()) :
+                                    context.values.Peek(),
+                                  context.locals[ins.immediates[0]._varuint32]);
     if(context.values.Peek() != nullptr &&
        ins.opcode == OP_local_set) // tee_local is the same as set_local except the operand isn't popped
       context.values.Pop();
@@ -1824,18 +1974,95 @@ IN_ERROR CompileInstruction(Instruction& ins, code::Context& context)
   return ERR_SUCCESS;
 }
 
+// Finds the locals written inside each block, in the order the blocks are opened, so that branches only have to carry
+// the values of locals that can be different from when the target block was entered. Everything allocated here lives
+// until the ScratchScope around the function body is gone.
+IN_ERROR ScanLocalWrites(FunctionBody& body, varuint32 n_locals, code::Context& context)
+{
+  context.writes.clear();
+  context.nextblock = 0;
+
+  // A local written inside a block is also written inside every block around it, so for each local we only need to know
+  // how many of the currently open blocks already have it.
+  auto depth = reinterpret_cast<varuint32*>(ScratchArena::Get().Allocate(sizeof(varuint32) * n_locals));
+  if(!depth)
+    return ERR_FATAL_OUT_OF_MEMORY;
+  memset(depth, 0, sizeof(varuint32) * n_locals);
+
+  std::vector<std::vector<varuint32>> frames; // Locals written inside each open block, reused by later blocks
+  std::vector<size_t> open;                   // Index in writes of each open block
+  BodyReader reader(body, context.env);
+  Instruction ins;
+
+  while(!reader.End())
+  {
+    IN_ERROR err = reader.Read(ins);
+    if(err < 0)
+      return err;
+
+    switch(ins.opcode)
+    {
+    case OP_block:
+    case OP_loop:
+    case OP_if:
+      if(frames.size() <= open.size())
+        frames.emplace_back();
+      frames[open.size()].clear();
+      open.push_back(context.writes.size());
+      context.writes.push_back({ 0, 0 });
+      break;
+    case OP_local_set:
+    case OP_local_tee:
+      if(ins.immediates[0]._varuint32 < n_locals)
+        for(varuint32& d = depth[ins.immediates[0]._varuint32]; d < open.size(); ++d)
+          frames[d].push_back(ins.immediates[0]._varuint32);
+      break;
+    case OP_end:
+      if(open.size() > 0) // The last end closes the function body, which isn't a block
+      {
+        auto& frame = frames[open.size() - 1];
+        auto& w     = context.writes[open.back()];
+        open.pop_back();
+        for(auto local : frame)
+          depth[local] = static_cast<varuint32>(open.size());
+
+        w.n_locals = static_cast<varuint32>(frame.size());
+        w.locals   = reinterpret_cast<varuint32*>(ScratchArena::Get().Allocate(sizeof(varuint32) * frame.size()));
+        if(!w.locals)
+          return ERR_FATAL_OUT_OF_MEMORY;
+        if(!frame.empty())
+          memcpy(w.locals, frame.data(), sizeof(varuint32) * frame.size());
+      }
+      break;
+    }
+  }
+
+  return ERR_SUCCESS;
+}
+
 IN_ERROR CompileFunctionBody(Func* fn, llvm::AllocaInst*& memlocal, FunctionType& sig, FunctionBody& body,
                              code::Context& context)
 {
   // Ensure context is reset
   assert(!context.control.Size() && !context.control.Limit());
   assert(!context.values.Size() && !context.values.Limit());
+  ScratchScope scratch(context.env); // Frees every temporary allocated while compiling this function
 
   // Get return value
   varsint7 ret = TE_void;
   if(sig.n_returns > 0)
     ret = sig.returns[0];
 
+  context.ssa = (context.env.flags & ENV_SSA_LOCALS) && !context.dbuilder;
+  context.ssalocals.clear();
+  context.loopphis.clear();
+  if(context.ssa)
+  {
+    IN_ERROR err = ScanLocalWrites(body, sig.n_params + body.n_locals, context);
+    if(err < 0)
+      return err;
+  }
+
   PushLabel("exit", ret, OP_return, nullptr, context,
             fn->getSubprogram()); // Setup the function exit block that wraps everything
   context.builder.SetInsertPoint(BB::Create(context.context, "entry", fn)); // Setup initial basic block.
@@ -1853,6 +2080,13 @@ IN_ERROR CompileFunctionBody(Func* fn, llvm::AllocaInst*& memlocal, FunctionType
     assert(index < sig.n_params);
     auto ty = GetLLVMType(sig.params[index], context);
     assert(ty == arg.getType());
+    if(context.ssa) // Parameters start out as the arguments themselves
+    {
+      context.ssalocals.push_back(&arg);
+      ++index;
+      continue;
+    }
+
     context.locals.push_back(context.builder.CreateAlloca(ty, nullptr,
                                                           (body.param_names && body.param_names[index].name.size()) ?
                                                             body.param_names[index].name.str() :
@@ -1878,6 +2112,12 @@ IN_ERROR CompileFunctionBody(Func* fn, llvm::AllocaInst*& memlocal, FunctionType
   for(varuint32 i = 0; i < body.n_locals; ++i)
   {
     auto ty = GetLLVMType(body.locals[i], context);
+    if(context.ssa)
+    {
+      context.ssalocals.push_back(llvm::Constant::getNullValue(ty));
+      continue;
+    }
+
     context.locals.push_back(context.builder.CreateAlloca(ty, nullptr,
                                                           (body.local_names && body.local_names[i].name.size()) ?
                                                             body.local_names[i].name.str() :
@@ -1900,6 +2140,8 @@ IN_ERROR CompileFunctionBody(Func* fn, llvm::AllocaInst*& memlocal, FunctionType
   unsigned int stacksize = 0;
   for(auto local : context.locals)
     stacksize += (local->getType()->getElementType()->getPrimitiveSizeInBits() / 8);
+  for(auto local : context.ssalocals) // Locals in SSA form can still end up on the stack if they don't fit in registers
+    stacksize += (local->getType()->getPrimitiveSizeInBits() / 8);
 
   // If we allocate more than 2048 bytes of stack space, make a stack probe so we can't blow past the gaurd page.
   if(stacksize > 2048)
@@ -1913,21 +2155,46 @@ IN_ERROR CompileFunctionBody(Func* fn, llvm::AllocaInst*& memlocal, FunctionType
   }
 
   // Begin iterating through the instructions until there aren't any left
-  for(varuint32 i = 0; i < body.n_body; ++i)
+  BodyReader reader(body, context.env);
+  Instruction ins = { OP_unreachable };
+  while(!reader.End())
   {
+    IN_ERROR err = reader.Read(ins);
+    if(err < 0)
+      return err;
     if(context.dbuilder)
       context.builder.SetCurrentDebugLocation(
-        llvm::DILocation::get(context.context, body.body[i].line, body.body[i].column, context.control.Peek().scope));
-    IN_ERROR err = CompileInstruction(body.body[i], context);
+        llvm::DILocation::get(context.context, ins.line, ins.column, context.control.Peek().scope));
+    err = CompileInstruction(ins, context);
     if(err < 0)
       return err;
   }
 
+  // Loops get a PHI node for every local written inside them, which is redundant unless a branch back to the loop can
+  // change the local and the loop actually reads it, so we remove any PHI node that is unused or always has the same
+  // value. Without this, unoptimized code would have to copy every one of them on each iteration.
+  for(bool changed = true; changed;)
+  {
+    changed = false;
+    for(auto& phi : context.loopphis)
+    {
+      llvmVal* value = !phi ? nullptr : phi->hasConstantValue();
+      if(value != nullptr || (phi != nullptr && phi->use_empty()))
+      {
+        if(value != nullptr)
+          phi->replaceAllUsesWith(value);
+        phi->eraseFromParent();
+        phi     = nullptr;
+        changed = true;
+      }
+    }
+  }
+
   context.memlocal = nullptr;
   if(context.values.Size() > 0 &&
      !context.values.Peek()) // Pop at most 1 polymorphic type off the stack. Any additional ones are an error.
     context.values.Pop();
-  if(body.body[body.n_body - 1].opcode != OP_end)
+  if(ins.opcode != OP_end)
     return ERR_FATAL_EXPECTED_END_INSTRUCTION;
   if(context.control.Size() > 0 || context.control.Limit() > 0)
     return ERR_END_MISMATCH;
@@ -2025,7 +2292,7 @@ Func* TopLevelFunction(llvm::LLVMContext& context, llvm::IRBuilder<>& builder, c
   return fn;
 }
 
-std::string GenFlagString(const Environment& env)
+std::string innative::GenFlagString(const Environment& env)
 {
   std::string f = env.flags ? "-flag" : "";
   if(env.flags & ENV_DEBUG)
@@ -2056,6 +2323,28 @@ std::string GenFlagString(const Environment& env)
     f += " check_int_division";
   if(env.flags & ENV_DISABLE_TAIL_CALL)
     f += " disable_tail_call";
+  if(env.flags & ENV_PARALLEL_CODEGEN)
+    f += " parallel_codegen";
+  if(env.flags & ENV_LINK_IN_MEMORY)
+    f += " link_in_memory";
+  if(env.flags & ENV_LAZY_COMPILE)
+    f += " lazy_compile";
+  if(env.flags & ENV_TIERED_COMPILE)
+    f += " tiered_compile";
+  if(env.flags & ENV_MEMORY_GUARD_PAGES)
+    f += " memory_guard_pages";
+  if(env.flags & ENV_MEMORY_RESERVE)
+    f += " memory_reserve";
+  if(env.flags & ENV_INSTANCES)
+    f += " instances";
+  if(env.flags & ENV_LAZY_DECODE)
+    f += " lazy_decode";
+  if(env.flags & ENV_FUSED_VALIDATION)
+    f += " fused_validation";
+  if(env.flags & ENV_SSA_LOCALS)
+    f += " ssa_locals";
+  if(UsesLTO(env))
+    f += " lto";
 
   if(env.optimize & ENV_OPTIMIZE_FAST_MATH_REASSOCIATE)
     f += " fast_math_reassociate";
@@ -2079,6 +2368,7 @@ std::string GenFlagString(const Environment& env)
   case ENV_OPTIMIZE_O2: f += " O2"; break;
   case ENV_OPTIMIZE_O3: f += " O3"; break;
   case ENV_OPTIMIZE_Os: f += " Os"; break;
+  case ENV_OPTIMIZE_BASELINE: f += " baseline"; break;
   }
 
   if(env.features)
@@ -2196,6 +2486,15 @@ IN_ERROR CompileModule(const Environment* env, code::Context& context)
   context.memgrow
     ->setReturnDoesNotAlias(); // This is a system memory allocation function, so the return value does not alias
 
+  context.memgrowreserved = Func::Create(FuncTy::get(context.builder.getInt8PtrTy(0),
+                                                    { context.builder.getInt8PtrTy(0), context.builder.getInt64Ty(),
+                                                      context.builder.getInt64Ty(), context.builder.getInt64Ty(),
+                                                      context.builder.getInt32Ty() },
+                                                    false),
+                                        Func::ExternalLinkage, "_innative_internal_env_grow_memory_reserved",
+                                        context.llvm);
+  context.memgrowreserved->setReturnDoesNotAlias();
+
   Func* fn_memcpy = Func::Create(
     FuncTy::get(context.builder.getVoidTy(),
                 { context.builder.getInt8PtrTy(0), context.builder.getInt8PtrTy(0), context.builder.getInt64Ty() }, false),
@@ -2204,6 +2503,10 @@ IN_ERROR CompileModule(const Environment* env, code::Context& context)
   Func* fn_memfree = Func::Create(FuncTy::get(context.builder.getVoidTy(), { context.builder.getInt8PtrTy(0) }, false),
                                   Func::ExternalLinkage, "_innative_internal_env_free_memory", context.llvm);
 
+  Func* fn_memfree_reserved =
+    Func::Create(FuncTy::get(context.builder.getVoidTy(), { context.builder.getInt8PtrTy(0) }, false),
+                 Func::ExternalLinkage, "_innative_internal_env_free_memory_reserved", context.llvm);
+
   if(context.dbuilder)
   {
     FunctionDebugInfo(context.init, "innative_internal_init|" + std::string(context.m.name.str()), context, true, true, 0);
@@ -2420,8 +2723,13 @@ IN_ERROR CompileModule(const Environment* env, code::Context& context)
     context.memories.back()->setMetadata(IN_MEMORY_MAX_METADATA,
                                          llvm::MDNode::get(context.context, { llvm::ConstantAsMetadata::get(max) }));
 
-    CallInst* call = context.builder.CreateCall(context.memgrow, { llvm::ConstantPointerNull::get(type), sz, max });
-    call->setCallingConv(context.memgrow->getCallingConv());
+    CallInst* call =
+      !UsesReservedMemory(context.env) ?
+        context.builder.CreateCall(context.memgrow, { llvm::ConstantPointerNull::get(type), sz, max }) :
+        context.builder.CreateCall(context.memgrowreserved, { llvm::ConstantPointerNull::get(type), sz, max,
+                                                              GetMemoryReservation(context, max),
+                                                              GetMemoryGuard(context) });
+    call->setCallingConv(call->getCalledFunction()->getCallingConv());
     InsertConditionalTrap(context.builder.CreateICmpEQ(context.builder.CreatePtrToInt(call, context.intptrty),
                                                        CInt::get(context.intptrty, 0)),
                           context);
@@ -2529,8 +2837,11 @@ IN_ERROR CompileModule(const Environment* env, code::Context& context)
 
   for(size_t i = context.m.importsection.memories - context.m.importsection.tables; i < context.memories.size();
       ++i) // Don't accidentally delete imported linear memories
-    context.builder.CreateCall(fn_memfree, { context.builder.CreateLoad(context.memories[i]) })
-      ->setCallingConv(fn_memfree->getCallingConv());
+  {
+    Func* free = UsesReservedMemory(context.env) ? fn_memfree_reserved : fn_memfree;
+    context.builder.CreateCall(free, { context.builder.CreateLoad(context.memories[i]) })
+      ->setCallingConv(free->getCallingConv());
+  }
 
   for(size_t i = context.m.importsection.tables - context.m.importsection.functions; i < context.tables.size();
       ++i) // Don't accidentally delete imported tables
@@ -2600,7 +2911,7 @@ void PostOrderTraversal(llvm::Function* f)
 // Runs a pass to propagate all memory_grow metadata up the call graph, then adds store instructions where necessary
 void AddMemLocalCaching(code::Context& ctx)
 {
-  if(!ctx.memories.size())
+  if(!ctx.memories.size() || UsesReservedMemory(ctx.env)) // Reserved memories never move, so the cache is never stale
     return;
 
   for(auto fn : ctx.functions) // Because it's crucial we cover the entire call graph, we just go through every single
@@ -2652,7 +2963,7 @@ void AddMemLocalCaching(code::Context& ctx)
 }
 
 // Resolve all exports in the module they originated from (in case any module is exporting an import)
-void ResolveModuleExports(const Environment* env, Module* root, llvm::LLVMContext& context)
+void ResolveModuleExports(const Environment* env, Module* root)
 {
   // Set ENV_HOMOGENIZE_FUNCTIONS flag appropriately.
   auto wrapperfn = (env->flags & ENV_HOMOGENIZE_FUNCTIONS) ? &HomogenizeFunction : &WrapFunction;
@@ -2689,7 +3000,7 @@ void ResolveModuleExports(const Environment* env, Module* root, llvm::LLVMContex
 
         if(ctx->dbuilder)
           ctx->builder.SetCurrentDebugLocation(
-            llvm::DILocation::get(context, ctx->init->getSubprogram()->getLine(), 0, ctx->init->getSubprogram()));
+            llvm::DILocation::get(ctx->context, ctx->init->getSubprogram()->getLine(), 0, ctx->init->getSubprogram()));
 
         auto name = std::string(e->name.str()) + "|" + m->name.str();
         ctx->functions[e->index].exported =
@@ -2720,21 +3031,319 @@ void ResolveModuleExports(const Environment* env, Module* root, llvm::LLVMContex
   }
 }
 
-IN_ERROR innative::CompileEnvironment(const Environment* env, const char* outfile)
+// Assigns every linear memory, table and global defined by a module in the environment to a field of the instance
+// structure, in module order so the layout stays the same when cached modules are reused. Exported state is imported by
+// other modules under the name of its alias, so those names map to the same field.
+std::vector<llvm::GlobalVariable*> GetInstanceFields(const Environment* env,
+                                                     std::unordered_map<std::string, unsigned>& fields)
 {
-  if(!outfile || !outfile[0])
-    return ERR_FATAL_NO_OUTPUT_FILE;
+  std::vector<llvm::GlobalVariable*> state;
+  auto AddField = [&](llvm::GlobalVariable* g) {
+    fields[g->getName().str()] = static_cast<unsigned>(state.size());
+    state.push_back(g);
+  };
 
-  path file = utility::GetPath(outfile);
+  for(varuint32 i = 0; i < env->n_modules; ++i)
+  {
+    code::Context& ctx = *env->modules[i].cache;
+    for(size_t j = ctx.m.importsection.tables - ctx.m.importsection.functions; j < ctx.tables.size(); ++j)
+      AddField(ctx.tables[j]);
+    for(size_t j = ctx.m.importsection.memories - ctx.m.importsection.tables; j < ctx.memories.size(); ++j)
+      AddField(ctx.memories[j]);
+    for(size_t j = ctx.m.importsection.globals - ctx.m.importsection.memories; j < ctx.globals.size(); ++j)
+      AddField(ctx.globals[j]);
 
-  if(!file.is_absolute())
-    file = utility::GetWorkingDir() / file;
+    for(auto& alias : ctx.llvm->aliases())
+    {
+      auto iter = fields.find(alias.getAliasee()->stripPointerCasts()->getName().str());
+      if(iter != fields.end())
+        fields[alias.getName().str()] = iter->second;
+    }
+  }
+
+  return state;
+}
+
+// Recreates a type from another module's context in this one. Module state only uses scalars, pointers, and the
+// anonymous structures that tables are made of.
+llvmTy* MapType(llvmTy* ty, llvm::LLVMContext& context)
+{
+  if(&ty->getContext() == &context)
+    return ty;
+
+  switch(ty->getTypeID())
+  {
+  case llvmTy::IntegerTyID: return llvm::IntegerType::get(context, ty->getIntegerBitWidth());
+  case llvmTy::PointerTyID:
+    return MapType(ty->getPointerElementType(), context)->getPointerTo(ty->getPointerAddressSpace());
+  case llvmTy::ArrayTyID:
+    return llvm::ArrayType::get(MapType(ty->getArrayElementType(), context), ty->getArrayNumElements());
+  case llvmTy::FunctionTyID:
+  {
+    std::vector<llvmTy*> params;
+    for(auto param : llvm::cast<FuncTy>(ty)->params())
+      params.push_back(MapType(param, context));
+    return FuncTy::get(MapType(llvm::cast<FuncTy>(ty)->getReturnType(), context), params, ty->isFunctionVarArg());
+  }
+  case llvmTy::StructTyID:
+  {
+    auto st = llvm::cast<llvm::StructType>(ty);
+    std::vector<llvmTy*> elements;
+    for(auto element : st->elements())
+      elements.push_back(MapType(element, context));
+    return st->isLiteral() ? llvm::StructType::get(context, elements, st->isPacked()) :
+                             llvm::StructType::create(context, elements, st->getName(), st->isPacked());
+  }
+  default: return llvmTy::getPrimitiveType(context, ty->getTypeID());
+  }
+}
+
+// Recreates the initial value of module state in another context, which is always a number or a null pointer
+llvm::Constant* MapConstant(llvm::Constant* value, llvmTy* ty)
+{
+  if(&value->getContext() == &ty->getContext())
+    return value;
+  if(auto i = llvm::dyn_cast<llvm::ConstantInt>(value))
+    return llvm::ConstantInt::get(ty, i->getValue());
+  if(auto f = llvm::dyn_cast<llvm::ConstantFP>(value))
+    return llvm::ConstantFP::get(ty->getContext(), f->getValueAPF());
+
+  assert(value->isNullValue());
+  return llvm::Constant::getNullValue(ty);
+}
+
+// Builds the instance structure in a module's own context. State this module declares or imports keeps the type it
+// was declared with, and everything else is recreated from the module that defines it.
+llvm::StructType* GetInstanceLayout(code::Context& ctx, llvm::ArrayRef<llvm::GlobalVariable*> state,
+                                    const std::unordered_map<std::string, unsigned>& fields)
+{
+  std::vector<llvmTy*> types;
+  for(auto g : state)
+    types.push_back(MapType(g->getValueType(), ctx.context));
+
+  for(auto list : { &ctx.tables, &ctx.memories, &ctx.globals })
+    for(auto g : *list)
+    {
+      auto iter = fields.find(g->getName().str());
+      if(iter != fields.end())
+        types[iter->second] = g->getValueType();
+    }
+
+  return llvm::StructType::create(ctx.context, types, "innative_instance");
+}
+
+// Declares the thread-local pointer to the current instance, which is only defined in the main module. The JIT can't
+// relocate thread-local variables, so like emulated TLS, it instead defines a key that the host maps to a thread-local
+// pointer, and declares the host function that returns the address of that pointer.
+llvm::Constant* DeclareInstanceVariable(code::Context& ctx, llvm::StructType* layout, bool define, bool jit)
+{
+  llvm::PointerType* ptr = layout->getPointerTo(0);
+  if(jit)
+  {
+    new llvm::GlobalVariable(*ctx.llvm, ctx.intptrty, false, llvm::GlobalValue::ExternalLinkage,
+                             define ? llvm::ConstantInt::get(ctx.intptrty, 0) : nullptr, IN_INSTANCE_KEY_VARIABLE);
+    Func* slot = Func::Create(FuncTy::get(ptr->getPointerTo(0), { ctx.intptrty->getPointerTo(0) }, false),
+                              Func::ExternalLinkage, IN_INSTANCE_SLOT_FUNCTION, ctx.llvm);
+    slot->setDoesNotThrow();
+    return slot;
+  }
+
+  auto current = new llvm::GlobalVariable(*ctx.llvm, ptr, false, llvm::GlobalValue::ExternalLinkage,
+                                          define ? llvm::ConstantPointerNull::get(ptr) : nullptr, IN_INSTANCE_VARIABLE);
+  current->setThreadLocalMode(llvm::GlobalValue::InitialExecTLSModel);
+  return current;
+}
+
+// Declares the process-wide pointer to the default instance created by the init function, which is used by threads
+// that never entered an instance of their own.
+llvm::GlobalVariable* DeclareDefaultInstance(code::Context& ctx, llvm::StructType* layout, bool define)
+{
+  llvm::PointerType* ptr = layout->getPointerTo(0);
+  return new llvm::GlobalVariable(*ctx.llvm, ptr, false, llvm::GlobalValue::ExternalLinkage,
+                                  define ? llvm::ConstantPointerNull::get(ptr) : nullptr, IN_INSTANCE_DEFAULT_VARIABLE);
+}
+
+// Returns the address of the calling thread's current instance pointer
+llvmVal* GetInstanceSlot(llvm::IRBuilder<>& builder, llvm::Constant* current)
+{
+  if(auto slot = llvm::dyn_cast<Func>(current))
+    return builder.CreateCall(slot, { slot->getParent()->getNamedGlobal(IN_INSTANCE_KEY_VARIABLE) });
+  return current;
+}
+
+// Rewrites every instruction that uses a constant, either directly or through constant expressions, to use the value
+// returned by get() instead. Constant expressions are rebuilt as instructions right after that value.
+void ReplaceConstantUses(llvm::Constant* value, const std::function<llvm::Instruction*(llvm::Instruction*)>& get)
+{
+  llvm::SmallVector<llvm::User*, 8> users(value->user_begin(), value->user_end());
+  for(auto user : users)
+  {
+    if(auto inst = llvm::dyn_cast<llvm::Instruction>(user))
+      inst->replaceUsesOfWith(value, get(inst));
+    else if(auto expr = llvm::dyn_cast<llvm::ConstantExpr>(user))
+      ReplaceConstantUses(expr, [&](llvm::Instruction* inst) {
+        llvm::Instruction* ptr    = get(inst);
+        llvm::Instruction* result = expr->getAsInstruction();
+        result->insertAfter(ptr);
+        result->replaceUsesOfWith(value, ptr);
+        return result;
+      });
+  }
+}
+
+// Replaces all the module state used by the functions in a module with pointers into the current instance, which is
+// loaded once at the start of each function. Threads that never entered an instance use the default one.
+void LowerInstanceState(code::Context& ctx, llvm::StructType* layout, llvm::Constant* current,
+                        llvm::GlobalVariable* fallback, const std::unordered_map<std::string, unsigned>& fields)
+{
+  std::unordered_map<Func*, llvm::Instruction*> instances;
+  std::map<std::pair<Func*, unsigned>, llvm::Instruction*> pointers;
+
+  std::vector<llvm::GlobalVariable*> state(ctx.tables.begin(), ctx.tables.end());
+  state.insert(state.end(), ctx.memories.begin(), ctx.memories.end());
+  state.insert(state.end(), ctx.globals.begin(), ctx.globals.end());
+  std::sort(state.begin(), state.end());
+  state.erase(std::unique(state.begin(), state.end()), state.end()); // Imports can share the same global
+
+  for(auto g : state)
+  {
+    auto field = fields.find(g->getName().str());
+    if(field == fields.end())
+      continue;
+
+    ReplaceConstantUses(g, [&](llvm::Instruction* inst) {
+      Func* fn                = inst->getFunction();
+      llvm::Instruction*& ptr = pointers[{ fn, field->second }];
+      if(!ptr)
+      {
+        llvm::Instruction*& instance = instances[fn];
+        if(!instance)
+        {
+          llvm::IRBuilder<> builder(&*fn->getEntryBlock().getFirstInsertionPt());
+          llvmVal* entered = builder.CreateLoad(GetInstanceSlot(builder, current));
+          instance         = llvm::cast<llvm::Instruction>(
+            builder.CreateSelect(builder.CreateIsNull(entered), builder.CreateLoad(fallback), entered, "instance"));
+        }
+
+        llvm::IRBuilder<> builder(instance->getNextNode());
+        ptr = llvm::cast<llvm::Instruction>(builder.CreateStructGEP(layout, instance, field->second, g->getName()));
+      }
+      return ptr;
+    });
+  }
+}
+
+// Generates the functions behind CreateInstance, ResetInstance, DestroyInstance and EnterInstance, and returns the one
+// that creates a new instance. New instances are copied from a template holding the initial value of every field, then
+// set up by running the init and start functions of every module while the new instance is current. Also fills in the
+// exit function, which destroys the default instance.
+Func* CompileInstanceFunctions(code::Context& mainctx, llvm::StructType* layout, llvm::ArrayRef<llvm::Constant*> init,
+                               llvm::Constant* current, llvm::GlobalVariable* fallback, Func* initialize,
+                               Func* finalize, Func* cleanup)
+{
+  llvm::IRBuilder<>& builder = mainctx.builder;
+  llvm::Module& m            = *mainctx.llvm;
+  auto bytes                 = builder.getInt8PtrTy(0);
+  auto null                  = llvm::ConstantPointerNull::get(layout->getPointerTo(0));
+  uint64_t size              = std::max<uint64_t>(m.getDataLayout().getTypeAllocSize(layout), 1);
+  Func* fn_memcpy            = m.getFunction("_innative_internal_env_memcpy");
+  Func* fn_memfree           = m.getFunction("_innative_internal_env_free_memory");
+
+  auto instance_template = new llvm::GlobalVariable(m, layout, true, llvm::GlobalValue::PrivateLinkage,
+                                                    llvm::ConstantStruct::get(layout, init),
+                                                    "_innative_internal_instance_template");
+
+  builder.SetCurrentDebugLocation(llvm::DebugLoc());
+  auto CreateFunction = [&](const char* name, llvmTy* ret, llvm::ArrayRef<llvmTy*> args) {
+    Func* fn = Func::Create(FuncTy::get(ret, args, false), Func::ExternalLinkage, name, m);
+    fn->setDLLStorageClass(llvm::GlobalValue::DLLStorageClassTypes::DLLExportStorageClass);
+    builder.SetInsertPoint(BB::Create(mainctx.context, "entry", fn));
+    return fn;
+  };
+  auto Call = [&](Func* fn, llvm::ArrayRef<llvmVal*> args) {
+    CallInst* call = builder.CreateCall(fn, args);
+    call->setCallingConv(fn->getCallingConv());
+    return call;
+  };
+  auto Enter = [&](llvmVal* slot, llvmVal* instance) {
+    llvmVal* prev = builder.CreateLoad(slot);
+    builder.CreateStore(builder.CreatePointerCast(instance, layout->getPointerTo(0)), slot);
+    return prev;
+  };
+  auto CopyTemplate = [&](llvmVal* instance) {
+    Call(fn_memcpy, { instance, builder.CreatePointerCast(instance_template, bytes), builder.getInt64(size) });
+  };
+
+  Func* create = CreateFunction(IN_INSTANCE_CREATE_FUNCTION, bytes, {});
+  {
+    llvmVal* instance = Call(mainctx.memgrow, { llvm::ConstantPointerNull::get(bytes), builder.getInt64(size),
+                                                builder.getInt64(0) });
+    BB* failblock     = BB::Create(mainctx.context, "fail", create);
+    BB* initblock     = BB::Create(mainctx.context, "init", create);
+    builder.CreateCondBr(builder.CreateIsNull(instance), failblock, initblock);
+
+    builder.SetInsertPoint(failblock);
+    builder.CreateRet(llvm::ConstantPointerNull::get(bytes));
+
+    builder.SetInsertPoint(initblock);
+    CopyTemplate(instance);
+    llvmVal* slot = GetInstanceSlot(builder, current);
+    llvmVal* prev = Enter(slot, instance);
+    Call(initialize, {});
+    builder.CreateStore(prev, slot);
+    builder.CreateRet(instance);
+  }
 
-  // Construct the LLVM environment and current working directories
-  if(!env->context)
-    const_cast<Environment*>(env)->context = new llvm::LLVMContext();
+  Func* reset = CreateFunction(IN_INSTANCE_RESET_FUNCTION, builder.getVoidTy(), { bytes });
+  {
+    llvmVal* instance = reset->arg_begin();
+    llvmVal* slot     = GetInstanceSlot(builder, current);
+    llvmVal* prev     = Enter(slot, instance);
+    Call(finalize, {});
+    CopyTemplate(instance);
+    Call(initialize, {});
+    builder.CreateStore(prev, slot);
+    builder.CreateRetVoid();
+  }
 
-  llvm::IRBuilder<> builder(*env->context);
+  // Destroying the default instance also forgets it, so the exit function won't free it a second time
+  Func* destroy = CreateFunction(IN_INSTANCE_DESTROY_FUNCTION, builder.getVoidTy(), { bytes });
+  {
+    llvmVal* instance = destroy->arg_begin();
+    llvmVal* typed    = builder.CreatePointerCast(instance, layout->getPointerTo(0));
+    llvmVal* slot     = GetInstanceSlot(builder, current);
+    llvmVal* prev     = Enter(slot, instance);
+    Call(finalize, {});
+    builder.CreateStore(builder.CreateSelect(builder.CreateICmpEQ(prev, typed), null, prev), slot);
+    llvmVal* def = builder.CreateLoad(fallback);
+    builder.CreateStore(builder.CreateSelect(builder.CreateICmpEQ(def, typed), null, def), fallback);
+    Call(fn_memfree, { instance });
+    builder.CreateRetVoid();
+  }
+
+  Func* enter = CreateFunction(IN_INSTANCE_ENTER_FUNCTION, bytes, { bytes });
+  builder.CreateRet(builder.CreatePointerCast(Enter(GetInstanceSlot(builder, current), enter->arg_begin()), bytes));
+
+  builder.SetInsertPoint(&cleanup->getEntryBlock());
+  if(mainctx.dbuilder)
+    builder.SetCurrentDebugLocation(GetSPLocation(mainctx, cleanup->getSubprogram()));
+  {
+    BB* exitblock    = BB::Create(mainctx.context, "exit", cleanup);
+    BB* destroyblock = BB::Create(mainctx.context, "destroy", cleanup);
+    llvmVal* def     = builder.CreateLoad(fallback);
+    builder.CreateCondBr(builder.CreateIsNull(def), exitblock, destroyblock);
+    builder.SetInsertPoint(destroyblock);
+    Call(destroy, { builder.CreatePointerCast(def, bytes) });
+    builder.CreateBr(exitblock);
+    builder.SetInsertPoint(exitblock);
+    builder.CreateRetVoid();
+  }
+
+  return create;
+}
+
+IN_ERROR innative::GenerateEnvironment(const Environment* env, const path& file)
+{
   bool has_start = false;
   IN_ERROR err   = ERR_SUCCESS;
 
@@ -2772,15 +3381,24 @@ IN_ERROR innative::CompileEnvironment(const Environment* env, const char* outfil
       subtarget_features.AddFeature(feature.first(), feature.second);
     }
   }
-  auto machine =
-    arch->createTargetMachine(triple, llvm::sys::getHostCPUName(), subtarget_features.getString(), opt, RM, llvm::None);
+
+  // The baseline tier skips every codegen optimization and forces FastISel, which trades code quality for compile speed
+  bool baseline = (env->optimize & ENV_OPTIMIZE_OMASK) == ENV_OPTIMIZE_BASELINE;
+  auto codegen  = baseline ? llvm::CodeGenOpt::None : llvm::CodeGenOpt::Default;
+  auto machine  = arch->createTargetMachine(triple, llvm::sys::getHostCPUName(), subtarget_features.getString(), opt, RM,
+                                            llvm::None, codegen);
+  if(baseline)
+  {
+    machine->setFastISel(true);
+    machine->setGlobalISel(false);
+  }
 
   if(!env->n_modules)
     return ERR_FATAL_NO_MODULES;
 
+  llvm::FastMathFlags fmf;
   if(env->optimize & ENV_OPTIMIZE_FAST_MATH)
   {
-    llvm::FastMathFlags fmf;
     if(env->optimize & ENV_OPTIMIZE_FAST_MATH_REASSOCIATE)
       fmf.setAllowReassoc();
     if(env->optimize & ENV_OPTIMIZE_FAST_MATH_NO_NAN)
@@ -2795,7 +3413,6 @@ IN_ERROR innative::CompileEnvironment(const Environment* env, const char* outfil
       fmf.setAllowContract();
     if(env->optimize & ENV_OPTIMIZE_FAST_MATH_ALLOW_APPROXIMATE_FUNCTIONS)
       fmf.setApproxFunc();
-    builder.setFastMathFlags(fmf);
   }
 
   std::vector<Module*> new_modules;
@@ -2807,14 +3424,21 @@ IN_ERROR innative::CompileEnvironment(const Environment* env, const char* outfil
     {
       if(env->modules[i].cache)
         DeleteCache(*env, env->modules[i]);
+
+      auto llvmcontext = std::make_unique<llvm::LLVMContext>();
+      auto irbuilder   = std::make_unique<llvm::IRBuilder<>>(*llvmcontext);
+      irbuilder->setFastMathFlags(fmf);
       env->modules[i].cache = new code::Context{ *env,
                                                  env->modules[i],
-                                                 *env->context,
+                                                 *llvmcontext,
                                                  0,
-                                                 builder,
+                                                 *irbuilder,
                                                  machine,
                                                  code::kh_init_importhash(),
-                                                 GetLinkerObjectPath(*env, env->modules[i], file) };
+                                                 file.empty() ? path() :
+                                                                GetLinkerObjectPath(*env, env->modules[i], file) };
+      env->modules[i].cache->ownedcontext = std::move(llvmcontext);
+      env->modules[i].cache->ownedbuilder = std::move(irbuilder);
       if(!env->modules[i].cache->objfile.empty())
         remove(env->modules[i].cache->objfile);
 
@@ -2826,7 +3450,7 @@ IN_ERROR innative::CompileEnvironment(const Environment* env, const char* outfil
   }
 
   for(auto m : new_modules)
-    ResolveModuleExports(env, m, *env->context);
+    ResolveModuleExports(env, m);
 
   for(auto m : new_modules)
     AddMemLocalCaching(*m->cache);
@@ -2834,9 +3458,40 @@ IN_ERROR innative::CompileEnvironment(const Environment* env, const char* outfil
   if((!has_start || env->flags & ENV_NO_INIT) && !(env->flags & ENV_LIBRARY))
     return ERR_FATAL_NO_START_FUNCTION; // We can't compile an EXE without at least one start function
 
+  code::Context& mainctx         = *env->modules[0].cache;
+  llvm::IRBuilder<>& builder     = mainctx.builder;
+  llvm::StructType* layout       = nullptr;
+  llvm::Constant* current        = nullptr;
+  llvm::GlobalVariable* fallback = nullptr;
+  std::vector<llvm::Constant*> layoutinit;
+
+  // Move all module state into the instance structure. The JIT is the only caller that doesn't write a file.
+  if(env->flags & ENV_INSTANCES)
+  {
+    std::unordered_map<std::string, unsigned> fields;
+    std::vector<llvm::GlobalVariable*> state = GetInstanceFields(env, fields);
+
+    // Every module has its own context, so each one gets its own copy of the instance structure
+    for(auto m : new_modules)
+    {
+      auto type = GetInstanceLayout(*m->cache, state, fields);
+      auto var  = DeclareInstanceVariable(*m->cache, type, m == env->modules, file.empty());
+      auto def  = DeclareDefaultInstance(*m->cache, type, m == env->modules);
+      LowerInstanceState(*m->cache, type, var, def, fields);
+      if(m == env->modules)
+      {
+        layout   = type;
+        current  = var;
+        fallback = def;
+      }
+    }
+
+    for(size_t i = 0; i < state.size(); ++i)
+      layoutinit.push_back(MapConstant(state[i]->getInitializer(), layout->getElementType((unsigned)i)));
+  }
+
   // Create cleanup function
-  code::Context& mainctx = *env->modules[0].cache;
-  Func* cleanup          = TopLevelFunction(*env->context, builder, IN_EXIT_FUNCTION, mainctx.llvm);
+  Func* cleanup = TopLevelFunction(mainctx.context, builder, IN_EXIT_FUNCTION, mainctx.llvm);
 
   if(mainctx.dbuilder)
   {
@@ -2844,11 +3499,25 @@ IN_ERROR innative::CompileEnvironment(const Environment* env, const char* outfil
     builder.SetCurrentDebugLocation(GetSPLocation(mainctx, cleanup->getSubprogram()));
   }
 
+  // With instances, every instance has to run the exit functions when it is reset or destroyed, so they go in their own
+  // function, and the exit function instead destroys the default instance.
+  Func* finalize = cleanup;
+  if(current != nullptr)
+  {
+    finalize = TopLevelFunction(mainctx.context, builder, "_innative_internal_instance_cleanup", mainctx.llvm);
+    finalize->setLinkage(Func::InternalLinkage);
+    if(mainctx.dbuilder)
+    {
+      FunctionDebugInfo(finalize, "_innative_internal_instance_cleanup", mainctx, true, true, 0);
+      builder.SetCurrentDebugLocation(GetSPLocation(mainctx, finalize->getSubprogram()));
+    }
+  }
+
   builder.CreateCall(mainctx.exit, {})->setCallingConv(mainctx.exit->getCallingConv());
 
   for(size_t i = 1; i < env->n_modules; ++i)
   {
-    Func* stub = Func::Create(env->modules[i].cache->exit->getFunctionType(), env->modules[i].cache->exit->getLinkage(),
+    Func* stub = Func::Create(FuncTy::get(builder.getVoidTy(), false), env->modules[i].cache->exit->getLinkage(),
                               env->modules[i].cache->exit->getName(),
                               mainctx.llvm); // Create function prototype in main module
     builder.CreateCall(stub, {})->setCallingConv(stub->getCallingConv());
@@ -2857,7 +3526,7 @@ IN_ERROR innative::CompileEnvironment(const Environment* env, const char* outfil
   builder.CreateRetVoid();
 
   // Create main function that calls all init functions for all modules and all start functions
-  Func* main = TopLevelFunction(*env->context, builder, IN_INIT_FUNCTION, nullptr);
+  Func* main = TopLevelFunction(mainctx.context, builder, IN_INIT_FUNCTION, nullptr);
 
   if(mainctx.dbuilder)
   {
@@ -2865,11 +3534,24 @@ IN_ERROR innative::CompileEnvironment(const Environment* env, const char* outfil
     builder.SetCurrentDebugLocation(GetSPLocation(mainctx, main->getSubprogram()));
   }
 
+  // With instances, every new instance has to run the init and start functions, so they go in their own function
+  Func* initialize = main;
+  if(current != nullptr)
+  {
+    initialize = TopLevelFunction(mainctx.context, builder, "_innative_internal_instance_init", mainctx.llvm);
+    initialize->setLinkage(Func::InternalLinkage);
+    if(mainctx.dbuilder)
+    {
+      FunctionDebugInfo(initialize, "_innative_internal_instance_init", mainctx, true, true, 0);
+      builder.SetCurrentDebugLocation(GetSPLocation(mainctx, initialize->getSubprogram()));
+    }
+  }
+
   builder.CreateCall(mainctx.init, {})->setCallingConv(mainctx.init->getCallingConv());
 
   for(size_t i = 1; i < env->n_modules; ++i)
   {
-    Func* stub = Func::Create(env->modules[i].cache->init->getFunctionType(), env->modules[i].cache->init->getLinkage(),
+    Func* stub = Func::Create(FuncTy::get(builder.getVoidTy(), false), env->modules[i].cache->init->getLinkage(),
                               env->modules[i].cache->init->getName(),
                               mainctx.llvm); // Create function prototype in main module
     builder.CreateCall(stub, {})->setCallingConv(stub->getCallingConv());
@@ -2887,13 +3569,27 @@ IN_ERROR innative::CompileEnvironment(const Environment* env, const char* outfil
         mainctx.llvm->getFunction(env->modules[i].cache->start->getName()); // Catch the case where an import from this
                                                                             // module is being called from another module
       if(!stub)
-        stub = Func::Create(env->modules[i].cache->start->getFunctionType(), env->modules[i].cache->start->getLinkage(),
+        stub = Func::Create(FuncTy::get(builder.getVoidTy(), false), env->modules[i].cache->start->getLinkage(),
                             env->modules[i].cache->start->getName(),
                             mainctx.llvm); // Create function prototype in main module
       builder.CreateCall(stub, {})->setCallingConv(stub->getCallingConv());
     }
   }
 
+  if(initialize != main) // The init function creates a default instance and makes it current
+  {
+    builder.CreateRetVoid();
+    Func* create =
+      CompileInstanceFunctions(mainctx, layout, layoutinit, current, fallback, initialize, finalize, cleanup);
+
+    builder.SetInsertPoint(&main->getEntryBlock());
+    if(mainctx.dbuilder)
+      builder.SetCurrentDebugLocation(GetSPLocation(mainctx, main->getSubprogram()));
+    llvmVal* instance = builder.CreatePointerCast(builder.CreateCall(create, {}), layout->getPointerTo(0));
+    builder.CreateStore(instance, fallback);
+    builder.CreateStore(instance, GetInstanceSlot(builder, current));
+  }
+
   if(env->flags & ENV_LIBRARY)
   {
     if(env->flags & ENV_NO_INIT)
@@ -2933,7 +3629,7 @@ IN_ERROR innative::CompileEnvironment(const Environment* env, const char* outfil
                                { builder.getInt8PtrTy(), mainctx.builder.getInt32Ty(), builder.getInt8PtrTy() }, false),
                    Func::ExternalLinkage, IN_INIT_FUNCTION "-stub");
     mainstub->setCallingConv(llvm::CallingConv::X86_StdCall);
-    BB* entryblock = BB::Create(*env->context, "entry", mainstub);
+    BB* entryblock = BB::Create(mainctx.context, "entry", mainstub);
     builder.SetInsertPoint(entryblock);
     if(mainctx.dbuilder)
     {
@@ -2944,9 +3640,9 @@ IN_ERROR innative::CompileEnvironment(const Environment* env, const char* outfil
     if(!(env->flags & ENV_NO_INIT)) // Only actually initialize things on DLL load if we actually want to, otherwise
                                     // create a stub function
     {
-      BB* endblock  = BB::Create(*env->context, "end", mainstub);
-      BB* initblock = BB::Create(*env->context, "init", mainstub);
-      BB* exitblock = BB::Create(*env->context, "exit", mainstub);
+      BB* endblock  = BB::Create(mainctx.context, "end", mainstub);
+      BB* initblock = BB::Create(mainctx.context, "init", mainstub);
+      BB* exitblock = BB::Create(mainctx.context, "exit", mainstub);
 
       llvm::SwitchInst* s = builder.CreateSwitch(mainstub->arg_begin() + 1, endblock, 2);
       s->addCase(mainctx.builder.getInt32(1), initblock); // DLL_PROCESS_ATTACH
@@ -2968,8 +3664,29 @@ IN_ERROR innative::CompileEnvironment(const Environment* env, const char* outfil
   }
 #endif
 
-  if(env->optimize & ENV_OPTIMIZE_OMASK)
-    OptimizeModules(env);
+  return ERR_SUCCESS;
+}
+
+IN_ERROR innative::CompileEnvironment(const Environment* env, const char* outfile)
+{
+  if(!outfile || !outfile[0])
+    return ERR_FATAL_NO_OUTPUT_FILE;
+
+  path file = utility::GetPath(outfile);
+
+  if(!file.is_absolute())
+    file = utility::GetWorkingDir() / file;
+
+  // If every module already has an object file in the cache, we can skip code generation and go straight to linking
+  if(env->cachepath && HasCachedObjects(*env))
+    return LinkEnvironment(env, file);
+
+  IN_ERROR err = GenerateEnvironment(env, file);
+  if(err < 0)
+    return err;
+
+  if((env->optimize & ENV_OPTIMIZE_OMASK) || kh_size(env->optimizehints) > 0)
+    OptimizeModules(env, UsesLTO(*env));
 
-  return LinkEnvironment(env, outfile);
+  return LinkEnvironment(env, file);
 }
@@ -6,12 +6,15 @@
 
 #include "innative/schema.h"
 #include "constants.h"
+#include "filesys.h"
 #include <vector>
 #include <string>
 
 namespace innative {
+  IN_ERROR GenerateEnvironment(const Environment* env, const path& file);
   IN_ERROR CompileEnvironment(const Environment* env, const char* file);
   int GetCallingConvention(const Import& imp);
+  std::string GenFlagString(const Environment& env);
 }
 
 #endif
@@ -286,6 +286,7 @@ namespace innative {
       { ERR_FATAL_NO_OUTPUT_FILE, "ERR_FATAL_NO_OUTPUT_FILE" },
       { ERR_FATAL_NO_MODULES, "ERR_FATAL_NO_MODULES" },
       { ERR_FATAL_NO_START_FUNCTION, "ERR_FATAL_NO_START_FUNCTION" },
+      { ERR_FATAL_JIT_ERROR, "ERR_FATAL_JIT_ERROR" },
       { ERR_VALIDATION_ERROR, "ERR_VALIDATION_ERROR" },
       { ERR_INVALID_FUNCTION_SIG, "ERR_INVALID_FUNCTION_SIG" },
       { ERR_INVALID_FUNCTION_INDEX, "ERR_INVALID_FUNCTION_INDEX" },
@@ -118,6 +118,15 @@ namespace innative {
     static const unsigned int WASM_MAGIC_COOKIE  = 0x6d736100;
     static const unsigned int WASM_MAGIC_VERSION = 0x01;
 
+    static const unsigned int IN_CODEGEN_PARTITION_MIN_FUNCTIONS = 256; // Minimum number of function bodies per partition
+    static const unsigned int IN_PARALLEL_PARSE_MIN_FUNCTIONS = 64; // Minimum number of function bodies per parse thread
+    static const size_t IN_ALLOCATOR_THREAD_CHUNK = 1 << 16; // Bytes each thread takes from the allocator at once
+    static const size_t IN_ALLOCATOR_THREAD_SLOTS = 4; // Number of allocators each thread keeps a chunk from
+    static const size_t IN_SCRATCH_BLOCK = 1 << 16; // Minimum size of each block in a thread's scratch arena
+    static const size_t IN_SCRATCH_RETAIN = 1 << 20; // Scratch memory a thread keeps after its outermost scope ends
+    static const unsigned int IN_TIER_UP_THRESHOLD = 10000; // Calls plus loop iterations before a function is optimized
+    static const uint64_t IN_MEMORY_GUARD_RESERVE  = (1ULL << 33) + 0x10000; // Every i32 address plus every i32 offset
+
     extern const kh_mapenum_s* ERR_ENUM_MAP;
     extern const kh_mapenum_s* TYPE_ENCODING_MAP;
     extern const kh_mapenum_s* WAST_ASSERTION_MAP;
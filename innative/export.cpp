@@ -3,6 +3,7 @@
 
 #include "innative/export.h"
 #include "tools.h"
+#include "jit.h"
 #include "util.h"
 
 using namespace innative;
@@ -28,6 +29,13 @@ void innative_runtime(IRExports* exports)
   exports->CompileScript         = &CompileScript;
   exports->SerializeModule       = &SerializeModule;
   exports->DestroyEnvironment    = &DestroyEnvironment;
+  exports->CompileJIT            = &CompileJIT;
+  exports->CreateInstance        = &CreateInstance;
+  exports->ResetInstance         = &ResetInstance;
+  exports->DestroyInstance       = &DestroyInstance;
+  exports->EnterInstance         = &EnterInstance;
+  exports->GetMemoryUsage        = &GetMemoryUsage;
+  exports->AddOptimization       = &AddOptimization;
 }
 
 void innative_set_work_dir_to_bin(const char* arg0)
@@ -0,0 +1,589 @@
+// Copyright (c)2019 Black Sphere Studios
+// For conditions of distribution and use, see copyright notice in innative.h
+
+#include "util.h"
+#include "llvm.h"
+#include "jit.h"
+#include "compile.h"
+#include "link.h"
+#include "tools.h"
+#include "optimize.h"
+#include "innative/export.h"
+#pragma warning(push)
+#pragma warning(disable : 4146 4267 4141 4244 4624)
+#include "llvm/IR/Verifier.h"
+#include "llvm/IR/Dominators.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/ExecutionEngine/Orc/LLJIT.h"
+#include "llvm/ExecutionEngine/Orc/ExecutionUtils.h"
+#include "llvm/Object/Archive.h"
+#include "llvm/BinaryFormat/Magic.h"
+#include "llvm/Support/DynamicLibrary.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Transforms/Utils/BasicBlockUtils.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#pragma warning(pop)
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <atomic>
+#include <unordered_set>
+
+using namespace innative;
+
+using Func   = llvm::Function;
+using FuncTy = llvm::FunctionType;
+
+namespace innative {
+  struct TierFunction
+  {
+    std::string name; // Name of the thunk that every call goes through, which the optimized version is derived from
+    bool queued;
+  };
+
+  // Holds everything the background worker needs to recompile hot functions with optimizations in tiered mode.
+  struct TierState
+  {
+    ~TierState()
+    {
+      {
+        std::lock_guard<std::mutex> guard(lock);
+        quit = true;
+      }
+      cv.notify_one();
+      if(worker.joinable())
+        worker.join();
+    }
+
+    std::vector<llvm::orc::ThreadSafeContext> contexts; // Destroyed after the sources that live in them
+    std::vector<std::unique_ptr<llvm::Module>> sources;  // Uninstrumented copy of each module
+    std::vector<std::vector<TierFunction>> functions;
+    llvm::orc::LLJIT* jit;
+    uint64_t optimize;
+    bool debug;
+    FILE* log; // If not null, every function that tiers up is logged here
+    std::mutex lock;
+    std::condition_variable cv;
+    std::deque<std::pair<uint32_t, uint32_t>> queue;
+    bool quit;
+    std::thread worker;
+  };
+
+  struct JITAssembly
+  {
+    std::unique_ptr<llvm::orc::LLJIT> jit;
+    bool init; // If true, we called the init function and must call the exit function when the assembly is freed
+    std::unique_ptr<TierState> tier; // Must be destroyed before the JIT, because the worker thread uses it
+  };
+}
+
+IN_ERROR LogJITError(const Environment& env, llvm::Error err)
+{
+  std::string msg = llvm::toString(std::move(err));
+  if(env.loglevel >= LOG_FATAL)
+    fprintf(env.log, "JIT error: %s\n", msg.c_str());
+  return ERR_FATAL_JIT_ERROR;
+}
+
+JITAssembly* GetJITAssembly(void* assembly)
+{
+  return reinterpret_cast<JITAssembly*>(reinterpret_cast<size_t>(assembly) & ~size_t(1));
+}
+
+// Embeddings given as paths are searched for the same way the linker would find them
+path FindEmbedding(const Environment& env, const char* file)
+{
+  path src = utility::GetPath(file);
+  if(src.is_absolute())
+    return src;
+
+  for(auto& dir : { utility::GetPath(env.libpath), utility::GetWorkingDir(), utility::GetPath(env.rootpath) })
+  {
+    FILE* f;
+    FOPEN(f, (dir / src).c_str(), "rb");
+    if(f)
+    {
+      fclose(f);
+      return dir / src;
+    }
+  }
+
+  return src;
+}
+
+// Static libraries are not linked in JIT mode, so every object file they contain is handed to the JIT instead, which only
+// materializes the ones that are actually referenced.
+IN_ERROR AddStaticEmbedding(const Environment& env, llvm::orc::LLJIT& jit, const Embedding& embed)
+{
+  std::unique_ptr<llvm::MemoryBuffer> buffer;
+  if(embed.size > 0)
+    buffer = llvm::MemoryBuffer::getMemBuffer(
+      llvm::StringRef(reinterpret_cast<const char*>(embed.data), (size_t)embed.size), "embedding", false);
+  else
+  {
+    auto file = llvm::MemoryBuffer::getFile(FindEmbedding(env, (const char*)embed.data).u8string());
+    if(!file)
+    {
+      if(env.loglevel >= LOG_FATAL)
+        fprintf(env.log, "Error loading file: %s\n", (const char*)embed.data);
+      return ERR_FATAL_FILE_ERROR;
+    }
+    buffer = std::move(file.get());
+  }
+
+  if(llvm::identify_magic(buffer->getBuffer()) != llvm::file_magic::archive)
+  {
+    if(auto err = jit.addObjectFile(llvm::MemoryBuffer::getMemBufferCopy(buffer->getBuffer(),
+                                                                         buffer->getBufferIdentifier())))
+      return LogJITError(env, std::move(err));
+    return ERR_SUCCESS;
+  }
+
+  auto archive = llvm::object::Archive::create(buffer->getMemBufferRef());
+  if(!archive)
+    return LogJITError(env, archive.takeError());
+
+  llvm::Error childerr = llvm::Error::success();
+  for(auto& child : (*archive)->children(childerr))
+  {
+    auto member = child.getMemoryBufferRef();
+    if(!member)
+      return LogJITError(env, member.takeError());
+    if(llvm::identify_magic(member->getBuffer()) == llvm::file_magic::archive) // Skip nested symbol tables
+      continue;
+    if(auto err = jit.addObjectFile(llvm::MemoryBuffer::getMemBufferCopy(member->getBuffer(),
+                                                                         member->getBufferIdentifier())))
+      return LogJITError(env, std::move(err));
+  }
+
+  if(childerr)
+    return LogJITError(env, std::move(childerr));
+  return ERR_SUCCESS;
+}
+
+IN_ERROR AddEmbeddings(const Environment& env, llvm::orc::LLJIT& jit)
+{
+  for(Embedding* cur = env.embeddings; cur != nullptr; cur = cur->next)
+  {
+    if(cur->tag == IN_TAG_DYNAMIC)
+    {
+      // Shared libraries are loaded into the process, where the JIT's process symbol generator can find them.
+      std::string err;
+      if(cur->size > 0 ||
+         llvm::sys::DynamicLibrary::LoadLibraryPermanently(FindEmbedding(env, (const char*)cur->data).u8string().c_str(),
+                                                          &err))
+      {
+        if(env.loglevel >= LOG_FATAL)
+          fprintf(env.log, "Error loading shared library embedding: %s\n",
+                  cur->size > 0 ? "in-memory shared libraries are not supported" : err.c_str());
+        return ERR_FATAL_FILE_ERROR;
+      }
+    }
+    else
+    {
+      IN_ERROR e = AddStaticEmbedding(env, jit, *cur);
+      if(e < 0)
+        return e;
+    }
+  }
+
+  return ERR_SUCCESS;
+}
+
+// Called by code compiled with ENV_INSTANCES to find the calling thread's current instance pointer. Every assembly has
+// its own key, which is given an index the first time it is used. Indexes are never reused, so a thread never sees a
+// pointer left behind by an assembly that was freed.
+void** InstanceSlot(std::atomic<size_t>* key)
+{
+  static std::atomic<size_t> count(0);
+  thread_local std::deque<void*> slots; // Growing a deque at the end never moves the existing slots
+
+  size_t index = key->load(std::memory_order_acquire);
+  if(!index)
+  {
+    size_t next = ++count;
+    index       = key->compare_exchange_strong(index, next, std::memory_order_acq_rel) ? next : index;
+  }
+  if(slots.size() < index)
+    slots.resize(index, nullptr);
+  return &slots[index - 1];
+}
+
+// Called by instrumented code when a function becomes hot
+void TierUp(TierState* state, uint32_t module, uint32_t function)
+{
+  std::lock_guard<std::mutex> guard(state->lock);
+  TierFunction& f = state->functions[module][function];
+  if(f.queued) // A function can become hot at its entry and at each of its loops, but is only ever recompiled once
+    return;
+
+  f.queued = true;
+  state->queue.emplace_back(module, function);
+  state->cv.notify_one();
+}
+
+void CompileTier(TierState& state, uint32_t module, uint32_t function)
+{
+  const std::string& name = state.functions[module][function].name;
+  std::unique_ptr<llvm::Module> tier;
+
+  {
+    // The hot function is cloned along with private copies of every function it calls directly, so they can be inlined.
+    // Everything else it references is resolved against the baseline module, so indirect calls and calls made by the
+    // copies still go through the thunks of the baseline functions.
+    auto lock = state.contexts[module].getLock();
+    Func* hot = state.sources[module]->getFunction(name);
+    std::unordered_set<const llvm::GlobalValue*> clone = { hot };
+    for(auto& block : *hot)
+      for(auto& inst : block)
+        if(auto call = llvm::dyn_cast<llvm::CallInst>(&inst))
+          if(auto callee = call->getCalledFunction())
+            if(!callee->isDeclaration())
+              clone.insert(callee);
+
+    llvm::ValueToValueMapTy vmap;
+    tier = llvm::CloneModule(*state.sources[module], vmap,
+                             [&clone](const llvm::GlobalValue* gv) { return clone.count(gv) > 0; });
+    for(auto gv : clone)
+      if(gv != hot)
+      {
+        Func* copy = tier->getFunction(gv->getName());
+        copy->setLinkage(Func::InternalLinkage);
+        copy->setVisibility(llvm::GlobalValue::DefaultVisibility);
+        copy->setDLLStorageClass(llvm::GlobalValue::DefaultStorageClass);
+      }
+    tier->getFunction(name)->setName(name + "$tier1");
+    OptimizeModule(*tier, state.optimize, state.debug);
+  }
+
+  if(auto err = state.jit->addIRModule(llvm::orc::ThreadSafeModule(std::move(tier), state.contexts[module])))
+  {
+    llvm::consumeError(std::move(err));
+    return;
+  }
+
+  auto fn  = state.jit->lookup(name + "$tier1");
+  auto ptr = state.jit->lookup(name + "$ptr");
+  if(fn && ptr) // Running code loads the pointer atomically, so it sees either the old or the new version
+  {
+    reinterpret_cast<std::atomic<void*>*>(ptr->getAddress())
+      ->store(reinterpret_cast<void*>(fn->getAddress()), std::memory_order_release);
+    if(state.log)
+    {
+      fprintf(state.log, "Tiered up %s\n", name.c_str());
+      fflush(state.log);
+    }
+  }
+  if(!fn)
+    llvm::consumeError(fn.takeError());
+  if(!ptr)
+    llvm::consumeError(ptr.takeError());
+}
+
+void TierWorker(TierState* state)
+{
+  std::unique_lock<std::mutex> guard(state->lock);
+  for(;;)
+  {
+    state->cv.wait(guard, [state]() { return state->quit || !state->queue.empty(); });
+    if(state->quit)
+      return;
+
+    auto request = state->queue.front();
+    state->queue.pop_front();
+    guard.unlock();
+    CompileTier(*state, request.first, request.second);
+    guard.lock();
+  }
+}
+
+// The optimized version of a function lives in a different module than the baseline, so nothing can have local linkage.
+void PromoteLocals(code::Context& context)
+{
+  for(auto& gv : context.llvm->global_values())
+    if(gv.hasLocalLinkage())
+    {
+      gv.setName(utility::CanonicalName(utility::StringRef::From(context.m.name),
+                                        utility::StringRef{ gv.getName().data(), gv.getName().size() }));
+      gv.setLinkage(llvm::GlobalValue::ExternalLinkage);
+    }
+}
+
+// Loads the current version of a function. Other threads can swap it at any time, so the load has to be atomic.
+llvm::Value* LoadTierPointer(llvm::IRBuilder<>& builder, llvm::GlobalVariable* ptr)
+{
+  llvm::LoadInst* load = builder.CreateLoad(ptr->getValueType(), ptr);
+  load->setAlignment(ptr->getParent()->getDataLayout().getPointerABIAlignment(0));
+  load->setAtomic(llvm::AtomicOrdering::Monotonic);
+  return load;
+}
+
+// Counters are shared by every thread running the function. Only the count matters, so the increment is relaxed, and
+// exactly one thread sees it reach the threshold.
+void InsertTierCounter(llvm::Instruction* at, llvm::GlobalVariable* counter, Func* tierup, llvm::ArrayRef<llvm::Value*> args)
+{
+  llvm::IRBuilder<> builder(at);
+  llvm::Value* count = builder.CreateAtomicRMW(llvm::AtomicRMWInst::Add, counter, builder.getInt32(1),
+                                               llvm::AtomicOrdering::Monotonic);
+  llvm::Instruction* hot = llvm::SplitBlockAndInsertIfThen(
+    builder.CreateICmpEQ(count, builder.getInt32(utility::IN_TIER_UP_THRESHOLD - 1)), at, false);
+  builder.SetInsertPoint(hot);
+  builder.CreateCall(tierup, args);
+}
+
+// Every wasm function is renamed and replaced with a thunk that tail calls whatever its pointer global currently holds,
+// which starts out as the unoptimized body. Direct calls in the same module load the pointer themselves, so only calls
+// from other modules, exports and tables go through the thunk. The body counts how often it is entered and how often
+// its loops iterate.
+void InstrumentTiers(TierState& state, code::Context& context)
+{
+  uint32_t index = (uint32_t)state.functions.size();
+  state.functions.emplace_back();
+
+  llvm::IRBuilder<> builder(context.context);
+  Func* tierup = Func::Create(
+    FuncTy::get(builder.getVoidTy(), { builder.getInt8PtrTy(), builder.getInt32Ty(), builder.getInt32Ty() }, false),
+    Func::ExternalLinkage, "_innative_internal_tier_up", context.llvm);
+  llvm::Constant* self = llvm::ConstantExpr::getIntToPtr(
+    llvm::ConstantInt::get(context.intptrty, reinterpret_cast<size_t>(&state)), builder.getInt8PtrTy());
+
+  for(auto& f : context.functions)
+  {
+    Func* body = f.internal;
+    if(f.imported || f.intrinsic || !body || body->isDeclaration())
+      continue;
+
+    std::string name = body->getName().str();
+    uint32_t id      = (uint32_t)state.functions[index].size();
+    state.functions[index].push_back(TierFunction{ name, false });
+
+    body->setName(name + "$tier0");
+    Func* thunk = Func::Create(body->getFunctionType(), body->getLinkage(), name, context.llvm);
+    thunk->setCallingConv(body->getCallingConv());
+    body->replaceAllUsesWith(thunk);
+
+    auto ptr = new llvm::GlobalVariable(*context.llvm, body->getType(), false, llvm::GlobalValue::ExternalLinkage, body,
+                                        name + "$ptr");
+
+    builder.SetInsertPoint(llvm::BasicBlock::Create(context.context, "entry", thunk));
+    std::vector<llvm::Value*> args;
+    for(auto& arg : thunk->args())
+      args.push_back(&arg);
+
+    llvm::CallInst* call = builder.CreateCall(body->getFunctionType(), LoadTierPointer(builder, ptr), args);
+    call->setCallingConv(body->getCallingConv());
+    call->setTailCallKind(llvm::CallInst::TCK_MustTail);
+    if(thunk->getReturnType()->isVoidTy())
+      builder.CreateRetVoid();
+    else
+      builder.CreateRet(call);
+
+    llvm::SmallVector<llvm::CallInst*, 8> calls;
+    for(auto user : thunk->users())
+      if(auto direct = llvm::dyn_cast<llvm::CallInst>(user))
+        if(direct->getCalledFunction() == thunk)
+          calls.push_back(direct);
+    for(auto direct : calls)
+    {
+      builder.SetInsertPoint(direct);
+      direct->setCalledFunction(body->getFunctionType(), LoadTierPointer(builder, ptr));
+    }
+
+    auto counter = new llvm::GlobalVariable(*context.llvm, builder.getInt32Ty(), false,
+                                            llvm::GlobalValue::ExternalLinkage, builder.getInt32(0), name + "$count");
+
+    // The entry counter goes at the end of the entry block so all the local allocas stay in the entry block
+    std::vector<llvm::Instruction*> points = { body->getEntryBlock().getTerminator() };
+    llvm::DominatorTree dt(*body);
+    llvm::LoopInfo loops(dt);
+    for(auto loop : loops.getLoopsInPreorder())
+      points.push_back(&*loop->getHeader()->getFirstInsertionPt());
+
+    for(auto at : points)
+      InsertTierCounter(at, counter, tierup, { self, builder.getInt32(index), builder.getInt32(id) });
+  }
+}
+
+IN_ERROR innative::CompileJIT(Environment* env, void** assembly)
+{
+  if(!env || !assembly)
+    return ERR_FATAL_NULL_POINTER;
+  *assembly = nullptr;
+
+  IN_ERROR err = Validate(env);
+  if(err != ERR_SUCCESS)
+    return err;
+
+  // There is no process entry point in JIT mode, so the init and exit functions are generated the same way they are for
+  // a library.
+  uint64_t flags = env->flags;
+  env->flags |= ENV_LIBRARY;
+  err = GenerateEnvironment(env, path());
+  env->flags = flags;
+  if(err < 0)
+    return err;
+
+  // In lazy mode, each function is optimized on its own right before it is compiled instead, and in tiered mode only hot
+  // functions are optimized.
+  if(((env->optimize & ENV_OPTIMIZE_OMASK) || kh_size(env->optimizehints) > 0) &&
+     !(env->flags & (ENV_LAZY_COMPILE | ENV_TIERED_COMPILE)))
+    OptimizeModules(env, false);
+
+  for(varuint32 i = 0; i < env->n_modules; ++i)
+  {
+    if(env->modules[i].cache->dbuilder)
+      env->modules[i].cache->dbuilder->finalize();
+
+    llvm::raw_fd_ostream dest(1, false, true);
+    if(llvm::verifyModule(*env->modules[i].cache->llvm, &dest))
+      return ERR_FATAL_INVALID_MODULE;
+  }
+
+  std::unique_ptr<TierState> tier;
+  if(env->flags & ENV_TIERED_COMPILE)
+  {
+    tier.reset(new TierState{});
+    tier->optimize = env->optimize;
+    if(!(env->optimize & ENV_OPTIMIZE_OMASK) || (env->optimize & ENV_OPTIMIZE_OMASK) == ENV_OPTIMIZE_BASELINE)
+      tier->optimize = (env->optimize & ~ENV_OPTIMIZE_OMASK) | ENV_OPTIMIZE_O3;
+    tier->debug = env->loglevel >= LOG_DEBUG;
+    tier->log   = env->loglevel >= LOG_NOTICE ? env->log : nullptr;
+
+    for(varuint32 i = 0; i < env->n_modules; ++i)
+      PromoteLocals(*env->modules[i].cache);
+
+    for(varuint32 i = 0; i < env->n_modules; ++i)
+    {
+      tier->sources.push_back(llvm::CloneModule(*env->modules[i].cache->llvm));
+      InstrumentTiers(*tier, *env->modules[i].cache);
+    }
+  }
+
+  auto machine = llvm::orc::JITTargetMachineBuilder::detectHost();
+  if(!machine)
+    return LogJITError(*env, machine.takeError());
+
+  // The baseline tier trades code quality for compile speed by skipping every codegen optimization
+  if((env->optimize & ENV_OPTIMIZE_OMASK) == ENV_OPTIMIZE_BASELINE)
+  {
+    machine->setCodeGenOptLevel(llvm::CodeGenOpt::None);
+    machine->getOptions().EnableFastISel = true;
+  }
+
+  std::unique_ptr<llvm::orc::LLJIT> jit;
+  llvm::orc::LLLazyJIT* lazy = nullptr;
+  if(env->flags & ENV_LAZY_COMPILE)
+  {
+    // Every function is split into its own partition behind a stub that compiles it on the first call
+    auto result = llvm::orc::LLLazyJITBuilder().setJITTargetMachineBuilder(std::move(*machine)).create();
+    if(!result)
+      return LogJITError(*env, result.takeError());
+
+    if((env->optimize & ENV_OPTIMIZE_OMASK) && !tier)
+    {
+      uint64_t optimize = env->optimize;
+      bool debug        = env->loglevel >= LOG_DEBUG;
+      (*result)->setLazyCompileTransform(
+        [optimize, debug](llvm::orc::ThreadSafeModule tsm,
+                          const llvm::orc::MaterializationResponsibility&) -> llvm::Expected<llvm::orc::ThreadSafeModule> {
+          auto lock = tsm.getContextLock();
+          OptimizeModule(*tsm.getModule(), optimize, debug);
+          return std::move(tsm);
+        });
+    }
+
+    lazy = result->get();
+    jit  = std::move(*result);
+  }
+  else
+  {
+    auto result = llvm::orc::LLJITBuilder().setJITTargetMachineBuilder(std::move(*machine)).create();
+    if(!result)
+      return LogJITError(*env, result.takeError());
+    jit = std::move(*result);
+  }
+
+  // Anything not defined by the modules or a static embedding is resolved against the host process, which is where the
+  // environment functions live when the host links against the default environment.
+  auto generator =
+    llvm::orc::DynamicLibrarySearchGenerator::GetForCurrentProcess(jit->getDataLayout().getGlobalPrefix());
+  if(!generator)
+    return LogJITError(*env, generator.takeError());
+  jit->getMainJITDylib().setGenerator(std::move(*generator));
+
+  if((err = AddEmbeddings(*env, *jit)) < 0)
+    return err;
+
+  llvm::orc::SymbolMap symbols;
+  if(tier)
+    symbols[jit->mangleAndIntern("_innative_internal_tier_up")] =
+      llvm::JITEvaluatedSymbol(llvm::pointerToJITTargetAddress(&TierUp), llvm::JITSymbolFlags::Exported);
+  if(env->flags & ENV_INSTANCES)
+    symbols[jit->mangleAndIntern(IN_INSTANCE_SLOT_FUNCTION)] =
+      llvm::JITEvaluatedSymbol(llvm::pointerToJITTargetAddress(&InstanceSlot), llvm::JITSymbolFlags::Exported);
+  if(!symbols.empty())
+    if(auto e = jit->getMainJITDylib().define(llvm::orc::absoluteSymbols(std::move(symbols))))
+      return LogJITError(*env, std::move(e));
+
+  // The JIT takes ownership of each module and the LLVM context it lives in, so the module caches are destroyed first.
+  std::vector<llvm::orc::ThreadSafeModule> modules;
+  for(varuint32 i = 0; i < env->n_modules; ++i)
+  {
+    llvm::orc::ThreadSafeContext context(std::move(env->modules[i].cache->ownedcontext));
+    if(tier)
+      tier->contexts.push_back(context);
+    modules.emplace_back(std::unique_ptr<llvm::Module>(env->modules[i].cache->llvm), context);
+    env->modules[i].cache->llvm = nullptr;
+    DeleteCache(*env, env->modules[i]);
+  }
+
+  for(auto& m : modules)
+    if(auto e = !lazy ? jit->addIRModule(std::move(m)) : lazy->addLazyIRModule(std::move(m)))
+      return LogJITError(*env, std::move(e));
+
+  if(tier)
+  {
+    tier->jit    = jit.get();
+    tier->worker = std::thread(&TierWorker, tier.get());
+  }
+
+  JITAssembly* result = new JITAssembly{ std::move(jit), !(env->flags & ENV_NO_INIT), std::move(tier) };
+  if(result->init)
+  {
+    auto init = result->jit->lookup(IN_INIT_FUNCTION);
+    if(!init)
+    {
+      delete result;
+      return LogJITError(*env, init.takeError());
+    }
+    reinterpret_cast<IN_Entrypoint>(init->getAddress())();
+  }
+
+  *assembly = reinterpret_cast<void*>(reinterpret_cast<size_t>(result) | 1);
+  return ERR_SUCCESS;
+}
+
+void* innative::LoadJITSymbol(void* assembly, const char* name)
+{
+  auto symbol = GetJITAssembly(assembly)->jit->lookup(name);
+  if(!symbol)
+  {
+    llvm::consumeError(symbol.takeError());
+    return nullptr;
+  }
+  return reinterpret_cast<void*>(symbol->getAddress());
+}
+
+void innative::FreeJIT(void* assembly)
+{
+  JITAssembly* jit = GetJITAssembly(assembly);
+  if(jit->init)
+  {
+    if(auto exit = jit->jit->lookup(IN_EXIT_FUNCTION))
+      reinterpret_cast<IN_Entrypoint>(exit->getAddress())();
+    else
+      llvm::consumeError(exit.takeError());
+  }
+  delete jit;
+}
@@ -0,0 +1,20 @@
+// Copyright (c)2019 Black Sphere Studios
+// For conditions of distribution and use, see copyright notice in innative.h
+
+#ifndef IN__JIT_H
+#define IN__JIT_H
+
+#include "innative/schema.h"
+#include <stddef.h>
+
+namespace innative {
+  // Handles returned by CompileJIT are tagged in their lowest bit so they can be told apart from the handles returned by
+  // LoadAssembly, which are always aligned.
+  inline bool IsJITAssembly(void* assembly) { return (reinterpret_cast<size_t>(assembly) & 1) != 0; }
+
+  IN_ERROR CompileJIT(Environment* env, void** assembly);
+  void* LoadJITSymbol(void* assembly, const char* name);
+  void FreeJIT(void* assembly);
+}
+
+#endif
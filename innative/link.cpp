@@ -3,59 +3,343 @@
 
 #include "util.h"
 #include "link.h"
+#include "compile.h"
 #include "intrinsic.h"
 #include "innative/export.h"
 #include "llvm/IR/LegacyPassManager.h"
 #include "llvm/IR/Verifier.h"
 #include "llvm/Analysis/TargetTransformInfo.h"
 #include "llvm/Analysis/TargetTransformInfoImpl.h"
+#include "llvm/Analysis/ModuleSummaryAnalysis.h"
+#include "llvm/Analysis/ProfileSummaryInfo.h"
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm/Transforms/Utils/SplitModule.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Host.h"
+#include "llvm/Support/MD5.h"
+#include "llvm/Support/TargetRegistry.h"
 #include "lld/Common/Driver.h"
 #include "lld/Common/ErrorHandler.h"
+#include <algorithm>
+
+#ifdef IN_PLATFORM_LINUX
+#include <sys/syscall.h>
+#include <unistd.h>
+#ifdef SYS_memfd_create
+#define IN_MEMORY_FILES
+#endif
+#endif
 
 using namespace innative;
 
-IN_ERROR OutputObjectFile(code::Context& context, const path& out)
+IN_ERROR EmitObject(const Environment& env, llvm::TargetMachine& machine, llvm::Module& m,
+                    llvm::raw_pwrite_stream& dest)
 {
-  std::error_code EC;
-  llvm::raw_fd_ostream dest(out.u8string(), EC, llvm::sys::fs::F_None);
+  llvm::legacy::PassManager pass;
+  auto FileType = llvm::TargetMachine::CGFT_ObjectFile;
+  llvm::TargetLibraryInfoImpl TLII(machine.getTargetTriple());
+  pass.add(new llvm::TargetLibraryInfoWrapperPass(TLII));
+  pass.add(createTargetTransformInfoWrapperPass(machine.getTargetIRAnalysis()));
 
-  if(EC)
+  if(machine.addPassesToEmitFile(pass, dest, nullptr, FileType))
   {
-    if(context.env.loglevel >= LOG_FATAL)
-    {
-      fputs("Could not open file: ", context.env.log);
-      fputs(EC.message().c_str(), context.env.log);
-    }
+    if(env.loglevel >= LOG_FATAL)
+      fputs("TheTargetMachine can't emit a file of this type", env.log);
     return ERR_FATAL_FILE_ERROR;
   }
 
-  llvm::legacy::PassManager pass;
-  auto FileType = llvm::TargetMachine::CGFT_ObjectFile;
-  llvm::TargetLibraryInfoImpl TLII(context.machine->getTargetTriple());
-  pass.add(new llvm::TargetLibraryInfoWrapperPass(TLII));
-  pass.add(createTargetTransformInfoWrapperPass(context.machine->getTargetIRAnalysis()));
+  pass.run(m);
+  dest.flush();
+  return ERR_SUCCESS;
+}
+
+// TargetMachines aren't thread-safe, so anything emitting code on the thread pool needs its own copy
+std::unique_ptr<llvm::TargetMachine> CloneTargetMachine(const llvm::TargetMachine& machine)
+{
+  return std::unique_ptr<llvm::TargetMachine>(machine.getTarget().createTargetMachine(
+    machine.getTargetTriple().getTriple(), machine.getTargetCPU(), machine.getTargetFeatureString(), machine.Options,
+    machine.getRelocationModel(), machine.getCodeModel(), machine.getOptLevel()));
+}
 
-  if(context.machine->addPassesToEmitFile(pass, dest, nullptr, FileType))
+// With ENV_LTO, modules are handed to LLD as bitcode, which it optimizes and compiles itself once they are all merged
+IN_ERROR EmitBitcode(code::Context& context, llvm::raw_pwrite_stream& dest)
+{
+  // LLD compiles for a generic CPU unless each function says otherwise
+  for(auto& f : *context.llvm)
+    if(!f.isDeclaration())
+    {
+      f.addFnAttr("target-cpu", context.machine->getTargetCPU());
+      f.addFnAttr("target-features", context.machine->getTargetFeatureString());
+    }
+
+  // A summary lets LLD import functions across modules without merging them, which is what makes it ThinLTO
+  if(context.env.flags & ENV_MULTITHREADED)
   {
-    if(context.env.loglevel >= LOG_FATAL)
-      fputs("TheTargetMachine can't emit a file of this type", context.env.log);
-    return ERR_FATAL_FILE_ERROR;
+    llvm::ProfileSummaryInfo PSI(*context.llvm);
+    llvm::ModuleSummaryIndex index = llvm::buildModuleSummaryIndex(*context.llvm, nullptr, &PSI);
+    llvm::WriteBitcodeToFile(*context.llvm, dest, false, &index);
   }
+  else
+    llvm::WriteBitcodeToFile(*context.llvm, dest);
 
-  pass.run(*context.llvm);
   dest.flush();
   return ERR_SUCCESS;
 }
 
-path innative::GetLinkerObjectPath(const Environment& env, Module& m, const path& outfile)
+// Only the built-in LLD linker understands bitcode, so external linkers are always given object code
+bool innative::UsesLTO(const Environment& env) { return (env.flags & ENV_LTO) && !env.linker; }
+
+IN_ERROR EmitObject(code::Context& context, llvm::raw_pwrite_stream& dest)
 {
-  if(m.cache != nullptr && !m.cache->objfile.empty())
-    return m.cache->objfile;
-  if(!m.name.size())
+  if(UsesLTO(context.env))
+    return EmitBitcode(context, dest);
+
+  // Every module shares the same TargetMachine, but they are all emitted at once when multithreaded
+  if(context.env.flags & ENV_MULTITHREADED)
+    return EmitObject(context.env, *CloneTargetMachine(*context.machine), *context.llvm, dest);
+  return EmitObject(context.env, *context.machine, *context.llvm, dest);
+}
+
+// Returns how many partitions a module should be split into for parallel code generation
+unsigned int GetCodegenPartitions(const Environment& env, const Module& m)
+{
+  if(!(env.flags & ENV_PARALLEL_CODEGEN) || UsesLTO(env)) // LLD does its own code generation for LTO
+    return 1;
+
+  size_t n = std::min<size_t>(env.pool->Size(), m.code.n_funcbody / utility::IN_CODEGEN_PARTITION_MIN_FUNCTIONS);
+  return !n ? 1 : (unsigned int)n;
+}
+
+path GetPartitionObjectPath(const path& objfile, unsigned int index)
+{
+  path file = objfile;
+  return file.replace_extension(std::to_string(index) + objfile.extension().u8string());
+}
+
+// Lowers a module to several object files at once by splitting it into one partition per stream, each compiled on the
+// environment's thread pool in a separate LLVMContext.
+IN_ERROR EmitPartitions(code::Context& context, llvm::ArrayRef<llvm::raw_pwrite_stream*> streams)
+{
+  // SplitModule consumes the module it is given, so we split a copy to keep the IR alive for the rest of the environment
+  std::unique_ptr<llvm::Module> clone = llvm::CloneModule(*context.llvm);
+
+  // Local symbols are externalized when they are referenced across partitions, so we must ensure their names remain
+  // unique across every module being linked together, not just this one.
+  for(auto& gv : clone->global_values())
+    if(gv.hasLocalLinkage())
+      gv.setName(utility::CanonicalName(utility::StringRef::From(context.m.name),
+                                        utility::StringRef{ gv.getName().data(), gv.getName().size() }));
+
+  const llvm::TargetMachine& machine = *context.machine;
+  const Environment& env             = context.env;
+  std::vector<std::future<void>> tasks;
+  std::vector<IN_ERROR> errors(streams.size(), ERR_SUCCESS);
+  size_t index = 0;
+
+  // Partitions are written to bitcode on this thread, because nothing else can touch the module while it's being split.
+  // Each task then reads its partition back into its own context, which is what llvm::splitCodeGen does internally.
+  llvm::SplitModule(
+    std::move(clone), (unsigned int)streams.size(),
+    [&](std::unique_ptr<llvm::Module> partition) {
+      auto bitcode = std::make_shared<llvm::SmallString<0>>();
+      llvm::raw_svector_ostream out(*bitcode);
+      llvm::WriteBitcodeToFile(*partition, out);
+
+      size_t i = index++;
+      tasks.push_back(env.pool->Submit([&env, &machine, &errors, streams, bitcode, i]() {
+        llvm::LLVMContext ctx;
+        auto m = llvm::parseBitcodeFile(llvm::MemoryBufferRef(llvm::StringRef(bitcode->data(), bitcode->size()),
+                                                              "<partition>"),
+                                        ctx);
+        if(!m)
+        {
+          llvm::consumeError(m.takeError());
+          errors[i] = ERR_FATAL_INVALID_MODULE;
+          return;
+        }
+
+        errors[i] = EmitObject(env, *CloneTargetMachine(machine), **m, *streams[i]);
+      }));
+    },
+    false);
+
+  for(auto& task : tasks)
+    env.pool->Wait(task);
+  for(auto err : errors)
+    if(err < 0)
+      return err;
+  return ERR_SUCCESS;
+}
+
+// Writes a module's object code to out, split into n partitions. The first partition is written to out, the rest are
+// stored in context.partitions. Objects in the cachepath are reused by any process for as long as they exist, so they are
+// written to unique temporary files and only renamed into place once they are complete. The main object is renamed last,
+// because its existence means every partition is already there.
+IN_ERROR OutputObjectFiles(code::Context& context, const path& out, unsigned int n)
+{
+  std::vector<path> files;
+  std::vector<path> temporaries;
+  std::vector<std::unique_ptr<llvm::raw_fd_ostream>> outputs;
+  std::vector<llvm::raw_pwrite_stream*> streams;
+  context.partitions.clear();
+
+  IN_ERROR err = ERR_SUCCESS;
+  for(unsigned int i = 0; i < n; ++i)
+  {
+    files.push_back(!i ? out : GetPartitionObjectPath(out, i));
+    temporaries.push_back(files.back());
+
+    std::error_code EC;
+    std::unique_ptr<llvm::raw_fd_ostream> output;
+    if(context.env.cachepath)
+    {
+      int fd;
+      llvm::SmallString<128> temporary;
+      EC = llvm::sys::fs::createUniqueFile(files.back().u8string() + ".%%%%%%%%.tmp", fd, temporary);
+      if(!EC)
+      {
+        temporaries.back() = path(temporary.str().str());
+        output.reset(new llvm::raw_fd_ostream(fd, true));
+      }
+    }
+    else
+      output.reset(new llvm::raw_fd_ostream(files.back().u8string(), EC, llvm::sys::fs::F_None));
+
+    if(EC)
+    {
+      if(context.env.loglevel >= LOG_FATAL)
+      {
+        fputs("Could not open file: ", context.env.log);
+        fputs(EC.message().c_str(), context.env.log);
+      }
+      temporaries.pop_back();
+      err = ERR_FATAL_FILE_ERROR;
+      break;
+    }
+
+    streams.push_back(output.get());
+    outputs.push_back(std::move(output));
+  }
+
+  if(err >= 0)
+    err = (n > 1) ? EmitPartitions(context, streams) : EmitObject(context, *streams[0]);
+
+  for(auto& f : outputs)
+    f->close();
+
+  // A partially written object must never be mistaken for a complete one, so everything is removed if anything failed
+  std::error_code ec;
+  for(size_t i = temporaries.size(); i-- > 0;)
+  {
+    if(err >= 0 && context.env.cachepath)
+    {
+      rename(temporaries[i], files[i], ec);
+      if(ec)
+        err = ERR_FATAL_FILE_ERROR;
+    }
+    if(err < 0)
+      remove(temporaries[i], ec);
+  }
+
+  if(err >= 0)
+    context.partitions.assign(files.begin() + 1, files.end());
+  return err;
+}
+
+// An object can only be reused if every partition it was split into is still there, otherwise the link would be missing
+// symbols. Objects in the cachepath always have the same number of partitions, because it's part of the cache key.
+bool HasPartitionObjects(const path& objfile, unsigned int n)
+{
+  std::error_code ec;
+  for(unsigned int k = 1; k < n; ++k)
+    if(!exists(GetPartitionObjectPath(objfile, k), ec))
+      return false;
+  return true;
+}
+
+// Copies a buffer into an anonymous in-memory file and returns a path the linker can open it with. The name is only
+// used for debugging and is limited to 249 bytes, so it should be a short constant. On platforms without anonymous
+// files, or if the file can't be created, this returns an empty path.
+path CreateMemoryFile(const char* name, const void* data, size_t size, std::vector<int>& handles)
+{
+#ifdef IN_MEMORY_FILES
+  int fd = (int)syscall(SYS_memfd_create, name, 0);
+  if(fd < 0)
     return path();
+  handles.push_back(fd); // Must be kept open until the linker is finished with it
 
-  path objpath = !env.objpath ? (outfile.empty() ? "" : outfile.parent_path()) : utility::GetPath(env.objpath);
+  for(size_t total = 0; total < size;)
+  {
+    ssize_t n = write(fd, reinterpret_cast<const char*>(data) + total, size - total);
+    if(n <= 0)
+      return path();
+    total += n;
+  }
+
+  return path("/proc/self/fd") / std::to_string(fd);
+#else
+  return path();
+#endif
+}
+
+void CloseMemoryFiles(std::vector<int>& handles)
+{
+#ifdef IN_MEMORY_FILES
+  for(int fd : handles)
+    close(fd);
+#endif
+  handles.clear();
+}
+
+// Emits a module's object code into memory buffers, then hands it to the linker through anonymous in-memory files. If
+// an in-memory file can't be created, that object is written to the same place it would have been without
+// ENV_LINK_IN_MEMORY instead, because the module can't be compiled a second time.
+IN_ERROR OutputObjectMemory(code::Context& context, const path& objfile, std::vector<std::string>& cache,
+                            std::vector<int>& handles)
+{
+  unsigned int n = GetCodegenPartitions(context.env, context.m);
+  std::vector<llvm::SmallVector<char, 0>> buffers(n);
+  std::vector<std::unique_ptr<llvm::raw_svector_ostream>> streams;
+  std::vector<llvm::raw_pwrite_stream*> outputs;
 
+  for(auto& buffer : buffers)
+  {
+    streams.emplace_back(new llvm::raw_svector_ostream(buffer));
+    outputs.push_back(streams.back().get());
+  }
+
+  IN_ERROR err = (n > 1) ? EmitPartitions(context, outputs) : EmitObject(context, *outputs[0]);
+  if(err < 0)
+    return err;
+
+  for(unsigned int k = 0; k < n; ++k)
+  {
+    path file = CreateMemoryFile("innative-object", buffers[k].data(), buffers[k].size(), handles);
+    if(file.empty())
+    {
+      file = !k ? objfile : GetPartitionObjectPath(objfile, k);
+      std::error_code ec;
+      llvm::raw_fd_ostream dest(file.u8string(), ec, llvm::sys::fs::F_None);
+      if(ec)
+        return ERR_FATAL_FILE_ERROR;
+      dest.write(buffers[k].data(), buffers[k].size());
+      dest.close();
+      if(dest.has_error())
+      {
+        dest.clear_error();
+        return ERR_FATAL_FILE_ERROR;
+      }
+    }
+    cache.emplace_back(file.u8string());
+  }
+
+  return ERR_SUCCESS;
+}
+
+path GetObjectFileName(const Module& m)
+{
   // The default module name must be an entire path to gaurantee uniqueness, but we need to write it in the objpath
   // directory
   std::string file(m.name.str());
@@ -63,50 +347,242 @@ path innative::GetLinkerObjectPath(const Environment& env, Module& m, const path
   std::replace(file.begin(), file.end(), '/', '_');
   std::replace(file.begin(), file.end(), '.', '_');
 
-  objpath /= file;
 #ifdef IN_PLATFORM_WIN32
-  objpath += ".obj";
+  file += ".obj";
 #else
-  objpath += ".o";
+  file += ".o";
 #endif
-  return objpath;
+  return path(file);
 }
 
-IN_ERROR innative::GenerateLinkerObjects(const Environment& env, std::vector<std::string>& cache)
+path innative::GetLinkerObjectPath(const Environment& env, Module& m, const path& outfile)
 {
-  for(size_t i = 0; i < env.n_modules; ++i)
-  {
-    assert(env.modules[i].cache != 0);
-    assert(env.modules[i].name.get() != nullptr);
-    path objfile = GetLinkerObjectPath(env, env.modules[i], path());
-    cache.emplace_back(objfile.u8string());
-
-    FILE* f;
-    FOPEN(f, objfile.c_str(), "rb");
-    if(f)
-      fclose(f);
-    else
+  if(m.cache != nullptr && !m.cache->objfile.empty())
+    return m.cache->objfile;
+  if(!m.name.size())
+    return path();
+
+  if(env.cachepath)
+    return GetObjectCachePath(env) / GetObjectFileName(m);
+
+  path objpath = !env.objpath ? (outfile.empty() ? "" : outfile.parent_path()) : utility::GetPath(env.objpath);
+  return objpath / GetObjectFileName(m);
+}
+
+void innative::HashModuleSource(uint8_t (&hash)[16], const void* data, uint64_t size)
+{
+  std::array<uint8_t, 16> result = llvm::MD5::hash(llvm::ArrayRef<uint8_t>((const uint8_t*)data, (size_t)size));
+  static_assert(sizeof(hash) == sizeof(result), "Module hash must be the same size as an MD5 hash");
+  memcpy(hash, result.data(), sizeof(hash));
+}
+
+// The object cache directory is keyed on everything that can change the resulting machine code: the source of every
+// module (because imports are resolved against the other modules in the environment), the compilation settings, the
+// embeddings and whitelist used during validation, per-function optimization levels, the host CPU, and the inNative
+// version.
+path innative::GetObjectCachePath(const Environment& env)
+{
+  llvm::MD5 hash;
+  auto add = [&hash](llvm::StringRef s) {
+    hash.update(s);
+    hash.update(llvm::StringRef("", 1)); // Terminate each key so adjacent keys can't be confused with each other
+  };
+
+  add(IN_VERSION_STRING);
+  add(GenFlagString(env));
+  add(std::to_string(env.flags));
+  add(std::to_string(env.optimize));
+  add(std::to_string(env.features));
+  add(std::to_string((env.flags & ENV_PARALLEL_CODEGEN) ? env.pool->Size() : 1)); // Decides how modules are partitioned
+  add(!env.system ? "" : env.system);
+  add(llvm::sys::getHostCPUName());
+
+  std::vector<std::string> keys;
+  llvm::StringMap<bool> feature_map;
+  if(llvm::sys::getHostCPUFeatures(feature_map))
+    for(auto& feature : feature_map)
+      keys.push_back((feature.second ? "+" : "-") + feature.first().str());
+
+  if(env.flags & ENV_WHITELIST)
+    for(khiter_t i = kh_begin(env.whitelist); i != kh_end(env.whitelist); ++i)
+      if(kh_exist(env.whitelist, i))
+      {
+        const char* key = kh_key(env.whitelist, i);
+        keys.push_back(std::string(key) + '|' + (key + strlen(key) + 1));
+      }
+
+  for(khiter_t i = kh_begin(env.optimizehints); i != kh_end(env.optimizehints); ++i)
+    if(kh_exist(env.optimizehints, i))
     {
-      IN_ERROR err = OutputObjectFile(*env.modules[i].cache, objfile);
-      if(err < 0)
-        return err;
+      const char* key = kh_key(env.optimizehints, i);
+      keys.push_back(std::string(key) + ':' + (key + strlen(key) + 1) + '=' +
+                     std::to_string(kh_val(env.optimizehints, i)));
     }
 
+  std::sort(keys.begin(), keys.end()); // Neither the feature map, the whitelist, nor the optimization hints are ordered
+  for(auto& key : keys)
+    add(key);
+
+  for(Embedding* cur = env.embeddings; cur != nullptr; cur = cur->next)
+  {
+    add(std::to_string(cur->tag));
+    if(cur->size > 0)
+      hash.update(llvm::ArrayRef<uint8_t>((const uint8_t*)cur->data, (size_t)cur->size));
+    else
+      add((const char*)cur->data);
+  }
+
+  for(size_t i = 0; i < env.n_modules; ++i)
+  {
+    add(llvm::StringRef(env.modules[i].name.str(), env.modules[i].name.size()));
+    hash.update(llvm::ArrayRef<uint8_t>(env.modules[i].hash, sizeof(env.modules[i].hash)));
+  }
+
+  llvm::MD5::MD5Result result;
+  hash.final(result);
+  return utility::GetPath(env.cachepath) / result.digest().str().str();
+}
+
+// LLD optimizes the bitcode again after merging it, so it needs our optimization level and how many threads it can use
+void AppendLTOArguments(const Environment& env, std::vector<std::string>& cache)
+{
+  int level = 0;
+  switch(env.optimize & ENV_OPTIMIZE_OMASK)
+  {
+  case ENV_OPTIMIZE_O1: level = 1; break;
+  case ENV_OPTIMIZE_O2:
+  case ENV_OPTIMIZE_Os: level = 2; break;
+  case ENV_OPTIMIZE_O3: level = 3; break;
+  }
+
+#ifdef IN_PLATFORM_WIN32
+  cache.emplace_back("/OPT:LLDLTO=" + std::to_string(level));
+  if(env.flags & ENV_MULTITHREADED)
+    cache.emplace_back("/OPT:LLDLTOJOBS=" + std::to_string(env.pool->Size()));
+#elif defined(IN_PLATFORM_POSIX)
+  cache.emplace_back("--lto-O" + std::to_string(level));
+  if(env.flags & ENV_MULTITHREADED)
+    cache.emplace_back("--thinlto-jobs=" + std::to_string(env.pool->Size()));
+#endif
+}
+
+void AppendEntryArguments(const Environment& env, size_t index, std::vector<std::string>& cache)
+{
 #ifdef IN_PLATFORM_POSIX
-    if(i == 0)
-    { // https://stackoverflow.com/questions/9759880/automatically-executed-functions-when-loading-shared-libraries
-      if(!(env.flags &
-           ENV_LIBRARY)) // If this isn't a shared library, we must specify an entry point instead of an init function
-        cache.emplace_back("--entry=" IN_INIT_FUNCTION);
-      else if(!(env.flags & ENV_NO_INIT)) // Otherwise only specify entry functions if we actually want them
-      {
-        cache.emplace_back("-init=" IN_INIT_FUNCTION);
-        cache.emplace_back("-fini=" IN_EXIT_FUNCTION);
-      }
+  if(index == 0)
+  { // https://stackoverflow.com/questions/9759880/automatically-executed-functions-when-loading-shared-libraries
+    if(!(env.flags &
+         ENV_LIBRARY)) // If this isn't a shared library, we must specify an entry point instead of an init function
+      cache.emplace_back("--entry=" IN_INIT_FUNCTION);
+    else if(!(env.flags & ENV_NO_INIT)) // Otherwise only specify entry functions if we actually want them
+    {
+      cache.emplace_back("-init=" IN_INIT_FUNCTION);
+      cache.emplace_back("-fini=" IN_EXIT_FUNCTION);
     }
+  }
+#endif
+}
+
+bool innative::HasCachedObjects(const Environment& env)
+{
+  if(!env.cachepath || !env.n_modules)
+    return false;
+
+  std::error_code ec;
+  path dir = GetObjectCachePath(env);
+  for(size_t i = 0; i < env.n_modules; ++i)
+  {
+    path objfile = dir / GetObjectFileName(env.modules[i]);
+    if(!env.modules[i].name.size() || !exists(objfile, ec) ||
+       !HasPartitionObjects(objfile, GetCodegenPartitions(env, env.modules[i])))
+      return false;
+  }
+
+  return true;
+}
+
+// Appends the objects and linker arguments for a single module to cache, generating the objects if necessary
+IN_ERROR GenerateModuleObjects(const Environment& env, size_t i, const path& cachedir, std::vector<std::string>& cache,
+                               std::vector<int>& handles)
+{
+  std::error_code ec;
+  assert(env.modules[i].cache != 0 || env.cachepath != 0);
+  assert(env.modules[i].name.get() != nullptr);
+
+  path objfile = !env.modules[i].cache ? cachedir / GetObjectFileName(env.modules[i]) :
+                                         GetLinkerObjectPath(env, env.modules[i], path());
+
+#ifdef IN_MEMORY_FILES
+  // Objects are only written to disk if we were asked to persist them in the cachepath
+  if((env.flags & ENV_LINK_IN_MEMORY) && !env.cachepath)
+  {
+    IN_ERROR err = OutputObjectMemory(*env.modules[i].cache, objfile, cache, handles);
+    if(err < 0)
+      return err;
+    AppendEntryArguments(env, i, cache);
+    return ERR_SUCCESS;
+  }
 #endif
+
+  cache.emplace_back(objfile.u8string());
+
+  // Objects left behind by an earlier compile of this module's IR can be reused, as long as none of them are missing
+  unsigned int partitions = GetCodegenPartitions(env, env.modules[i]);
+  bool reused             = exists(objfile, ec) && HasPartitionObjects(objfile, partitions);
+  if(reused && !env.cachepath && env.modules[i].cache)
+    reused = env.modules[i].cache->partitions.size() == partitions - 1;
+
+  if(!reused && !env.modules[i].cache)
+    return ERR_FATAL_FILE_ERROR;
+  if(!reused)
+  {
+    IN_ERROR err = OutputObjectFiles(*env.modules[i].cache, objfile, partitions);
+    if(err < 0)
+      return err;
+  }
+
+  for(unsigned int k = 1; k < partitions; ++k)
+    cache.emplace_back(GetPartitionObjectPath(objfile, k).u8string());
+
+  AppendEntryArguments(env, i, cache);
+  return ERR_SUCCESS;
+}
+
+IN_ERROR innative::GenerateLinkerObjects(const Environment& env, std::vector<std::string>& cache, std::vector<int>& handles)
+{
+  std::error_code ec;
+  path cachedir;
+  if(env.cachepath)
+  {
+    cachedir = GetObjectCachePath(env);
+    create_directories(cachedir, ec);
   }
 
+  // Every module lives in its own LLVMContext, so when multithreaded they are all lowered to object code at once. Each
+  // module gets its own list of objects, which are appended in order afterwards so the link order never changes.
+  std::vector<std::vector<std::string>> objects(env.n_modules);
+  std::vector<std::vector<int>> files(env.n_modules);
+  std::vector<IN_ERROR> errors(env.n_modules, ERR_SUCCESS);
+  auto generate = [&](size_t i) { return errors[i] = GenerateModuleObjects(env, i, cachedir, objects[i], files[i]); };
+
+  if(env.flags & ENV_MULTITHREADED)
+    utility::ParallelFor(env, env.n_modules, 1, generate);
+  else
+  {
+    for(size_t i = 0; i < env.n_modules; ++i)
+      if(generate(i) < 0)
+        break;
+  }
+
+  for(size_t i = 0; i < env.n_modules; ++i)
+  {
+    handles.insert(handles.end(), files[i].begin(), files[i].end()); // The caller closes these even if we fail
+    cache.insert(cache.end(), objects[i].begin(), objects[i].end());
+  }
+
+  for(auto err : errors)
+    if(err < 0)
+      return err;
   return ERR_SUCCESS;
 }
 
@@ -190,13 +666,18 @@ int innative::CallLinker(const Environment* env, std::vector<const char*>& linka
 
 void innative::DeleteCache(const Environment& env, Module& m)
 {
-  // Certain error conditions can result in us clearing the cache of an invalid module.
-  if(m.name.size() > 0)                           // Prevent an error from happening if the name is invalid.
+  // Certain error conditions can result in us clearing the cache of an invalid module. Objects in the cachepath are
+  // persistent, so they are never removed, and modules compiled by the JIT never had an object file to begin with.
+  if(m.name.size() > 0 && !env.cachepath &&
+     (!m.cache || !m.cache->objfile.empty())) // Prevent an error from happening if the name is invalid.
     remove(GetLinkerObjectPath(env, m, path())); // Always remove the file if it exists
 
   if(m.cache != nullptr)
   {
     auto context = static_cast<code::Context*>(m.cache);
+    if(!env.cachepath)
+      for(auto& partition : context->partitions)
+        remove(partition);
     kh_destroy_importhash(context->importhash);
     delete context->llvm;
     delete context;
@@ -204,6 +685,15 @@ void innative::DeleteCache(const Environment& env, Module& m)
   }
 }
 
+// LLVM can't tell us how much memory a module uses, so we estimate it from the number of instructions
+size_t innative::GetCacheMemory(const Module& m)
+{
+  auto context = static_cast<const code::Context*>(m.cache);
+  if(!context || !context->llvm)
+    return 0;
+  return context->llvm->getInstructionCount() * (sizeof(llvm::Instruction) + 2 * sizeof(llvm::Use));
+}
+
 void innative::DeleteContext(Environment& env, bool shutdown)
 {
   for(varuint32 i = 0; i < env.n_modules; ++i)
@@ -211,9 +701,6 @@ void innative::DeleteContext(Environment& env, bool shutdown)
     DeleteCache(env, env.modules[i]);
   }
 
-  delete env.context;
-  env.context = nullptr;
-
   if(shutdown)
     llvm::llvm_shutdown();
 }
@@ -315,6 +802,9 @@ IN_ERROR innative::LinkEnvironment(const Environment* env, const path& file)
   // Finalize all modules
   for(varuint32 i = 0; i < env->n_modules; ++i)
   {
+    if(!env->modules[i].cache) // Modules loaded straight from the object cache have no LLVM module
+      continue;
+
     if(env->modules[i].cache->dbuilder)
       env->modules[i].cache->dbuilder->finalize();
 
@@ -390,22 +880,35 @@ IN_ERROR innative::LinkEnvironment(const Environment* env, const path& file)
 #error unknown platform
 #endif
     std::vector<path> garbage;
+    std::vector<int> handles;
 
     // Defer lambda deleting temporary files
-    utility::DeferLambda<std::function<void()>> deferclean([&garbage]() {
+    utility::DeferLambda<std::function<void()>> deferclean([&garbage, &handles]() {
       for(auto& v : garbage)
         remove(v);
+      CloseMemoryFiles(handles);
     });
 
+    if(UsesLTO(*env))
+      AppendLTOArguments(*env, cache);
+    else if((env->flags & ENV_LTO) && env->loglevel >= LOG_WARNING)
+      FPRINTF(env->log, "ENV_LTO ignored, because the external linker %s can't link LLVM bitcode.\n", env->linker);
+
     // Generate object code
-    IN_ERROR err = GenerateLinkerObjects(*env, cache);
+    IN_ERROR err = GenerateLinkerObjects(*env, cache, handles);
     if(err < 0)
       return err;
 
     // Write all in-memory environments to cache files
     for(Embedding* cur = env->embeddings; cur != nullptr; cur = cur->next)
     {
-      if(cur->size > 0) // If the size is greater than 0, this is an in-memory embedding
+      path memfile; // Embeddings loaded from a file are passed by path, so only in-memory embeddings need a file
+      if(cur->size > 0 && (env->flags & ENV_LINK_IN_MEMORY))
+        memfile = CreateMemoryFile("innative-embedding", cur->data, (size_t)cur->size, handles);
+
+      if(!memfile.empty()) // In-memory embeddings can be handed to the linker without touching the disk
+        cache.emplace_back(memfile.u8string());
+      else if(cur->size > 0) // If the size is greater than 0, this is an in-memory embedding
       {
         union
         {
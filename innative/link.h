@@ -12,14 +12,19 @@
 namespace innative {
   IN_ERROR LinkEnvironment(const Environment* env, const path& file);
   void DeleteCache(const Environment& env, Module& m);
+  size_t GetCacheMemory(const Module& m);
   void DeleteContext(Environment& env, bool shutdown);
   std::vector<std::string> GetSymbols(const char* file, size_t size, FILE* log, LLD_FORMAT format);
   void AppendIntrinsics(Environment& env);
   std::string ABIMangle(const std::string& src, ABI abi, int convention, int bytes);
   int GetParameterBytes(const IN_WASM_MODULE& m, const Import& imp);
-  IN_ERROR GenerateLinkerObjects(const Environment& env, std::vector<std::string>& cache);
+  IN_ERROR GenerateLinkerObjects(const Environment& env, std::vector<std::string>& cache, std::vector<int>& handles);
   int CallLinker(const Environment* env, std::vector<const char*>& linkargs, LLD_FORMAT format);
   path GetLinkerObjectPath(const Environment& env, Module& m, const path& outfile);
+  path GetObjectCachePath(const Environment& env);
+  bool HasCachedObjects(const Environment& env);
+  bool UsesLTO(const Environment& env);
+  void HashModuleSource(uint8_t (&hash)[16], const void* data, uint64_t size);
 }
 
 #endif
@@ -30,9 +30,17 @@ namespace innative {
     {
       llvm::Value* v;
       llvm::BasicBlock* b;
+      llvm::Value** locals; // Values of the target block's written locals when this branch was taken
       BlockResult* next;
     };
 
+    // Locals that are assigned anywhere inside a block, including any nested blocks
+    struct LocalWrites
+    {
+      varuint32* locals;
+      varuint32 n_locals;
+    };
+
     struct Block
     {
       llvm::BasicBlock* block;  // Label
@@ -42,6 +50,8 @@ namespace innative {
       uint8_t op;               // instruction that pushed this label
       llvm::DIScope* scope;     // Debug lexical scope for this block
       BlockResult* results;     // Holds alternative branch results targeting this block
+      LocalWrites written;      // Locals that can change inside this block, if locals are kept in SSA form
+      llvm::Value** entry;      // Values of the written locals when an if was entered, or the PHI nodes of a loop
     };
 
     struct Function
@@ -88,6 +98,18 @@ namespace innative {
       llvm::Function* exit;
       llvm::Function* start;
       llvm::Function* memgrow;
+      llvm::Function* memgrowreserved; // Grows linear memories in place when they are reserved up front
+      std::vector<path> partitions; // Additional object files this module was split into by ENV_PARALLEL_CODEGEN
+      bool ssa;                             // Set if the current function keeps its locals in SSA form
+      std::vector<llvm::Value*> ssalocals;  // Current value of each local if ssa is set
+      std::vector<LocalWrites> writes;      // Locals written inside each block of the current function, in order
+      size_t nextblock;                     // Index into writes of the next block that will be opened
+      std::vector<llvm::PHINode*> loopphis; // PHI nodes at loop headers, some of which may turn out to be redundant
+
+      // Every module has its own LLVM context, so modules can be optimized and compiled in parallel. The builder is
+      // declared last so it's destroyed before the context, which the JIT takes ownership of.
+      std::unique_ptr<llvm::LLVMContext> ownedcontext;
+      std::unique_ptr<llvm::IRBuilder<>> ownedbuilder;
     };
   }
 }
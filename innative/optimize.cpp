@@ -1,7 +1,9 @@
 // Copyright (c)2019 Black Sphere Studios
 // For conditions of distribution and use, see copyright notice in innative.h
 
+#include "util.h"
 #include "optimize.h"
+#include "bounds.h"
 #pragma warning(push)
 #pragma warning(disable : 4146 4267 4141 4244 4624)
 #define _SCL_SECURE_NO_WARNINGS
@@ -12,10 +14,13 @@
 #include "llvm/Transforms/Utils.h"
 #include "llvm/Transforms/Scalar.h"
 #include "llvm/Transforms/Scalar/GVN.h"
+#include "llvm/Transforms/Scalar/SimplifyCFG.h"
+#include "llvm/Transforms/Utils/Mem2Reg.h"
 #include "llvm/Transforms/IPO.h"
 #include "llvm/Transforms/IPO/FunctionAttrs.h"
 #include "llvm/Analysis/AliasAnalysis.h"
 #include "llvm/Analysis/DependenceAnalysis.h"
+#include "llvm/Analysis/LoopInfo.h"
 #include "llvm/Analysis/DominanceFrontier.h"
 #include "llvm/Analysis/GlobalsModRef.h"
 #include "llvm/Analysis/MemoryDependenceAnalysis.h"
@@ -27,29 +32,86 @@
 
 using namespace innative;
 
-IN_ERROR innative::OptimizeModules(const Environment* env)
+// Every optimization level, ordered from the fastest to compile to the most aggressive
+static constexpr uint64_t OPTIMIZATION_RANKS[] = { ENV_OPTIMIZE_O0, ENV_OPTIMIZE_BASELINE, ENV_OPTIMIZE_O1,
+                                                   ENV_OPTIMIZE_Os, ENV_OPTIMIZE_O2,       ENV_OPTIMIZE_O3 };
+static constexpr int N_OPTIMIZATION_RANKS        = sizeof(OPTIMIZATION_RANKS) / sizeof(uint64_t);
+
+// With LTO, the linker optimizes the modules again once they are merged, so we only run the pre-link pipeline
+enum class LTO_PHASE : uint8_t
 {
-  llvm::PassBuilder passBuilder;
-  llvm::LoopAnalysisManager loopAnalysisManager(env->loglevel >= LOG_DEBUG);
-  llvm::FunctionAnalysisManager functionAnalysisManager(env->loglevel >= LOG_DEBUG);
-  llvm::CGSCCAnalysisManager cGSCCAnalysisManager(env->loglevel >= LOG_DEBUG);
-  llvm::ModuleAnalysisManager moduleAnalysisManager(env->loglevel >= LOG_DEBUG);
+  NONE,
+  THIN,
+  FULL,
+};
 
-  // Pass debugging
-  /*llvm::PassInstrumentationCallbacks PIC;
-  moduleAnalysisManager.registerPass([&]() {return llvm::PassInstrumentationAnalysis(&PIC); });
-  functionAnalysisManager.registerPass([&]() { return llvm::PassInstrumentationAnalysis(&PIC); });
-  loopAnalysisManager.registerPass([&]() { return llvm::PassInstrumentationAnalysis(&PIC); });
-  cGSCCAnalysisManager.registerPass([&]() { return llvm::PassInstrumentationAnalysis(&PIC); });
+int GetOptimizationRank(uint64_t level)
+{
+  for(int i = 0; i < N_OPTIMIZATION_RANKS; ++i)
+    if(OPTIMIZATION_RANKS[i] == (level & ENV_OPTIMIZE_OMASK))
+      return i;
+  return 0;
+}
+
+llvm::PassBuilder::OptimizationLevel GetOptimizationLevel(uint64_t level)
+{
+  switch(level & ENV_OPTIMIZE_OMASK)
+  {
+  case ENV_OPTIMIZE_O1: return llvm::PassBuilder::OptimizationLevel::O1;
+  case ENV_OPTIMIZE_O2: return llvm::PassBuilder::OptimizationLevel::O2;
+  case ENV_OPTIMIZE_O3: return llvm::PassBuilder::OptimizationLevel::O3;
+  case ENV_OPTIMIZE_Os: return llvm::PassBuilder::OptimizationLevel::Os;
+  }
+  return llvm::PassBuilder::OptimizationLevel::O0;
+}
 
-  FILE* aux = fopen("passes.txt", "wb");
+// The baseline tier only cleans up what the code generator leaves behind, so FastISel has less to chew through
+llvm::FunctionPassManager BuildBaselinePipeline(bool debug)
+{
+  llvm::FunctionPassManager functionPassManager(debug);
+  functionPassManager.addPass(llvm::PromotePass());
+  functionPassManager.addPass(llvm::SimplifyCFGPass());
+  return functionPassManager;
+}
+
+// Optimizes every function at the environment's optimization level, except for the functions in levels, which are
+// optimized at the level they're mapped to instead.
+IN_ERROR RunOptimizer(uint64_t optimize, bool debug, LTO_PHASE phase, llvm::ArrayRef<llvm::Module*> modules,
+                      const llvm::DenseMap<llvm::Function*, uint64_t>& levels)
+{
+  // The module pipeline runs at the most aggressive level anything asked for
+  int pipeline = GetOptimizationRank(optimize);
+  for(auto& level : levels)
+    pipeline = std::max(pipeline, GetOptimizationRank(level.second));
+
+  // Functions that want less optimization than the pipeline are marked optnone, but LLVM's new pass manager doesn't
+  // respect optnone on its own, so we skip every function and loop pass on them.
+  llvm::PassInstrumentationCallbacks PIC;
+  PIC.registerBeforePassCallback([](llvm::StringRef, llvm::Any ir) {
+    const llvm::Function* fn = nullptr;
+    if(llvm::any_isa<const llvm::Function*>(ir))
+      fn = llvm::any_cast<const llvm::Function*>(ir);
+    else if(llvm::any_isa<const llvm::Loop*>(ir))
+      fn = llvm::any_cast<const llvm::Loop*>(ir)->getHeader()->getParent();
+    return !fn || !fn->hasOptNone();
+  });
+
+  llvm::PassBuilder passBuilder(nullptr, llvm::PipelineTuningOptions(), llvm::None, &PIC);
+  llvm::LoopAnalysisManager loopAnalysisManager(debug);
+  llvm::FunctionAnalysisManager functionAnalysisManager(debug);
+  llvm::CGSCCAnalysisManager cGSCCAnalysisManager(debug);
+  llvm::ModuleAnalysisManager moduleAnalysisManager(debug);
+
+  // Pass debugging
+  /*FILE* aux = fopen("passes.txt", "wb");
   int counter = 0;
   PIC.registerAfterPassCallback([&](const llvm::StringRef& name, const llvm::Any&) {
-    if(name.contains_lower("PassManager") && env->n_modules > 1)
+    if(name.contains_lower("PassManager") && modules.size() > 1)
     {
       std::error_code EC;
-      llvm::raw_fd_ostream dest(std::string(env->modules[1].cache->llvm->getName()) + "_" + std::to_string(++counter) +
-  ".llvm", EC, llvm::sys::fs::OpenFlags::OF_None); env->modules[1].cache->llvm->print(dest, nullptr);
+      llvm::raw_fd_ostream dest(std::string(modules[1]->getName()) + "_" + std::to_string(++counter) + ".llvm", EC,
+                                llvm::sys::fs::OpenFlags::OF_None);
+      modules[1]->print(dest, nullptr);
     }
     fprintf(aux, "%i: %s\n", counter, name.begin());
     });*/
@@ -61,94 +123,150 @@ IN_ERROR innative::OptimizeModules(const Environment* env)
   passBuilder.crossRegisterProxies(loopAnalysisManager, functionAnalysisManager, cGSCCAnalysisManager,
                                    moduleAnalysisManager);
 
-  llvm::PassBuilder::OptimizationLevel optlevel = llvm::PassBuilder::OptimizationLevel::O0;
+  // Group every function that needs less optimization than the pipeline by its optimization rank
+  std::vector<llvm::Function*> lowered[N_OPTIMIZATION_RANKS];
+  for(auto m : modules)
+    for(auto& fn : *m)
+    {
+      auto level = levels.find(&fn);
+      int rank   = GetOptimizationRank(level != levels.end() ? level->second : optimize);
+      if(!fn.isDeclaration() && rank < pipeline)
+        lowered[rank].push_back(&fn);
+    }
 
-  switch(env->optimize & ENV_OPTIMIZE_OMASK)
+  // Each group is optimized on its own first, then hidden from the module pipeline. Anything marked noinline can't be
+  // inlined into hot functions, but this is meant for cold code anyway.
+  std::vector<llvm::Function*> restore;
+  for(int rank = 0; rank < N_OPTIMIZATION_RANKS; ++rank)
   {
-  case ENV_OPTIMIZE_O1: optlevel = llvm::PassBuilder::OptimizationLevel::O1; break;
-  case ENV_OPTIMIZE_O2: optlevel = llvm::PassBuilder::OptimizationLevel::O2; break;
-  case ENV_OPTIMIZE_O3: optlevel = llvm::PassBuilder::OptimizationLevel::O3; break;
-  case ENV_OPTIMIZE_Os: optlevel = llvm::PassBuilder::OptimizationLevel::Os; break;
-  default: assert(false);
-  }
+    if(lowered[rank].empty())
+      continue;
 
-  llvm::ModulePassManager modulePassManager =
-    passBuilder.buildPerModuleDefaultPipeline(optlevel, env->loglevel >= LOG_DEBUG);
-
-  // Optimize all modules
-  for(size_t i = 0; i < env->n_modules; ++i)
-    modulePassManager.run(*env->modules[i].cache->llvm, moduleAnalysisManager);
-
-  /*{
-    auto manager = llvm::make_unique<llvm::legacy::FunctionPassManager>(context[i].llvm);
-
-    manager->add(llvm::createDependenceAnalysisWrapperPass()); // (used by loop - unroll - and-jam)
-    manager->add(llvm::createAAResultsWrapperPass()); // (used by LICM and argpromotion)
-    manager->add(llvm::createGlobalsAAWrapperPass());
-    manager->add(llvm::createSCEVAAWrapperPass());
-    manager->add(new llvm::MemoryDependenceWrapperPass());
-    manager->add(new llvm::ScalarEvolutionWrapperPass()); // (used by strength reduction)
-    manager->add(new llvm::DominanceFrontierWrapperPass()); // (used by mem2reg)
-    manager->add(llvm::createPostDomTree());
-
-    manager->add(llvm::createSROAPass());
-    manager->add(llvm::createReassociatePass());
-    manager->add(llvm::createConstantMergePass());
-    manager->add(llvm::createConstantPropagationPass());
-    manager->add(llvm::createPostOrderFunctionAttrsLegacyPass());
-    manager->add(llvm::createFunctionInliningPass());
-    manager->add(llvm::createInstructionCombiningPass());
-    manager->add(llvm::createGVNPass());
-    manager->add(llvm::createStraightLineStrengthReducePass());
-    manager->add(llvm::createJumpThreadingPass());
-    manager->add(llvm::createLoadStoreVectorizerPass());
-    manager->add(llvm::createSLPVectorizerPass());
-
-    manager->add(llvm::createLoopSimplifyCFGPass());
-    manager->add(llvm::createLoopSimplifyPass());
-    manager->add(llvm::createLCSSAPass());
-    manager->add(llvm::createLICMPass());
-    manager->add(llvm::createIndVarSimplifyPass());
-    manager->add(llvm::createLoopUnrollPass());
-    manager->add(llvm::createLoopUnrollAndJamPass());
-    manager->add(llvm::createLoopUnswitchPass());
-    manager->add(llvm::createLoopStrengthReducePass());
-    manager->add(llvm::createLoopVectorizePass());
-    manager->add(llvm::createLoopDeletionPass());
-
-    manager->add(llvm::createAggressiveInstCombinerPass());
-    manager->add(llvm::createLoopSinkPass());
-    manager->add(llvm::createSinkingPass());
-    manager->add(llvm::createPromoteMemoryToRegisterPass());
-    manager->add(llvm::createMergeICmpsPass());
-
-    manager->add(llvm::createSCCPPass());
-    manager->add(llvm::createIPConstantPropagationPass());
-    manager->add(llvm::createIPSCCPPass());
-    manager->add(llvm::createDeadInstEliminationPass());
-    manager->add(llvm::createDeadStoreEliminationPass());
-    manager->add(llvm::createDeadArgEliminationPass());
-    manager->add(llvm::createDeadCodeEliminationPass());
-    manager->add(llvm::createGlobalDCEPass());
-
-    manager->add(llvm::createMergedLoadStoreMotionPass());
-    manager->add(llvm::createPostOrderFunctionAttrsLegacyPass());
-    manager->add(llvm::createGlobalOptimizerPass());
-    manager->add(llvm::createCFGSimplificationPass());
-
-    manager->add(llvm::createTailCallEliminationPass());
-    manager->add(llvm::createPruneEHPass());
-
-    if(!(env->flags&ENV_DEBUG))
+    uint64_t level = OPTIMIZATION_RANKS[rank];
+    if(rank > 0)
     {
-      manager->add(llvm::createStripDeadDebugInfoPass());
-      manager->add(llvm::createStripDeadPrototypesPass());
-      manager->add(llvm::createStripNonDebugSymbolsPass());
+      llvm::FunctionPassManager functionPassManager =
+        level == ENV_OPTIMIZE_BASELINE ?
+          BuildBaselinePipeline(debug) :
+          passBuilder.buildFunctionSimplificationPipeline(GetOptimizationLevel(level),
+                                                          llvm::PassBuilder::ThinLTOPhase::None, debug);
+      for(auto fn : lowered[rank])
+        functionPassManager.run(*fn, functionAnalysisManager);
     }
 
-    manager->doInitialization();
-  }*/
+    for(auto fn : lowered[rank])
+    {
+      // Only unoptimized and baseline functions are kept at optnone, so the code generator also takes the fast path
+      if(rank > 1 && !fn->hasFnAttribute(llvm::Attribute::NoInline))
+        restore.push_back(fn);
+      fn->addFnAttr(llvm::Attribute::OptimizeNone);
+      fn->addFnAttr(llvm::Attribute::NoInline);
+    }
+  }
+
+  // The attributes we just added can change the results of function analyses
+  loopAnalysisManager.clear();
+  functionAnalysisManager.clear();
+
+  if(OPTIMIZATION_RANKS[pipeline] == ENV_OPTIMIZE_BASELINE)
+  {
+    llvm::ModulePassManager modulePassManager(debug);
+    modulePassManager.addPass(llvm::createModuleToFunctionPassAdaptor(BuildBaselinePipeline(debug)));
+
+    for(auto m : modules)
+      modulePassManager.run(*m, moduleAnalysisManager);
+  }
+  else if(OPTIMIZATION_RANKS[pipeline] != ENV_OPTIMIZE_O0)
+  {
+    // Remove redundant bounds checks once the loops have been simplified, but before they are vectorized. The ThinLTO
+    // pre-link pipeline leaves vectorization to the linker, which doesn't know about our pass, so it runs earlier there.
+    auto boundscheck = [](llvm::FunctionPassManager& fpm, llvm::PassBuilder::OptimizationLevel) {
+      fpm.addPass(BoundsCheckPass());
+    };
+    if(phase == LTO_PHASE::THIN)
+      passBuilder.registerScalarOptimizerLateEPCallback(boundscheck);
+    else
+      passBuilder.registerVectorizerStartEPCallback(boundscheck);
+
+    auto level = GetOptimizationLevel(OPTIMIZATION_RANKS[pipeline]);
+    llvm::ModulePassManager modulePassManager =
+      (phase == LTO_PHASE::THIN) ? passBuilder.buildThinLTOPreLinkDefaultPipeline(level, debug) :
+      (phase == LTO_PHASE::FULL) ? passBuilder.buildLTOPreLinkDefaultPipeline(level, debug) :
+                                   passBuilder.buildPerModuleDefaultPipeline(level, debug);
+
+    // Optimize all modules
+    for(auto m : modules)
+      modulePassManager.run(*m, moduleAnalysisManager);
+  }
+
+  for(auto fn : restore)
+  {
+    fn->removeFnAttr(llvm::Attribute::OptimizeNone);
+    fn->removeFnAttr(llvm::Attribute::NoInline);
+  }
 
   // fclose(aux);
   return ERR_SUCCESS;
+}
+
+IN_ERROR innative::OptimizeModules(const Environment* env, bool lto)
+{
+  std::vector<llvm::DenseMap<llvm::Function*, uint64_t>> levels(env->n_modules);
+
+  for(size_t i = 0; kh_size(env->optimizehints) > 0 && i < env->n_modules; ++i)
+  {
+    Module& m = env->modules[i];
+
+    // Functions are matched by any name they are exported as, but their name in the name section takes priority
+    auto find = [env, &m](const Identifier& name) -> khiter_t {
+      return kh_get_optimizehint(env->optimizehints, (std::string(m.name.str()) + '\0' + name.str()).c_str());
+    };
+
+    varuint32 imports = m.importsection.functions;
+    for(varuint32 j = 0; j < m.exportsection.n_exports; ++j)
+    {
+      Export& e = m.exportsection.exports[j];
+      if(e.kind != WASM_KIND_FUNCTION || e.index < imports || e.index - imports >= m.code.n_funcbody)
+        continue;
+      khiter_t iter = find(e.name);
+      if(kh_exist2(env->optimizehints, iter))
+        levels[i][m.cache->functions[e.index].internal] = kh_val(env->optimizehints, iter);
+    }
+
+    for(varuint32 j = 0; j < m.code.n_funcbody; ++j)
+    {
+      khiter_t iter = !m.code.funcbody[j].debug.name.size() ? kh_end(env->optimizehints) :
+                                                              find(m.code.funcbody[j].debug.name);
+      if(kh_exist2(env->optimizehints, iter))
+        levels[i][m.cache->functions[imports + j].internal] = kh_val(env->optimizehints, iter);
+    }
+  }
+
+  // The linker uses ThinLTO when multithreaded, see ENV_LTO
+  LTO_PHASE phase = !lto ? LTO_PHASE::NONE : (env->flags & ENV_MULTITHREADED) ? LTO_PHASE::THIN : LTO_PHASE::FULL;
+
+  // Every module lives in its own LLVMContext, so when multithreaded they are all optimized at once
+  std::vector<IN_ERROR> errors(env->n_modules, ERR_SUCCESS);
+  auto optimize = [env, phase, &levels, &errors](size_t i) {
+    errors[i] =
+      RunOptimizer(env->optimize, env->loglevel >= LOG_DEBUG, phase, { env->modules[i].cache->llvm }, levels[i]);
+  };
+
+  if(env->flags & ENV_MULTITHREADED)
+    utility::ParallelFor(*env, env->n_modules, 1, optimize);
+  else
+  {
+    for(size_t i = 0; i < env->n_modules; ++i)
+      optimize(i);
+  }
+
+  for(auto err : errors)
+    if(err < 0)
+      return err;
+  return ERR_SUCCESS;
+}
+
+IN_ERROR innative::OptimizeModule(llvm::Module& m, uint64_t optimize, bool debug)
+{
+  return RunOptimizer(optimize, debug, LTO_PHASE::NONE, { &m }, {});
 }
\ No newline at end of file
@@ -7,7 +7,8 @@
 #include "llvm.h"
 
 namespace innative {
-  IN_ERROR OptimizeModules(const Environment* env);
+  IN_ERROR OptimizeModules(const Environment* env, bool lto);
+  IN_ERROR OptimizeModule(llvm::Module& m, uint64_t optimize, bool debug);
 }
 
 #endif
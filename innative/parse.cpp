@@ -2,6 +2,7 @@
 // For conditions of distribution and use, see copyright notice in innative.h
 
 #include "parse.h"
+#include "body.h"
 #include "validate.h"
 #include "stream.h"
 #include "util.h"
@@ -20,25 +21,25 @@ namespace innative {
     IN_FORCEINLINE IN_ERROR ParseVarUInt32(Stream& s, varuint32& target)
     {
       IN_ERROR err;
-      target = static_cast<varuint32>(s.DecodeLEB128(err, 32, false));
+      target = static_cast<varuint32>(s.ReadLEB128<32, false>(err));
       return err;
     }
     IN_FORCEINLINE IN_ERROR ParseVarSInt7(Stream& s, varsint7& target)
     {
       IN_ERROR err;
-      target = static_cast<varsint7>(s.DecodeLEB128(err, 7, true));
+      target = static_cast<varsint7>(s.ReadLEB128<7, true>(err));
       return err;
     }
     IN_FORCEINLINE IN_ERROR ParseVarUInt7(Stream& s, varuint7& target)
     {
       IN_ERROR err;
-      target = static_cast<varuint7>(s.DecodeLEB128(err, 7, false));
+      target = static_cast<varuint7>(s.ReadLEB128<7, false>(err));
       return err;
     }
     IN_FORCEINLINE IN_ERROR ParseVarUInt1(Stream& s, varuint1& target)
     {
       IN_ERROR err;
-      target = static_cast<varuint1>(s.DecodeLEB128(err, 1, false));
+      target = static_cast<varuint1>(s.ReadLEB128<1, false>(err));
       return err;
     }
     IN_FORCEINLINE IN_ERROR ParseByte(Stream& s, uint8_t& target)
@@ -74,6 +75,29 @@ namespace innative {
       }
     };
 
+    // Arrays of indices are common enough to be worth decoding in bulk instead of one value at a time
+    IN_ERROR ParseVarUInt32Array(Stream& s, varuint32*& ptr, varuint32& size, const Environment& env)
+    {
+      IN_ERROR err = ParseVarUInt32(s, size);
+      if(err < 0)
+        return err;
+
+      if(!size)
+      {
+        ptr = 0;
+        return err;
+      }
+      if(size > s.size - s.pos) // Every value takes at least one byte
+        return ERR_PARSE_UNEXPECTED_EOF;
+
+      ptr = tmalloc<varuint32>(env, size);
+      if(!ptr)
+        return ERR_FATAL_OUT_OF_MEMORY;
+
+      s.ReadVarUInt32Array(ptr, size, err);
+      return err;
+    }
+
     struct LocalEntry
     {
       varuint32 count;
@@ -99,6 +123,15 @@ IN_ERROR innative::ParseByteArray(Stream& s, ByteArray& section, bool terminator
   if(err < 0)
     return err;
 
+  if(!terminator && s.persistent) // The source outlives the module, so point into it instead of copying
+  {
+    if(n > s.size - s.pos)
+      return ERR_PARSE_UNEXPECTED_EOF;
+    section = ByteArray(s.data + s.pos, n);
+    s.pos += n;
+    return ERR_SUCCESS;
+  }
+
   section.resize(n, terminator, env);
   if(n > 0)
   {
@@ -276,7 +309,7 @@ IN_ERROR innative::ParseInstruction(Stream& s, Instruction& ins, const Environme
       err = ERR_INVALID_RESERVED_VALUE;
     break;
   case OP_br_table:
-    err = Parse<varuint32>::template Array<&ParseVarUInt32>(s, ins.immediates[0].table, ins.immediates[0].n_table, env);
+    err = ParseVarUInt32Array(s, ins.immediates[0].table, ins.immediates[0].n_table, env);
 
     if(err >= 0)
       ins.immediates[1]._varuint32 = s.ReadVarUInt32(err);
@@ -473,7 +506,7 @@ IN_ERROR innative::ParseTableInit(Stream& s, TableInit& init, Module& m, const E
     if(!desc)
       err = ERR_INVALID_TABLE_INDEX;
     else if(desc->element_type == TE_funcref)
-      err = Parse<varuint32>::template Array<&ParseVarUInt32>(s, init.elements, init.n_elements, env);
+      err = ParseVarUInt32Array(s, init.elements, init.n_elements, env);
     else
       err = ERR_FATAL_BAD_ELEMENT_TYPE;
   }
@@ -481,18 +514,81 @@ IN_ERROR innative::ParseTableInit(Stream& s, TableInit& init, Module& m, const E
   return err;
 }
 
-IN_ERROR innative::ParseFunctionBody(Stream& s, FunctionBody& f, const Environment& env)
+IN_ERROR innative::ParseInstruction(Stream& s, Instruction& ins, const Environment& env, std::vector<varuint32>& table)
+{
+  if(s.pos >= s.size || s.data[s.pos] != OP_br_table)
+    return ParseInstruction(s, ins, env);
+
+  IN_ERROR err = ERR_SUCCESS;
+  ins.opcode   = s.ReadByte(err);
+  ins.line     = 0;
+  ins.column   = 0;
+  size_t size  = s.ReadVarUInt32(err);
+  if(err >= 0 && size > s.size - s.pos) // Every target takes at least one byte
+    err = ERR_PARSE_UNEXPECTED_EOF;
+  table.resize(err >= 0 ? size : 0);
+  for(size_t i = 0; i < table.size() && err >= 0; ++i)
+    table[i] = s.ReadVarUInt32(err);
+  if(err >= 0)
+    ins.immediates[1]._varuint32 = s.ReadVarUInt32(err);
+  ins.immediates[0].n_table = static_cast<varuint32>(table.size());
+  ins.immediates[0].table   = table.data();
+  return err;
+}
+
+namespace innative {
+  namespace internal {
+    // Decodes every instruction in a function body, optionally validating each one as soon as it is decoded
+    IN_ERROR DecodeFunctionBody(Stream& s, size_t end, FunctionBody& f, const Environment& env, BodyValidator* validator)
+    {
+      if(!f.body_size)
+        return ERR_SUCCESS;
+
+      // Every instruction re-encodes into at most the number of bytes it was parsed from, so body_size is always enough
+      f.body = tmalloc<uint8_t>(env, f.body_size);
+      if(!f.body)
+        return ERR_FATAL_OUT_OF_MEMORY;
+
+      // br_table targets are re-encoded into the body right away, so they don't need their own allocation
+      IN_ERROR err = ERR_SUCCESS;
+      Instruction ins;
+      std::vector<varuint32> table;
+      for(; s.pos < end && err >= 0; ++f.n_body)
+      {
+        if((err = ParseInstruction(s, ins, env, table)) < 0)
+          break;
+        if(s.pos > end) // An instruction that runs past the end of the body could overflow the instruction stream
+          return ERR_PARSE_UNEXPECTED_EOF;
+        if(validator)
+          validator->Validate(ins);
+        f.n_bytes += (varuint32)EncodeInstruction(f.body + f.n_bytes, ins);
+      }
+      return err;
+    }
+  }
+}
+
+IN_ERROR innative::ParseFunctionBody(Stream& s, FunctionBody& f, const Environment& env, const FunctionType* sig,
+                                     Module* m)
 {
   IN_ERROR err = ParseVarUInt32(s, f.body_size);
   size_t end   = s.pos + f.body_size; // body_size is the size of both local_entries and body in bytes.
 
   if(err >= 0) // Parse local entries into a temporary array, then expand them into a usable local type array.
   {
-    LocalEntry* locals;
+    ScratchScope scratch(env);
     varuint32 n_locals;
-    err = Parse<LocalEntry>::template Array<&ParseLocalEntry>(s, locals, n_locals, env);
-    if(err < 0)
+    if((err = ParseVarUInt32(s, n_locals)) < 0)
       return err;
+    if(n_locals > s.size - s.pos) // Every entry takes at least one byte
+      return ERR_PARSE_UNEXPECTED_EOF;
+
+    LocalEntry* locals = scratch.alloc<LocalEntry>(n_locals);
+    if(n_locals > 0 && !locals)
+      return ERR_FATAL_OUT_OF_MEMORY;
+    for(varuint32 i = 0; i < n_locals; ++i)
+      if((err = ParseLocalEntry(s, locals[i])) < 0)
+        return err;
 
     f.n_locals = 0;
     for(varuint32 i = 0; i < n_locals; ++i)
@@ -511,23 +607,96 @@ IN_ERROR innative::ParseFunctionBody(Stream& s, FunctionBody& f, const Environme
         f.locals[f.n_locals++] = locals[i].type;
   }
 
-  f.body = 0;
-  if(err >= 0 && f.body_size > 0)
-  {
-    f.body = tmalloc<Instruction>(env, f.body_size); // Overallocate maximum number of possible instructions we might have
-    if(!f.body)
-      return ERR_FATAL_OUT_OF_MEMORY;
-
-    for(f.n_body = 0; s.pos < end && err >= 0; ++f.n_body)
-      err = ParseInstruction(s, f.body[f.n_body], env);
-  }
+  f.body        = 0;
+  f.n_body      = 0;
+  f.n_bytes     = 0;
+  f.lines       = 0; // Binary modules have no source locations, so we never allocate a debug location array.
   f.local_names = 0;
   f.param_names = 0;
   f.debug       = { 0 };
 
+  // Validating only appends errors to the environment, which is safe to do from any thread
+  if(err >= 0 && (env.flags & ENV_LAZY_DECODE))
+  {
+    // Leave the instructions in the module source, they will be decoded by whatever reads them
+    if(s.pos > end || end > s.size)
+      return ERR_PARSE_UNEXPECTED_EOF;
+    f.body    = s.data + s.pos;
+    f.n_bytes = static_cast<varuint32>(end - s.pos);
+    s.pos     = end;
+    if(sig) // The body is still hot in the cache, so this is much cheaper than validating it later
+      ValidateFunctionBody(*sig, f, const_cast<Environment&>(env), m);
+  }
+  else if(err >= 0 && sig)
+  {
+    BodyValidator validator(*sig, f, const_cast<Environment&>(env), m);
+    if((err = internal::DecodeFunctionBody(s, end, f, env, &validator)) >= 0)
+      validator.Finish();
+  }
+  else if(err >= 0)
+    err = internal::DecodeFunctionBody(s, end, f, env, nullptr);
+
   return err;
 }
 
+IN_ERROR innative::ParseCodeSection(Stream& s, Module& m, const Environment& env)
+{
+  // Bodies whose signature is invalid or missing are left for ValidateModule, which reports the actual error
+  m.code.validated = (env.flags & ENV_FUSED_VALIDATION) != 0;
+  auto parse       = [&](Stream& body, size_t i) {
+    const FunctionType* sig = nullptr;
+    if(m.code.validated && i < m.function.n_funcdecl && m.function.funcdecl[i] < m.type.n_functions)
+      sig = &m.type.functions[m.function.funcdecl[i]];
+    return ParseFunctionBody(body, m.code.funcbody[i], env, sig, &m);
+  };
+
+  IN_ERROR err = ParseVarUInt32(s, m.code.n_funcbody);
+  if(err < 0 || !m.code.n_funcbody)
+  {
+    m.code.funcbody = 0;
+    return err;
+  }
+  if(m.code.n_funcbody > s.size - s.pos) // Every body takes at least one byte
+    return ERR_PARSE_UNEXPECTED_EOF;
+
+  m.code.funcbody = tmalloc<FunctionBody>(env, m.code.n_funcbody);
+  if(!m.code.funcbody)
+    return ERR_FATAL_OUT_OF_MEMORY;
+  memset(m.code.funcbody, 0, sizeof(FunctionBody) * m.code.n_funcbody);
+
+  if(!(env.flags & ENV_MULTITHREADED))
+  {
+    for(varuint32 i = 0; i < m.code.n_funcbody && err >= 0; ++i)
+      err = parse(s, i);
+    return err;
+  }
+
+  // Every function body starts with its size, so we can find where all of them start with a single scan and then parse
+  // them in parallel. Each body gets its own stream over the entire module, so errors are identical to a serial parse.
+  std::vector<size_t> starts(m.code.n_funcbody);
+  for(varuint32 i = 0; i < m.code.n_funcbody; ++i)
+  {
+    starts[i]      = s.pos;
+    varuint32 size = s.ReadVarUInt32(err);
+    if(err < 0)
+      return err;
+    if(size > s.size - s.pos)
+      return ERR_PARSE_UNEXPECTED_EOF;
+    s.pos += size;
+  }
+
+  std::vector<IN_ERROR> errors(m.code.n_funcbody, ERR_SUCCESS);
+  ParallelFor(env, m.code.n_funcbody, IN_PARALLEL_PARSE_MIN_FUNCTIONS, [&](size_t i) {
+    Stream body = { s.data, s.size, starts[i], s.persistent };
+    errors[i]   = parse(body, i);
+  });
+
+  for(auto e : errors) // Report the same error a serial parse would have stopped at
+    if(e < 0)
+      return e;
+  return ERR_SUCCESS;
+}
+
 IN_ERROR innative::ParseDataInit(Stream& s, DataInit& data, const Environment& env)
 {
   IN_ERROR err = ParseVarUInt32(s, data.index);
@@ -644,6 +813,48 @@ IN_ERROR innative::ParseNameSection(Stream& s, size_t end, Module& m, const Envi
   return err;
 }
 
+// Finds the module name in the name section without parsing any other section. The name is left empty if the module
+// doesn't have one. Nothing else is checked, so an error only means the module must be parsed to find out what's wrong.
+IN_ERROR innative::ParseModuleName(Stream& s, const Environment& env, Identifier& name)
+{
+  IN_ERROR err = ERR_SUCCESS;
+  if(s.ReadUInt32(err) != WASM_MAGIC_COOKIE)
+    return ERR_PARSE_INVALID_MAGIC_COOKIE;
+  if(s.ReadUInt32(err) != WASM_MAGIC_VERSION)
+    return ERR_PARSE_INVALID_VERSION;
+
+  while(err >= 0 && !s.End())
+  {
+    varuint7 opcode   = s.ReadVarUInt7(err);
+    varuint32 payload = s.ReadVarUInt32(err);
+    size_t end        = s.pos + payload;
+    if(err < 0)
+      return err;
+    if(end > s.size)
+      return ERR_PARSE_INVALID_FILE_LENGTH;
+
+    // Comparing the custom section identifier in place avoids allocating a copy of every one of them
+    varuint32 n = (opcode == WASM_SECTION_CUSTOM) ? s.ReadVarUInt32(err) : 0;
+    if(err >= 0 && n == 4 && s.pos + n <= end && !memcmp(s.data + s.pos, "name", n))
+    {
+      s.pos += n;
+      while(err >= 0 && s.pos < end)
+      {
+        auto type = s.ReadVarUInt7(err);
+        auto len  = s.ReadVarUInt32(err);
+        if(err >= 0 && type == 0) // module
+          err = ParseByteArray(s, name, true, env);
+        else
+          s.pos += len;
+      }
+    }
+
+    s.pos = end;
+  }
+
+  return err;
+}
+
 IN_ERROR innative::ParseModule(Stream& s, const Environment& env, Module& m, ByteArray name, ValidationError*& errors)
 {
   m = { 0 };
@@ -744,7 +955,7 @@ IN_ERROR innative::ParseModule(Stream& s, const Environment& env, Module& m, Byt
     }
     break;
     case WASM_SECTION_FUNCTION:
-      err = Parse<varuint32>::template Array<&ParseVarUInt32>(s, m.function.funcdecl, m.function.n_funcdecl, env);
+      err = ParseVarUInt32Array(s, m.function.funcdecl, m.function.n_funcdecl, env);
       break;
     case WASM_SECTION_TABLE:
       err = Parse<TableDesc>::template Array<&ParseTableDesc>(s, m.table.tables, m.table.n_tables, env);
@@ -766,10 +977,7 @@ IN_ERROR innative::ParseModule(Stream& s, const Environment& env, Module& m, Byt
                                                                                            m.element.n_elements, env, m,
                                                                                            env);
       break;
-    case WASM_SECTION_CODE:
-      err = Parse<FunctionBody, const Environment&>::template Array<&ParseFunctionBody>(s, m.code.funcbody,
-                                                                                        m.code.n_funcbody, env, env);
-      break;
+    case WASM_SECTION_CODE: err = ParseCodeSection(s, m, env); break;
     case WASM_SECTION_DATA:
       err = Parse<DataInit, const Environment&>::template Array<&ParseDataInit>(s, m.data.data, m.data.n_data, env, env);
       break;
@@ -5,6 +5,7 @@
 #define IN__PARSE_H
 
 #include "stream.h"
+#include <vector>
 
 namespace innative {
   IN_ERROR ParseByteArray(utility::Stream& s, ByteArray& section, bool terminator, const Environment& env);
@@ -19,11 +20,17 @@ namespace innative {
   IN_ERROR ParseImport(utility::Stream& s, Import& i, const Environment& env);
   IN_ERROR ParseExport(utility::Stream& s, Export& e, const Environment& env);
   IN_ERROR ParseInstruction(utility::Stream& s, Instruction& ins, const Environment& env);
+  // Decodes br_table targets into table instead of allocating them, so they are only valid until table is reused
+  IN_ERROR ParseInstruction(utility::Stream& s, Instruction& ins, const Environment& env, std::vector<varuint32>& table);
   IN_ERROR ParseTableInit(utility::Stream& s, TableInit& init, Module& m, const Environment& env);
-  IN_ERROR ParseFunctionBody(utility::Stream& s, FunctionBody& f, const Environment& env);
+  // If sig is not null, the body is also validated against it while it's being decoded
+  IN_ERROR ParseFunctionBody(utility::Stream& s, FunctionBody& f, const Environment& env,
+                             const FunctionType* sig = nullptr, Module* m = nullptr);
+  IN_ERROR ParseCodeSection(utility::Stream& s, Module& m, const Environment& env);
   IN_ERROR ParseDataInit(utility::Stream& s, DataInit& data, const Environment& env);
   IN_ERROR ParseNameSectionLocal(utility::Stream& s, size_t num, DebugInfo*& target, const Environment& env);
   IN_ERROR ParseNameSection(utility::Stream& s, size_t end, Module& m, const Environment& env);
+  IN_ERROR ParseModuleName(utility::Stream& s, const Environment& env, Identifier& name);
   IN_ERROR ParseModule(utility::Stream& s, const Environment& env, Module& module, ByteArray name,
                        ValidationError*& errors);
   IN_ERROR ParseExportFixup(Module& module, ValidationError*& errors, const Environment& env);
@@ -2,6 +2,7 @@
 // For conditions of distribution and use, see copyright notice in innative.h
 
 #include "serialize.h"
+#include "body.h"
 #include <stdarg.h>
 #include <ostream>
 
@@ -410,10 +411,10 @@ void innative::wat::TokenizeModule(const Environment& env, Queue<WatToken>& toke
       tokens.Push(WatToken{ WatTokens::CLOSE });
     }
 
-    for(varuint32 j = 0; j < m.code.funcbody[i].n_body; ++j)
-    {
-      TokenizeInstruction(env, tokens, m, m.code.funcbody[i].body[j], &m.code.funcbody[i], &fn);
-    }
+    BodyReader reader(m.code.funcbody[i], env);
+    Instruction ins;
+    while(!reader.End() && reader.Read(ins) >= 0) // Stop at the first instruction that can't be decoded
+      TokenizeInstruction(env, tokens, m, ins, &m.code.funcbody[i], &fn);
     tokens.Push(WatToken{ WatTokens::CLOSE });
   }
 
@@ -3,6 +3,14 @@
 
 #include "stream.h"
 
+#if(defined(IN_CPU_x86_64) || defined(IN_CPU_x86)) && (defined(IN_COMPILER_MSC) || defined(__SSE2__))
+#define IN_SSE2_LEB128
+#include <emmintrin.h>
+#ifdef IN_COMPILER_MSC
+#include <intrin.h>
+#endif
+#endif
+
 using namespace innative;
 using namespace utility;
 
@@ -25,7 +33,7 @@ uint64_t Stream::DecodeLEB128(IN_ERROR& err, unsigned int maxbits, bool sign)
       return 0;
     }
 
-    result |= ((byte & 0x7F) << shift);
+    result |= (uint64_t(byte & 0x7F) << shift);
     shift += 7;
   } while((byte & 0x80) != 0);
 
@@ -35,7 +43,7 @@ uint64_t Stream::DecodeLEB128(IN_ERROR& err, unsigned int maxbits, bool sign)
   {
     // If our encoding is potentially overlong, we must correct the sign bit to the final legal bit
     signbit  = (1 << (maxbits + 6 - shift)) & byte;
-    int bits = (~0 << (maxbits + 7 - shift)) & 0x7F; // Gets the illegal bits of this byte
+    int bits = (~0U << (maxbits + 7 - shift)) & 0x7F; // Gets the illegal bits of this byte
 
     if(sign && signbit) // If the sign bit is set, we need to check (~byte)&bits instead of byte&bits
       byte = ~byte;
@@ -48,9 +56,89 @@ uint64_t Stream::DecodeLEB128(IN_ERROR& err, unsigned int maxbits, bool sign)
   }
 
   // assert(!(((~0ULL) << maxbits) & result));
-  if(sign && signbit != 0)
+  if(sign && signbit != 0 && shift < 64)
     result |= (~0ULL << shift);
 
   err = ERR_SUCCESS;
   return result;
-}
\ No newline at end of file
+}
+
+#ifdef IN_SSE2_LEB128
+namespace {
+  IN_FORCEINLINE uint32_t CountTrailingZeros(uint32_t v)
+  {
+#ifdef IN_COMPILER_MSC
+    unsigned long r;
+    _BitScanForward(&r, v);
+    return r;
+#else
+    return __builtin_ctz(v);
+#endif
+  }
+}
+#endif
+
+void Stream::ReadVarUInt32Array(varuint32* out, size_t n, IN_ERROR& err)
+{
+  err = ERR_SUCCESS;
+
+#ifdef IN_SSE2_LEB128
+  // The continuation bits of a 16 byte block tell us where every value in it ends. A block of single byte values is
+  // simply widened, otherwise each value of up to 4 bytes that ends inside the block is decoded with a single load.
+  // Values of 5 bytes could be overlong, so they are left to DecodeLEB128, as are values crossing the end of the block.
+  IN_ALIGN(16) uint8_t block[16 + 4] = { 0 }; // Padding lets us always load 4 bytes
+  const __m128i zero = _mm_setzero_si128();
+
+  while(n > 0 && size - pos >= 16)
+  {
+    __m128i chunk = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data + pos));
+    uint32_t ends = ~static_cast<uint32_t>(_mm_movemask_epi8(chunk)) & 0xFFFF;
+
+    if(ends == 0xFFFF && n >= 16)
+    {
+      __m128i lo = _mm_unpacklo_epi8(chunk, zero);
+      __m128i hi = _mm_unpackhi_epi8(chunk, zero);
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(out) + 0, _mm_unpacklo_epi16(lo, zero));
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(out) + 1, _mm_unpackhi_epi16(lo, zero));
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(out) + 2, _mm_unpacklo_epi16(hi, zero));
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(out) + 3, _mm_unpackhi_epi16(hi, zero));
+      out += 16;
+      n -= 16;
+      pos += 16;
+      continue;
+    }
+
+    _mm_store_si128(reinterpret_cast<__m128i*>(block), chunk);
+    uint32_t offset = 0;
+    while(n > 0 && offset < 16 && (ends >> offset) != 0)
+    {
+      uint32_t len = CountTrailingZeros(ends >> offset) + 1;
+      if(len > 4)
+        break;
+
+      uint32_t w;
+      memcpy(&w, block + offset, sizeof(w));
+      w &= ~0U >> (32 - (len << 3));
+      *out++ = (w & 0x7F) | ((w >> 1) & (0x7F << 7)) | ((w >> 2) & (0x7F << 14)) | ((w >> 3) & (0x7F << 21));
+      offset += len;
+      --n;
+    }
+
+    pos += offset;
+    if(!offset && n > 0) // The next value is too long for the block, so decode it normally
+    {
+      *out++ = ReadVarUInt32(err);
+      if(err < 0)
+        return;
+      --n;
+    }
+  }
+#endif
+
+  for(; n > 0; --n)
+  {
+    *out++ = ReadVarUInt32(err);
+    if(err < 0)
+      return;
+  }
+}
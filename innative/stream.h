@@ -17,6 +17,7 @@ namespace innative {
       uint8_t* data;
       size_t size;
       size_t pos;
+      bool persistent; // True if data outlives anything parsed from it, so byte arrays can point into it without copying
 
       // Attempts to read num bytes from the stream, returns actual number of bytes read
       inline size_t ReadBytes(uint8_t* target, size_t num) noexcept
@@ -70,13 +71,42 @@ namespace innative {
       }
 
       IN_COMPILER_DLLEXPORT uint64_t DecodeLEB128(IN_ERROR& err, unsigned int maxbits, bool sign);
-      IN_FORCEINLINE varuint1 ReadVarUInt1(IN_ERROR& err) { return DecodeLEB128(err, 1, false) != 0; }
-      IN_FORCEINLINE varuint7 ReadVarUInt7(IN_ERROR& err) { return static_cast<varuint7>(DecodeLEB128(err, 7, false)); }
-      IN_FORCEINLINE varuint32 ReadVarUInt32(IN_ERROR& err) { return static_cast<varuint32>(DecodeLEB128(err, 32, false)); }
-      IN_FORCEINLINE varuint64 ReadVarUInt64(IN_ERROR& err) { return static_cast<varuint64>(DecodeLEB128(err, 64, false)); }
-      IN_FORCEINLINE varsint7 ReadVarInt7(IN_ERROR& err) { return static_cast<varsint7>(DecodeLEB128(err, 7, true)); }
-      IN_FORCEINLINE varsint32 ReadVarInt32(IN_ERROR& err) { return static_cast<varsint32>(DecodeLEB128(err, 32, true)); }
-      IN_FORCEINLINE varsint64 ReadVarInt64(IN_ERROR& err) { return static_cast<varsint64>(DecodeLEB128(err, 64, true)); }
+
+      // Decodes one and two byte LEB128 values inline, which covers almost every index, count and type in a module. All
+      // longer encodings and all error handling are left to DecodeLEB128.
+      template<unsigned int MAXBITS, bool SIGN> IN_FORCEINLINE uint64_t ReadLEB128(IN_ERROR& err)
+      {
+        static_assert(MAXBITS > 0 && MAXBITS <= 64, "LEB128 values must be between 1 and 64 bits");
+        if(MAXBITS >= 7 && pos < size && data[pos] < 0x80)
+        {
+          uint64_t r = data[pos++];
+          if(SIGN && (r & 0x40))
+            r |= ~0ULL << 7;
+          err = ERR_SUCCESS;
+          return r;
+        }
+        if(MAXBITS >= 14 && size - pos >= 2 && data[pos + 1] < 0x80) // We know the first byte has a continuation bit
+        {
+          uint64_t r = (data[pos] & 0x7F) | (uint64_t(data[pos + 1]) << 7);
+          pos += 2;
+          if(SIGN && (r & (1 << 13)))
+            r |= ~0ULL << 14;
+          err = ERR_SUCCESS;
+          return r;
+        }
+        return DecodeLEB128(err, MAXBITS, SIGN);
+      }
+
+      // Decodes n consecutive varuint32 values into out, using SIMD to decode blocks of 16 bytes at a time if available.
+      IN_COMPILER_DLLEXPORT void ReadVarUInt32Array(varuint32* out, size_t n, IN_ERROR& err);
+
+      IN_FORCEINLINE varuint1 ReadVarUInt1(IN_ERROR& err) { return ReadLEB128<1, false>(err) != 0; }
+      IN_FORCEINLINE varuint7 ReadVarUInt7(IN_ERROR& err) { return static_cast<varuint7>(ReadLEB128<7, false>(err)); }
+      IN_FORCEINLINE varuint32 ReadVarUInt32(IN_ERROR& err) { return static_cast<varuint32>(ReadLEB128<32, false>(err)); }
+      IN_FORCEINLINE varuint64 ReadVarUInt64(IN_ERROR& err) { return static_cast<varuint64>(ReadLEB128<64, false>(err)); }
+      IN_FORCEINLINE varsint7 ReadVarInt7(IN_ERROR& err) { return static_cast<varsint7>(ReadLEB128<7, true>(err)); }
+      IN_FORCEINLINE varsint32 ReadVarInt32(IN_ERROR& err) { return static_cast<varsint32>(ReadLEB128<32, true>(err)); }
+      IN_FORCEINLINE varsint64 ReadVarInt64(IN_ERROR& err) { return static_cast<varsint64>(ReadLEB128<64, true>(err)); }
       template<class T> inline T ReadPrimitive(IN_ERROR& err)
       {
         T r = 0;
@@ -0,0 +1,103 @@
+// Copyright (c)2019 Black Sphere Studios
+// For conditions of distribution and use, see copyright notice in innative.h
+
+#include "threadpool.h"
+
+IN_WASM_THREADPOOL::IN_WASM_THREADPOOL(unsigned int maxthreads) : threads(maxthreads), stop(false)
+{
+  if(!threads)
+    threads = std::thread::hardware_concurrency();
+  if(!threads)
+    threads = 1;
+}
+
+IN_WASM_THREADPOOL::~IN_WASM_THREADPOOL()
+{
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    stop = true;
+  }
+  signal.notify_all();
+
+  for(auto& worker : workers)
+    worker.join();
+
+  // If there are no workers, tasks only run while someone waits on them, so we must finish any that are left
+  std::unique_lock<std::mutex> guard(lock);
+  while(RunTask(guard))
+    ;
+}
+
+std::future<void> IN_WASM_THREADPOOL::Queue(std::packaged_task<void()>&& task, bool defer)
+{
+  std::future<void> r = task.get_future();
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    if(workers.empty())
+      Start();
+    tasks.push_back(std::move(task));
+    if(defer)
+      deferred.push_back(std::move(r));
+  }
+  signal.notify_all();
+  return r;
+}
+
+// Must be called while holding the lock. The thread waiting on a task is the last thread, so we create one less worker.
+void IN_WASM_THREADPOOL::Start()
+{
+  for(unsigned int i = 1; i < threads; ++i)
+    workers.emplace_back(&IN_WASM_THREADPOOL::Work, this);
+}
+
+bool IN_WASM_THREADPOOL::RunTask(std::unique_lock<std::mutex>& guard)
+{
+  if(tasks.empty())
+    return false;
+
+  std::packaged_task<void()> task = std::move(tasks.front());
+  tasks.pop_front();
+  guard.unlock();
+  task();
+  guard.lock();
+  signal.notify_all(); // Wake up anyone waiting on this task
+  return true;
+}
+
+void IN_WASM_THREADPOOL::Work()
+{
+  std::unique_lock<std::mutex> guard(lock);
+  while(RunTask(guard) || !stop)
+  {
+    if(tasks.empty() && !stop)
+      signal.wait(guard);
+  }
+}
+
+void IN_WASM_THREADPOOL::Wait(std::future<void>& f)
+{
+  std::unique_lock<std::mutex> guard(lock);
+  while(f.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+  {
+    if(!RunTask(guard))
+      signal.wait(guard);
+  }
+}
+
+void IN_WASM_THREADPOOL::WaitDeferred()
+{
+  std::vector<std::future<void>> pending;
+  for(;;) // Deferred tasks can defer more tasks, so keep going until there are none left
+  {
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      pending.swap(deferred);
+    }
+    if(pending.empty())
+      return;
+
+    for(auto& f : pending)
+      Wait(f);
+    pending.clear();
+  }
+}
@@ -0,0 +1,53 @@
+// Copyright (c)2019 Black Sphere Studios
+// For conditions of distribution and use, see copyright notice in innative.h
+
+#ifndef IN__THREADPOOL_H
+#define IN__THREADPOOL_H
+
+#include "innative/innative.h"
+#include <condition_variable>
+#include <deque>
+#include <future>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// A fixed set of worker threads shared by every multithreaded action in an environment. The workers are only created
+// the first time a task is submitted. A thread that waits on a task runs other queued tasks until it finishes, so tasks
+// can submit and wait on more tasks without deadlocking the pool, and the waiting thread counts as one of its threads.
+struct IN_WASM_THREADPOOL
+{
+  IN_COMPILER_DLLEXPORT explicit IN_WASM_THREADPOOL(unsigned int maxthreads);
+  IN_COMPILER_DLLEXPORT ~IN_WASM_THREADPOOL(); // Finishes every queued task before joining the workers
+
+  // Number of threads that can run tasks at once, including whichever thread is waiting on them
+  inline unsigned int Size() const { return threads; }
+
+  template<class F> std::future<void> Submit(F&& f)
+  {
+    return Queue(std::packaged_task<void()>(std::forward<F>(f)), false);
+  }
+
+  // Blocks until a task is finished, running other queued tasks in the meantime
+  IN_COMPILER_DLLEXPORT void Wait(std::future<void>& f);
+
+  // Submits a task that nobody waits on individually, it will instead be finished by the next call to WaitDeferred
+  template<class F> void Defer(F&& f) { Queue(std::packaged_task<void()>(std::forward<F>(f)), true); }
+  IN_COMPILER_DLLEXPORT void WaitDeferred();
+
+protected:
+  IN_COMPILER_DLLEXPORT std::future<void> Queue(std::packaged_task<void()>&& task, bool defer);
+  void Start();
+  void Work();
+  bool RunTask(std::unique_lock<std::mutex>& guard);
+
+  unsigned int threads;
+  bool stop;
+  std::mutex lock;
+  std::condition_variable signal; // Notified whenever a task is queued or finished
+  std::deque<std::packaged_task<void()>> tasks;
+  std::vector<std::thread> workers;
+  std::vector<std::future<void>> deferred;
+};
+
+#endif
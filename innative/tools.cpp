@@ -5,11 +5,12 @@
 #include "validate.h"
 #include "compile.h"
 #include "link.h"
+#include "jit.h"
 #include "tools.h"
 #include "wast.h"
 #include "serialize.h"
 #include <atomic>
-#include <thread>
+#include "threadpool.h"
 #include <fstream>
 #include <stdio.h>
 #include <sstream>
@@ -22,11 +23,14 @@ Environment* innative::CreateEnvironment(unsigned int modules, unsigned int maxt
   Environment* env = (Environment*)calloc(1, sizeof(Environment));
   if(env)
   {
-    env->modulemap = kh_init_modules();
-    env->whitelist = kh_init_modulepair();
-    env->cimports  = kh_init_cimport();
-    env->modules   = trealloc<Module>(0, modules);
-    env->alloc     = new IN_WASM_ALLOCATOR();
+    env->modulemap     = kh_init_modules();
+    env->whitelist     = kh_init_modulepair();
+    env->optimizehints = kh_init_optimizehint();
+    env->cimports      = kh_init_cimport();
+    env->modules       = trealloc<Module>(0, modules);
+    env->alloc         = new IN_WASM_ALLOCATOR();
+    env->pool          = new IN_WASM_THREADPOOL(maxthreads);
+    env->alloc->env = env; // Enforces memlimit, which stays 0 (unlimited) unless it's set after this returns
 
     if(!env->modules)
     {
@@ -50,9 +54,10 @@ Environment* innative::CreateEnvironment(unsigned int modules, unsigned int maxt
       return nullptr;
     }
 
-    env->objpath  = 0;
-    env->system   = "";
-    env->wasthook = 0;
+    env->objpath   = 0;
+    env->cachepath = 0;
+    env->system    = "";
+    env->wasthook  = 0;
   }
   return env;
 }
@@ -68,11 +73,52 @@ void innative::ClearEnvironmentCache(Environment* env, Module* m)
                                 // there is no way to restore it.
 }
 
+namespace innative {
+  namespace internal {
+    // Size of a hash table's buckets, keys and values, not counting anything the keys or values point to
+    template<class H> inline size_t HashMemory(const H* h, bool map)
+    {
+      if(!h)
+        return 0;
+      size_t bucket = sizeof(*h->keys) + (map ? sizeof(*h->vals) : 0);
+      return sizeof(H) + (h->n_buckets * bucket) + (__ac_fsize(h->n_buckets) * sizeof(khint32_t));
+    }
+  }
+}
+
+IN_ERROR innative::GetMemoryUsage(const Environment* env, MemoryUsage* usage)
+{
+  if(!env || !usage)
+    return ERR_FATAL_NULL_POINTER;
+
+  *usage = MemoryUsage{ 0 };
+  if(env->alloc)
+  {
+    usage->arena = env->alloc->total.load(std::memory_order_relaxed);
+    std::lock_guard<std::mutex> lock(env->alloc->mapslock);
+    for(auto& map : env->alloc->maps)
+      usage->mapped += map.second;
+  }
+
+  usage->modules = env->capacity * sizeof(Module);
+  usage->hashes  = internal::HashMemory(env->modulemap, true) + internal::HashMemory(env->whitelist, true) +
+                  internal::HashMemory(env->optimizehints, true) + internal::HashMemory(env->cimports, false);
+  for(size_t i = 0; i < env->n_modules; ++i)
+  {
+    usage->hashes += internal::HashMemory(env->modules[i].exports, true);
+    usage->llvm += GetCacheMemory(env->modules[i]);
+  }
+
+  usage->total = usage->arena + usage->modules + usage->hashes + usage->llvm;
+  return ERR_SUCCESS;
+}
+
 void innative::DestroyEnvironment(Environment* env)
 {
   if(!env)
     return;
 
+  delete env->pool; // Finishes any pending tasks, which could still be using the environment
   ClearEnvironmentCache(env, 0);
   for(varuint32 i = 0; i < env->n_modules; ++i)
   {
@@ -80,18 +126,85 @@ void innative::DestroyEnvironment(Environment* env)
     assert(!env->modules[i].cache);
   }
 
-  delete env->alloc;
+  delete env->alloc; // Also unmaps any files that were mapped into memory
   kh_destroy_modulepair(env->whitelist);
+  kh_destroy_optimizehint(env->optimizehints);
   kh_destroy_modules(env->modulemap);
   kh_destroy_cimport(env->cimports);
   free(env->modules);
   free(env);
 }
 
+// With an object cache, a binary module isn't parsed until we know its objects aren't already cached. Finding them only
+// takes the module name, which can be read without parsing anything else. Buffers are normally discarded after loading,
+// so they are copied to keep the source around until then.
+IN_ERROR DeferModule(Environment& env, Module& m, const Stream& s, ByteArray name)
+{
+  m                   = { 0 };
+  const uint8_t* data = s.data;
+  if(!s.persistent)
+  {
+    uint8_t* copy = tmalloc<uint8_t>(env, s.size);
+    if(!copy)
+      return ERR_FATAL_OUT_OF_MEMORY;
+    tmemcpy<uint8_t>(copy, s.size, s.data, s.size);
+    data = copy;
+  }
+
+  Stream source = { (uint8_t*)data, s.size, 0, true };
+  if(ParseModuleName(source, env, m.name) < 0) // Parsing the whole module finds out what's wrong with it
+  {
+    source.pos = 0;
+    return ParseModule(source, env, m, name, env.errors);
+  }
+
+  if(!m.name.size())
+  {
+    m.name.resize(name.size(), true, env);
+    if(!m.name.get())
+      return ERR_FATAL_OUT_OF_MEMORY;
+    tmemcpy(m.name.get(), m.name.size(), name.get(), name.size());
+  }
+  if(!ValidateIdentifier(m.name))
+    return ERR_PARSE_INVALID_NAME;
+
+  m.source   = data;
+  m.n_source = s.size;
+  return ERR_SUCCESS;
+}
+
+IN_ERROR innative::ParseDeferredModules(Environment* env)
+{
+  // Deferred modules are only ever parsed on multiple threads if they would have been loaded on multiple threads
+  std::vector<IN_ERROR> errors(env->n_modules, ERR_SUCCESS);
+  size_t min = (env->flags & ENV_MULTITHREADED) ? 1 : env->n_modules + 1;
+  ParallelFor(*env, env->n_modules, min, [env, &errors](size_t i) {
+    Module& m = env->modules[i];
+    if(!m.source)
+      return;
+
+    Stream s         = { (uint8_t*)m.source, (size_t)m.n_source, 0, true };
+    Identifier name  = m.name;
+    const char* file = m.path;
+    uint8_t hash[sizeof(m.hash)];
+    memcpy(hash, m.hash, sizeof(hash));
+
+    errors[i] = ParseModule(s, *env, m, name, env->errors);
+    m.path    = file;
+    memcpy(m.hash, hash, sizeof(hash));
+  });
+
+  for(auto err : errors)
+    if(err < 0)
+      return err;
+  return ERR_SUCCESS;
+}
+
 void innative::LoadModule(Environment* env, size_t index, const void* data, uint64_t size, const char* name,
                           const char* file, int* err)
 {
-  Stream s = { (uint8_t*)data, (size_t)size, 0 };
+  // Data read from a mapped file or kept alive for ENV_LAZY_DECODE outlives the module, so it can be referenced directly
+  Stream s = { (uint8_t*)data, (size_t)size, 0, file != nullptr || (env->flags & ENV_LAZY_DECODE) != 0 };
   std::string fallback;
   if(!name)
   {
@@ -99,15 +212,25 @@ void innative::LoadModule(Environment* env, size_t index, const void* data, uint
     name     = fallback.data();
   }
 
-  if((env->flags & ENV_ENABLE_WAT) && size > 0 && s.data[0] != 0)
+  // Hashing the source is much cheaper than parsing it, and is all a warm start needs to find its cached objects
+  uint8_t hash[sizeof(Module::hash)] = { 0 };
+  if(env->cachepath)
+    HashModuleSource(hash, data, size);
+
+  bool binary = !(env->flags & ENV_ENABLE_WAT) || !size || !s.data[0];
+  if(!binary)
   {
     env->modules[index] = { 0 };
     *err = innative::ParseWatModule(*env, env->modules[index], s.data, (size_t)size, StringRef{ name, strlen(name) });
   }
+  else if(env->cachepath)
+    *err = DeferModule(*env, env->modules[index], s, ByteArray((uint8_t*)name, (varuint32)strlen(name)));
   else
     *err = ParseModule(s, *env, env->modules[index], ByteArray((uint8_t*)name, (varuint32)strlen(name)), env->errors);
 
   env->modules[index].path = utility::AllocString(*env, file);
+  memcpy(env->modules[index].hash, hash, sizeof(hash));
+
   ((std::atomic<size_t>&)env->n_modules).fetch_add(1, std::memory_order_release);
 }
 
@@ -120,37 +243,28 @@ void innative::AddModule(Environment* env, const void* data, uint64_t size, cons
   }
 
   const char* file = nullptr;
-  std::unique_ptr<uint8_t[]> data_module;
   if(!size)
   {
-    long sz     = 0;
-    file        = (const char*)data;
-    data_module = utility::LoadFile(file, sz);
-    if(data_module.get() == nullptr)
+    size_t sz = 0;
+    file      = (const char*)data;
+    data      = utility::MapFile(*env, utility::GetPath(file), sz); // Stays mapped until the environment is destroyed
+    if(!data)
     {
       *err = ERR_FATAL_FILE_ERROR;
       return;
     }
     size = sz;
-    data = data_module.get();
-  }
-
-  if((env->flags & ENV_MULTITHREADED) != 0 && env->maxthreads > 0)
-  {
-    while(((std::atomic<size_t>&)env->size).load(std::memory_order_relaxed) -
-            ((std::atomic<size_t>&)env->n_modules).load(std::memory_order_relaxed) >=
-          env->maxthreads)
-      std::this_thread::sleep_for(std::chrono::milliseconds(
-        2)); // If we're using maxthreads, block until one finishes (we must block up here or we risk a deadlock)
   }
 
   size_t index = ((std::atomic<size_t>&)env->size).fetch_add(1, std::memory_order_acq_rel);
   if(index >= ((std::atomic<size_t>&)env->capacity).load(std::memory_order_acquire))
   {
-    while(((std::atomic<size_t>&)env->n_modules).load(std::memory_order_relaxed) != index)
-      std::this_thread::sleep_for(
-        std::chrono::milliseconds(5)); // If we've exceeded our capacity, block until all other threads have finished
-
+    env->pool->WaitDeferred(); // Pending loads write into the modules array, so they must finish before we move it
+    if(index * sizeof(Module) > env->alloc->available()) // Growing from index to index * 2 adds index modules
+    {
+      *err = ERR_FATAL_OUT_OF_MEMORY;
+      return;
+    }
     env->modules = trealloc<Module>(env->modules, index * 2);
     if(!env->modules)
     {
@@ -160,8 +274,8 @@ void innative::AddModule(Environment* env, const void* data, uint64_t size, cons
     ((std::atomic<size_t>&)env->capacity).store(index * 2, std::memory_order_release);
   }
 
-  if(env->flags & ENV_MULTITHREADED)
-    std::thread(LoadModule, env, index, data, size, name, file, err).detach();
+  if(env->flags & ENV_MULTITHREADED) // The thread pool limits how many modules load at once, so we never block here
+    env->pool->Defer([=]() { LoadModule(env, index, data, size, name, file, err); });
   else
     LoadModule(env, index, data, size, name, file, err);
 }
@@ -183,6 +297,34 @@ IN_ERROR innative::AddWhitelist(Environment* env, const char* module_name, const
   return ERR_SUCCESS;
 }
 
+IN_ERROR innative::AddOptimization(Environment* env, const char* module_name, const char* function_name,
+                                   uint64_t optimize)
+{
+  if(!env)
+    return ERR_FATAL_NULL_POINTER;
+  if(!module_name || !function_name)
+    return ERR_PARSE_INVALID_NAME;
+  if((optimize & ENV_OPTIMIZE_OMASK) > ENV_OPTIMIZE_BASELINE)
+    return ERR_UNKNOWN_FLAG;
+
+  // Keys use the same pair of null-terminated strings as the whitelist, but the module name is never normalized
+  size_t module_len = strlen(module_name) + 1;
+  size_t len        = module_len + strlen(function_name) + 1;
+  char* key         = tmalloc<char>(*env, len);
+  if(!key)
+    return ERR_FATAL_OUT_OF_MEMORY;
+
+  tmemcpy<char>(key, len, module_name, module_len);
+  tmemcpy<char>(key + module_len, len - module_len, function_name, len - module_len);
+
+  int r;
+  auto iter = kh_put_optimizehint(env->optimizehints, key, &r);
+  if(r < 0)
+    return ERR_FATAL_OUT_OF_MEMORY;
+  kh_val(env->optimizehints, iter) = optimize & ENV_OPTIMIZE_OMASK;
+  return ERR_SUCCESS;
+}
+
 IN_ERROR innative::AddEmbedding(Environment* env, int tag, const void* data, uint64_t size)
 {
   if(!env)
@@ -219,40 +361,41 @@ IN_ERROR innative::FinalizeEnvironment(Environment* env)
         symbols = GetSymbols((const char*)embed->data, (size_t)embed->size, env->log, format);
       else
       {
-        auto testpath = [](FILE* f, const path& file, path& out) -> FILE* {
-          if(!f)
+        // Map the library instead of reading it, so even large static libraries are never copied through the heap
+        size_t size   = 0;
+        auto testpath = [env, &size](const uint8_t* map, const path& file, path& out) -> const uint8_t* {
+          if(!map)
           {
             out = file;
-            FOPEN(f, out.c_str(), "rb");
+            map = utility::MapFile(*env, out, size);
           }
-          return f;
+          return map;
         };
 
         path envpath(utility::GetPath(env->libpath));
         path rootpath(utility::GetPath(env->rootpath));
         path src(utility::GetPath((const char*)embed->data));
         path out;
-        FILE* f = 0;
+        const uint8_t* map = 0;
 
-        f = testpath(f, envpath / src, out);
-        f = testpath(f, src, out);
-        f = testpath(f, rootpath / src, out);
+        map = testpath(map, envpath / src, out);
+        map = testpath(map, src, out);
+        map = testpath(map, rootpath / src, out);
 
 #ifdef IN_PLATFORM_POSIX
         if(CURRENT_ARCH_BITS == 64)
-          f = testpath(f, rootpath.parent_path() / "lib64" / src, out);
-        f = testpath(f, rootpath.parent_path() / "lib" / src, out);
+          map = testpath(map, rootpath.parent_path() / "lib64" / src, out);
+        map = testpath(map, rootpath.parent_path() / "lib" / src, out);
 
         if(CURRENT_ARCH_BITS == 64)
-          f = testpath(f, path("/usr/lib64/") / src, out);
-        f = testpath(f, path("/usr/lib/") / src, out);
+          map = testpath(map, path("/usr/lib64/") / src, out);
+        map = testpath(map, path("/usr/lib/") / src, out);
 #endif
-        if(!f)
+        if(!map)
         {
           fprintf(env->log, "Error loading file: %s\n", src.u8string().c_str());
           return ERR_FATAL_FILE_ERROR;
         }
-        fclose(f);
 
         std::string buf = out.u8string();
         char* tmp       = tmalloc<char>(*env, buf.size() + 1);
@@ -261,7 +404,8 @@ IN_ERROR innative::FinalizeEnvironment(Environment* env)
         tmemcpy<char>(tmp, buf.size() + 1, buf.c_str(), buf.size() + 1);
         embed->data = tmp;
 
-        symbols = GetSymbols(out.u8string().c_str(), 0, env->log, format);
+        symbols = GetSymbols((const char*)map, size, env->log, format);
+        utility::UnmapFile(*env, map); // The linker reads the library itself, so we only needed its symbols
       }
 
       int r;
@@ -284,9 +428,7 @@ IN_ERROR innative::FinalizeEnvironment(Environment* env)
     }
   }
 
-  while(((std::atomic<size_t>&)env->size).load(std::memory_order_relaxed) >
-        ((std::atomic<size_t>&)env->n_modules).load(std::memory_order_relaxed))
-    std::this_thread::sleep_for(std::chrono::milliseconds(5)); // Spin until all modules have loaded
+  env->pool->WaitDeferred(); // Finish loading every module, helping out on this thread
 
   return ERR_SUCCESS;
 }
@@ -296,6 +438,10 @@ IN_ERROR innative::Validate(Environment* env)
   if(!env)
     return ERR_FATAL_NULL_POINTER;
 
+  IN_ERROR err = ParseDeferredModules(env);
+  if(err < 0)
+    return err;
+
   // Before validating, add all modules to the modulemap. We must do this outside of LoadModule for multithreading reasons.
   // kh_clear_modules(env->modulemap);
   for(size_t i = 0; i < env->n_modules; ++i)
@@ -322,16 +468,27 @@ IN_ERROR innative::Compile(Environment* env, const char* file)
   if(!env)
     return ERR_FATAL_NULL_POINTER;
 
-  IN_ERROR err = Validate(env);
-  if(err != ERR_SUCCESS)
-    return err;
+  // If every module has a cached object file, validation already succeeded when the cache was written, so we skip it,
+  // along with parsing any module that LoadModule deferred
+  if(!env->cachepath || !HasCachedObjects(*env))
+  {
+    IN_ERROR err = Validate(env);
+    if(err != ERR_SUCCESS)
+      return err;
+  }
 
   return CompileEnvironment(env, file);
 }
+// Assemblies can either be shared libraries or JIT sessions, so all symbol lookups go through here
+void* LoadAssemblySymbol(void* assembly, const char* name)
+{
+  return IsJITAssembly(assembly) ? LoadJITSymbol(assembly, name) : LoadDLLFunction(assembly, name);
+}
+
 IN_Entrypoint innative::LoadFunction(void* assembly, const char* module_name, const char* function)
 {
   auto canonical = utility::CanonicalName(StringRef::From(module_name), StringRef::From(function));
-  return (IN_Entrypoint)LoadDLLFunction(assembly, !function ? IN_INIT_FUNCTION : canonical.c_str());
+  return (IN_Entrypoint)LoadAssemblySymbol(assembly, !function ? IN_INIT_FUNCTION : canonical.c_str());
 }
 
 struct IN_TABLE
@@ -343,17 +500,41 @@ struct IN_TABLE
 IN_Entrypoint innative::LoadTable(void* assembly, const char* module_name, const char* table, varuint32 index)
 {
   IN_TABLE* ref =
-    (IN_TABLE*)LoadDLLFunction(assembly,
-                               utility::CanonicalName(StringRef::From(module_name), StringRef::From(table)).c_str());
+    (IN_TABLE*)LoadAssemblySymbol(assembly,
+                                  utility::CanonicalName(StringRef::From(module_name), StringRef::From(table)).c_str());
   return !ref ? nullptr : ref[index].func;
 }
 
 IRGlobal* innative::LoadGlobal(void* assembly, const char* module_name, const char* export_name)
 {
-  return (IRGlobal*)LoadDLLFunction(
+  return (IRGlobal*)LoadAssemblySymbol(
     assembly, utility::CanonicalName(StringRef::From(module_name), StringRef::From(export_name)).c_str());
 }
 
+void* innative::CreateInstance(void* assembly)
+{
+  auto create = (void* (*)())LoadAssemblySymbol(assembly, IN_INSTANCE_CREATE_FUNCTION);
+  return !create ? nullptr : create();
+}
+
+void innative::ResetInstance(void* assembly, void* instance)
+{
+  if(auto reset = (void (*)(void*))LoadAssemblySymbol(assembly, IN_INSTANCE_RESET_FUNCTION))
+    reset(instance);
+}
+
+void innative::DestroyInstance(void* assembly, void* instance)
+{
+  if(auto destroy = (void (*)(void*))LoadAssemblySymbol(assembly, IN_INSTANCE_DESTROY_FUNCTION))
+    destroy(instance);
+}
+
+void* innative::EnterInstance(void* assembly, void* instance)
+{
+  auto enter = (void* (*)(void*))LoadAssemblySymbol(assembly, IN_INSTANCE_ENTER_FUNCTION);
+  return !enter ? nullptr : enter(instance);
+}
+
 void* innative::LoadAssembly(const char* file)
 {
   if(!file)
@@ -364,7 +545,13 @@ void* innative::LoadAssembly(const char* file)
   return envpath.is_absolute() ? LoadDLL(envpath) : LoadDLL(GetWorkingDir() / envpath);
 }
 
-void innative::FreeAssembly(void* assembly) { FreeDLL(assembly); }
+void innative::FreeAssembly(void* assembly)
+{
+  if(IsJITAssembly(assembly))
+    FreeJIT(assembly);
+  else
+    FreeDLL(assembly);
+}
 
 const char* innative::GetTypeEncodingString(int type_encoding)
 {
@@ -384,17 +571,19 @@ int innative::CompileScript(const uint8_t* data, size_t sz, Environment* env, bo
   const char* target = buf;
   std::string dumpfile;
 
+  if(!env)
+  {
+    fputs("Environment cannot be null.\n", stderr);
+    return ERR_FATAL_NULL_POINTER;
+  }
+
   // Load the module
-  std::unique_ptr<uint8_t[]> data_module;
   if(!sz)
   {
-    long len;
-    target      = reinterpret_cast<const char*>(data);
-    data_module = utility::LoadFile(utility::GetPath(target), len);
-    if(data_module.get() == nullptr)
+    target = reinterpret_cast<const char*>(data);
+    data   = utility::MapFile(*env, utility::GetPath(target), sz);
+    if(!data)
       return ERR_FATAL_FILE_ERROR;
-    data = data_module.get();
-    sz   = len;
   }
   else if(env->flags & ENV_DEBUG)
   {
@@ -405,12 +594,6 @@ int innative::CompileScript(const uint8_t* data, size_t sz, Environment* env, bo
     target   = dumpfile.c_str();
   }
 
-  if(!env)
-  {
-    fputs("Environment cannot be null.\n", stderr);
-    return ERR_FATAL_NULL_POINTER;
-  }
-
   if(err < 0)
   {
     char buf[10];
@@ -440,9 +623,13 @@ int innative::SerializeModule(Environment* env, size_t m, const char* out, size_
   if(m >= env->n_modules)
     return ERR_FATAL_INVALID_MODULE;
 
+  int err = ParseDeferredModules(env);
+  if(err < 0)
+    return err;
+
   Queue<WatToken> tokens;
   wat::TokenizeModule(*env, tokens, env->modules[m]);
-  int err = CheckWatTokens(*env, env->errors, tokens, "");
+  err = CheckWatTokens(*env, env->errors, tokens, "");
   if(err < 0)
     return err;
 
@@ -13,18 +13,26 @@ struct IN_WASM_ENVIRONMENT;
 namespace innative {
   struct IN_WASM_ENVIRONMENT* CreateEnvironment(unsigned int modules, unsigned int maxthreads, const char* arg0);
   void ClearEnvironmentCache(struct IN_WASM_ENVIRONMENT* env, Module* m);
+  enum IN_ERROR GetMemoryUsage(const struct IN_WASM_ENVIRONMENT* env, MemoryUsage* usage);
   void DestroyEnvironment(struct IN_WASM_ENVIRONMENT* env);
   void LoadModule(struct IN_WASM_ENVIRONMENT* env, size_t index, const void* data, uint64_t size, const char* name,
                   const char* file, int* err);
   void AddModule(struct IN_WASM_ENVIRONMENT* env, const void* data, uint64_t size, const char* name, int* err);
   enum IN_ERROR AddWhitelist(struct IN_WASM_ENVIRONMENT* env, const char* module_name, const char* export_name);
+  enum IN_ERROR AddOptimization(struct IN_WASM_ENVIRONMENT* env, const char* module_name, const char* function_name,
+                                uint64_t optimize);
   enum IN_ERROR AddEmbedding(struct IN_WASM_ENVIRONMENT* env, int tag, const void* data, uint64_t size);
   enum IN_ERROR FinalizeEnvironment(struct IN_WASM_ENVIRONMENT* env);
+  enum IN_ERROR ParseDeferredModules(struct IN_WASM_ENVIRONMENT* env);
   enum IN_ERROR Validate(struct IN_WASM_ENVIRONMENT* env);
   enum IN_ERROR Compile(struct IN_WASM_ENVIRONMENT* env, const char* file);
   IN_Entrypoint LoadFunction(void* assembly, const char* module_name, const char* function);
   IN_Entrypoint LoadTable(void* assembly, const char* module_name, const char* table, varuint32 index);
   IRGlobal* LoadGlobal(void* assembly, const char* module_name, const char* export_name);
+  void* CreateInstance(void* assembly);
+  void ResetInstance(void* assembly, void* instance);
+  void DestroyInstance(void* assembly, void* instance);
+  void* EnterInstance(void* assembly, void* instance);
   void* LoadAssembly(const char* file);
   void FreeAssembly(void* assembly);
   void DumpModule(std::ostream& stream, Module& mod);
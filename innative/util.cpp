@@ -7,6 +7,7 @@
 #include <stdexcept>
 #include <stdarg.h>
 #include <algorithm>
+#include <limits>
 
 #ifdef IN_PLATFORM_WIN32
 #include "../innative/win32.h"
@@ -17,6 +18,8 @@
 #include <limits.h>
 #include <dlfcn.h>
 #include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
 #include <dirent.h>
 #else
 #error unknown platform
@@ -24,7 +27,58 @@
 
 using std::string;
 
+namespace {
+  struct ThreadChunk
+  {
+    uint64_t owner; // id of the allocator this chunk came from, or 0 if unused
+    char* cur;
+    char* end;
+  };
+
+  std::atomic<uint64_t> allocator_ids(1);
+  thread_local ThreadChunk thread_chunks[innative::utility::IN_ALLOCATOR_THREAD_SLOTS] = {};
+  thread_local size_t thread_chunk_next = 0;
+}
+
+IN_WASM_ALLOCATOR::IN_WASM_ALLOCATOR() :
+  mem(0), sz(0), cur(0), commit(0), id(allocator_ids.fetch_add(1, std::memory_order_relaxed)), total(0), env(nullptr)
+{}
+
 void* IN_WASM_ALLOCATOR::allocate(size_t n)
+{
+  using innative::utility::IN_ALLOCATOR_THREAD_CHUNK;
+  using innative::utility::IN_ALLOCATOR_THREAD_SLOTS;
+
+  if(n > IN_ALLOCATOR_THREAD_CHUNK / 8) // Large allocations would waste too much of a chunk
+    return allocate_shared(n);
+
+  ThreadChunk* chunk = nullptr;
+  for(auto& c : thread_chunks)
+    if(c.owner == id)
+      chunk = &c;
+
+  if(!chunk || size_t(chunk->end - chunk->cur) < n)
+  {
+    if(!chunk) // Evict the oldest chunk this thread has, the rest of it is simply never used
+      chunk = &thread_chunks[thread_chunk_next++ % IN_ALLOCATOR_THREAD_SLOTS];
+
+    char* p = reinterpret_cast<char*>(allocate_shared(IN_ALLOCATOR_THREAD_CHUNK));
+    if(!p)
+    {
+      chunk->owner = 0;
+      return nullptr;
+    }
+    chunk->owner = id;
+    chunk->cur   = p;
+    chunk->end   = p + IN_ALLOCATOR_THREAD_CHUNK;
+  }
+
+  void* r = chunk->cur;
+  chunk->cur += n;
+  return r;
+}
+
+void* IN_WASM_ALLOCATOR::allocate_shared(size_t n)
 {
   size_t index = cur.fetch_add(n, std::memory_order_acq_rel);
   size_t end   = index + n;
@@ -38,16 +92,25 @@ void* IN_WASM_ALLOCATOR::allocate(size_t n)
       while(commit.load(std::memory_order_acquire) != index)
         ; // Spin until all reads are done
 
-      size_t len = std::max<size_t>(end, 4096) * 2;
-      void* prev = malloc(len);
+      size_t len   = std::max<size_t>(end, 4096) * 2;
+      size_t avail = available();
+      void* prev   = nullptr;
+      if(n <= avail) // Allocate less than we normally would if that keeps us under the memory limit
+        prev = malloc(len = std::min(len, avail));
       if(prev != nullptr)
       {
         list.push_back({ prev, len }); // Add real pointer and size to our destructor list
+        total.fetch_add(len, std::memory_order_relaxed);
         mem.exchange((char*)prev - index,
                      std::memory_order_release); // backtrack to trick the current index into pointing to the right address
       }
-      else // If malloc failed, set the memory pointer to NULL, but increase sz anyway to unblock other threads
+      else
+      {
+        // If malloc failed or we hit the memory limit, set the memory pointer to NULL, but increase sz anyway to unblock
+        // other threads. Only this allocation's range is skipped, so smaller allocations after it can still succeed.
+        len = n;
         mem.exchange(nullptr, std::memory_order_release);
+      }
 
       sz.exchange(len + index, std::memory_order_release); // Actual "end" is our previous allocation endpoint (not the
                                                            // memory endpoint) plus current size
@@ -55,12 +118,21 @@ void* IN_WASM_ALLOCATOR::allocate(size_t n)
   }
 
   void* m = mem.load(std::memory_order_acquire);
+  commit.fetch_add(n, std::memory_order_acq_rel); // Failed allocations must also commit, or the next reallocation hangs
   if(!m) // mem can be NULL if we ran out of memory
     return nullptr;
-  commit.fetch_add(n, std::memory_order_acq_rel);
   return (char*)m + index;
 }
 
+size_t IN_WASM_ALLOCATOR::available() const
+{
+  if(!env || !env->memlimit)
+    return std::numeric_limits<size_t>::max();
+
+  uint64_t used = total.load(std::memory_order_relaxed) + env->capacity * sizeof(Module);
+  return (used >= env->memlimit) ? 0 : static_cast<size_t>(std::min<uint64_t>(env->memlimit - used, SIZE_MAX));
+}
+
 IN_WASM_ALLOCATOR::~IN_WASM_ALLOCATOR()
 {
   mem.exchange(nullptr, std::memory_order_release);
@@ -72,6 +144,9 @@ IN_WASM_ALLOCATOR::~IN_WASM_ALLOCATOR()
     free(list.back().first);
     list.pop_back();
   }
+
+  for(auto& map : maps)
+    innative::utility::UnmapFile(map.first, map.second);
 }
 
 namespace innative {
@@ -375,5 +450,127 @@ namespace innative {
     void* LoadDLLFunction(void* dll, const char* name) { return dlsym(dll, name); }
     void FreeDLL(void* dll) { dlclose(dll); }
 #endif
+
+    ScratchArena& ScratchArena::Get()
+    {
+      thread_local ScratchArena arena;
+      return arena;
+    }
+
+    void* ScratchArena::Allocate(size_t n)
+    {
+      const size_t align = alignof(std::max_align_t);
+      n                  = (n + align - 1) & ~(align - 1);
+
+      // Blocks after the current one are left over from allocations that have since been reset, so we reuse them first
+      for(; block < blocks.size(); ++block, pos = 0)
+      {
+        if(blocks[block].second - pos >= n)
+        {
+          void* r = blocks[block].first.get() + pos;
+          pos += n;
+          return r;
+        }
+      }
+
+      // Double the capacity to keep the block count low, but allocate less if that keeps us under the memory limit
+      size_t len   = std::max(n, std::max(IN_SCRATCH_BLOCK, capacity));
+      size_t avail = !env ? len : env->alloc->available();
+      if(n > avail)
+        return nullptr;
+
+      char* p = new(std::nothrow) char[len = std::min(len, avail)];
+      if(!p)
+        return nullptr;
+
+      blocks.emplace_back(std::unique_ptr<char[]>(p), len);
+      capacity += len;
+      block = blocks.size() - 1;
+      pos   = n;
+      return p;
+    }
+
+    void ScratchArena::Trim()
+    {
+      // Blocks after the current one are unused, and newer blocks are larger, so they are freed first
+      while(blocks.size() > block + 1 && capacity > IN_SCRATCH_RETAIN)
+      {
+        capacity -= blocks.back().second;
+        blocks.pop_back();
+      }
+    }
+
+    // Maps an entire file into memory as read-only. The mapping belongs to the environment's allocator, so it stays valid
+    // until the environment is destroyed. Returns null if the file can't be opened or mapped, or is empty.
+    const uint8_t* MapFile(const Environment& env, const path& file, size_t& sz)
+    {
+      void* p = nullptr;
+      sz      = 0;
+#ifdef IN_PLATFORM_WIN32
+      HANDLE f = CreateFileW(file.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+      if(f == INVALID_HANDLE_VALUE)
+        return nullptr;
+
+      LARGE_INTEGER size;
+      if(GetFileSizeEx(f, &size) && size.QuadPart > 0 && (uint64_t)size.QuadPart <= SIZE_MAX)
+      {
+        HANDLE mapping = CreateFileMappingW(f, NULL, PAGE_READONLY, 0, 0, NULL);
+        if(mapping != NULL)
+        {
+          p = MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+          CloseHandle(mapping); // The view keeps the mapping alive
+          sz = (size_t)size.QuadPart;
+        }
+      }
+      CloseHandle(f);
+#elif defined(IN_PLATFORM_POSIX)
+      int fd = open(file.c_str(), O_RDONLY | O_CLOEXEC);
+      if(fd < 0)
+        return nullptr;
+
+      struct stat st;
+      if(!fstat(fd, &st) && S_ISREG(st.st_mode) && st.st_size > 0)
+      {
+        p = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if(p == MAP_FAILED)
+          p = nullptr;
+        sz = (size_t)st.st_size;
+      }
+      close(fd); // The mapping keeps the file alive
+#else
+#error unknown platform
+#endif
+      if(!p)
+      {
+        sz = 0;
+        return nullptr;
+      }
+
+      std::lock_guard<std::mutex> lock(env.alloc->mapslock);
+      env.alloc->maps.push_back({ p, sz });
+      return reinterpret_cast<const uint8_t*>(p);
+    }
+
+    void UnmapFile(void* p, size_t sz)
+    {
+#ifdef IN_PLATFORM_WIN32
+      UnmapViewOfFile(p);
+#elif defined(IN_PLATFORM_POSIX)
+      munmap(p, sz);
+#endif
+    }
+
+    // Unmaps a file mapped by MapFile before the environment is destroyed, once nothing points into it anymore
+    void UnmapFile(const Environment& env, const uint8_t* p)
+    {
+      std::lock_guard<std::mutex> lock(env.alloc->mapslock);
+      for(auto i = env.alloc->maps.begin(); i != env.alloc->maps.end(); ++i)
+        if(i->first == p)
+        {
+          UnmapFile(i->first, i->second);
+          env.alloc->maps.erase(i);
+          return;
+        }
+    }
   }
 }
\ No newline at end of file
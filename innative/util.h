@@ -14,11 +14,17 @@
 #include <memory>
 #include <atomic>
 #include <vector>
+#include <mutex>
+#include <algorithm>
+#include <cstddef>
 #include "../innative/filesys.h"
+#include "threadpool.h"
 
+// Greedy allocator that never frees anything until it is destroyed. Each thread takes chunks of
+// IN_ALLOCATOR_THREAD_CHUNK bytes from a shared buffer and allocates from them without touching any shared state.
 struct IN_WASM_ALLOCATOR
 {
-  IN_WASM_ALLOCATOR() : mem(0), sz(0), cur(0), commit(0) {}
+  IN_COMPILER_DLLEXPORT IN_WASM_ALLOCATOR();
   IN_COMPILER_DLLEXPORT ~IN_WASM_ALLOCATOR();
 
   std::atomic<void*> mem;
@@ -26,8 +32,16 @@ struct IN_WASM_ALLOCATOR
   std::atomic_size_t cur;
   std::atomic_size_t commit;
   std::vector<std::pair<void*, size_t>> list;
+  std::vector<std::pair<void*, size_t>> maps; // Files mapped by MapFile, which are unmapped along with the allocator
+  std::mutex mapslock;
+
+  uint64_t id; // Unique for every allocator ever created, so a thread can tell if its chunk belongs to this one
+  std::atomic_size_t total; // Bytes allocated from the system, which is the size of everything in list
+  const Environment* env;   // If not null, this environment's memlimit is enforced when allocating more memory
 
   IN_COMPILER_DLLEXPORT void* allocate(size_t n);
+  void* allocate_shared(size_t n);
+  size_t available() const; // How much more memory the environment's memlimit allows us to allocate
 };
 
 extern "C" int64_t GetRSPValue();
@@ -158,6 +172,67 @@ namespace innative {
       return reinterpret_cast<T*>(env.alloc->allocate(n * sizeof(T)));
     }
 
+    // Stack of memory blocks for temporaries that only live while one function body is being parsed, validated or
+    // compiled. Every thread has its own arena that is reused by every environment, so scratch memory is given back as
+    // soon as the ScratchScope that allocated it ends, instead of staying in the environment's allocator. New blocks
+    // count against the memlimit of the environment that opened the innermost scope, and once the outermost scope ends,
+    // the arena only keeps IN_SCRATCH_RETAIN bytes, so a single huge function body doesn't pin its memory to the thread.
+    class ScratchArena
+    {
+    public:
+      struct Mark
+      {
+        size_t block;
+        size_t pos;
+      };
+
+      IN_COMPILER_DLLEXPORT static ScratchArena& Get(); // Returns this thread's arena
+      IN_COMPILER_DLLEXPORT void* Allocate(size_t n);
+      IN_COMPILER_DLLEXPORT void Trim(); // Frees the newest blocks until at most IN_SCRATCH_RETAIN bytes are left
+      inline Mark GetMark() const { return Mark{ block, pos }; }
+      inline void Reset(const Mark& mark)
+      {
+        block = mark.block;
+        pos   = mark.pos;
+      }
+      inline size_t Capacity() const { return capacity; } // Total size of every block this arena currently holds
+
+    protected:
+      friend class ScratchScope;
+
+      std::vector<std::pair<std::unique_ptr<char[]>, size_t>> blocks;
+      size_t block           = 0;
+      size_t pos             = 0;
+      size_t capacity        = 0;
+      size_t depth           = 0;       // Number of ScratchScopes on this thread that haven't ended yet
+      const Environment* env = nullptr; // Environment of the innermost ScratchScope
+    };
+
+    // Frees everything allocated from this thread's scratch arena once it goes out of scope. Scopes must be nested.
+    class ScratchScope
+    {
+    public:
+      inline ScratchScope(const Environment& env) :
+        arena(ScratchArena::Get()), mark(arena.GetMark()), previous(arena.env)
+      {
+        arena.env = &env;
+        ++arena.depth;
+      }
+      inline ~ScratchScope()
+      {
+        arena.Reset(mark);
+        arena.env = previous;
+        if(!--arena.depth)
+          arena.Trim();
+      }
+      template<class T> inline T* alloc(size_t n) { return reinterpret_cast<T*>(arena.Allocate(n * sizeof(T))); }
+
+    protected:
+      ScratchArena& arena;
+      ScratchArena::Mark mark;
+      const Environment* previous;
+    };
+
     // Checks if an integer is a power of two
     inline bool IsPowerOfTwo(varuint32 x) noexcept { return (x & (x - 1)) == 0; }
 
@@ -198,6 +273,32 @@ namespace innative {
       return (m.knownsections & (1 << opcode)) != 0;
     }
 
+    // Calls f(i) for every i in [0, n), spread across the environment's thread pool so each thread gets at least min
+    // items. If there isn't enough work to split, f is only called on this thread.
+    template<class F> inline void ParallelFor(const Environment& env, size_t n, size_t min, F&& f)
+    {
+      size_t threads = std::min<size_t>(!env.pool ? 1 : env.pool->Size(), n / min);
+      if(threads < 2)
+      {
+        for(size_t i = 0; i < n; ++i)
+          f(i);
+        return;
+      }
+
+      std::atomic_size_t next(0);
+      auto worker = [&]() {
+        for(size_t i; (i = next.fetch_add(1, std::memory_order_relaxed)) < n;)
+          f(i);
+      };
+
+      std::vector<std::future<void>> tasks;
+      for(size_t i = 1; i < threads; ++i)
+        tasks.push_back(env.pool->Submit(worker));
+      worker();
+      for(auto& t : tasks)
+        env.pool->Wait(t);
+    }
+
     uint8_t GetInstruction(StringRef s);
     varuint32 ModuleFunctionType(const Module& m, varuint32 index);
     FunctionType* ModuleFunction(const Module& m, varuint32 index);
@@ -216,6 +317,9 @@ namespace innative {
     void* LoadDLL(const path& path);
     void* LoadDLLFunction(void* dll, const char* name);
     void FreeDLL(void* dll);
+    const uint8_t* MapFile(const Environment& env, const path& file, size_t& sz);
+    void UnmapFile(void* p, size_t sz);
+    void UnmapFile(const Environment& env, const uint8_t* p);
     int Install(const char* arg0, bool full);
     int Uninstall();
     IN_COMPILER_DLLEXPORT int AddCImport(const Environment& env, const char* id);
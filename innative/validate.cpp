@@ -2,6 +2,7 @@
 // For conditions of distribution and use, see copyright notice in innative.h
 
 #include "validate.h"
+#include "body.h"
 #include "util.h"
 #include "stack.h"
 #include "compile.h"
@@ -14,22 +15,13 @@
 #define str_pair_hash_equal(a, b) ((strcmp(a, b) == 0) && (strcmp(strchr(a, 0) + 1, strchr(b, 0) + 1) == 0))
 
 __KHASH_IMPL(modulepair, , kh_cstr_t, FunctionType, 1, innative::internal::__ac_X31_hash_string_pair, str_pair_hash_equal);
+__KHASH_IMPL(optimizehint, , kh_cstr_t, uint64_t, 1, innative::internal::__ac_X31_hash_string_pair,
+             str_pair_hash_equal);
 __KHASH_IMPL(cimport, , Identifier, char, 0, innative::internal::__ac_X31_hash_bytearray, kh_int_hash_equal);
 
 using namespace innative;
 using namespace utility;
 
-namespace innative {
-  namespace internal {
-    struct ControlBlock
-    {
-      size_t limit; // Previous limit of value stack
-      varsint7 sig; // Block signature
-      uint8_t type; // instruction that pushed this label
-    };
-  }
-}
-
 // UTF8 validator based off the official unicode C validator source
 bool innative::ValidateIdentifier(const ByteArray& b)
 {
@@ -124,7 +116,7 @@ void innative::AppendError(const Environment& env, ValidationError*& errors, Mod
   err->error[len] = 0;
   err->code       = code;
   err->m          = -1;
-  if(m >= env.modules && size_t(m - env.modules) < env.n_modules)
+  if(m >= env.modules && size_t(m - env.modules) < env.size) // Includes modules that are still loading
     err->m = m - env.modules;
 
   do
@@ -1064,11 +1056,10 @@ void innative::ValidateTableOffset(const TableInit& init, Environment& env, Modu
   }
 }
 
-void innative::ValidateFunctionBody(const FunctionType& sig, const FunctionBody& body, Environment& env, Module* m)
+BodyValidator::BodyValidator(const FunctionType& sig, const FunctionBody& body, Environment& env, Module* m) :
+  sig(sig), body(body), env(env), m(m), scratch(env), locals(nullptr), n_local(0), index(0), last(OP_unreachable),
+  skip(true)
 {
-  Instruction* cur = body.body;
-  Stack<internal::ControlBlock> control; // control-flow stack that must be closed by end instructions
-  Stack<varsint7> values;                // Current stack of value types
   varsint7 ret = TE_void;
   if(sig.n_returns > 1) // This is already an invalid function so don't pollute the output with more errors.
     return;
@@ -1082,66 +1073,79 @@ void innative::ValidateFunctionBody(const FunctionType& sig, const FunctionBody&
     AppendError(env, env.errors, m, ERR_FATAL_TOO_MANY_LOCALS, "n_local + n_params exceeds the max value of uint32!");
     return;
   }
-  varuint32 n_local = sig.n_params + body.n_locals;
+  n_local = sig.n_params + body.n_locals;
 
-  varsint7* locals = tmalloc<varsint7>(env, n_local);
-  if(locals)
-    tmemcpy<varsint7>(locals, n_local, sig.params, sig.n_params);
-  else if(n_local > 0)
-    abort(); // Out of memory, abort execution
+  locals = scratch.alloc<varsint7>(n_local);
+  if(n_local > 0 && !locals)
+  {
+    AppendError(env, env.errors, m, ERR_FATAL_OUT_OF_MEMORY, "Out of memory allocating %u locals", n_local);
+    return;
+  }
+  tmemcpy<varsint7>(locals, n_local, sig.params, sig.n_params);
 
   n_local = sig.n_params;
   for(varuint32 i = 0; i < body.n_locals; ++i)
     locals[n_local++] = body.locals[i];
 
   control.Push({ values.Limit(), ret, OP_block }); // Push the function body block with the function signature
+  skip = false;
+}
 
-  if(!body.n_body)
-    return AppendError(env, env.errors, m, ERR_INVALID_FUNCTION_BODY, "Cannot have an empty function body!");
+void BodyValidator::Validate(const Instruction& ins)
+{
+  if(skip)
+    return;
 
-  for(varuint32 i = 0; i < body.n_body; ++i)
-  {
-    ValidateInstruction(cur[i], values, control, n_local, locals, env, m);
+  varuint32 i = index++;
+  last        = ins.opcode;
+  ValidateInstruction(ins, values, control, n_local, locals, env, m);
 
-    switch(cur[i].opcode)
+  switch(ins.opcode)
+  {
+  case OP_block:
+  case OP_loop:
+  case OP_if:
+    control.Push({ values.Limit(), ins.immediates[0]._varsint7, ins.opcode });
+    values.SetLimit(values.Size() + values.Limit());
+    break;
+  case OP_end:
+    if(!control.Size())
+      AppendError(env, env.errors, m, ERR_INVALID_FUNCTION_BODY, "Mismatched end instruction at index %u!", i);
+    else
     {
-    case OP_block:
-    case OP_loop:
-    case OP_if:
-      control.Push({ values.Limit(), cur[i].immediates[0]._varsint7, cur[i].opcode });
+      char buf[10];
+      if(control.Peek().type == OP_if && control.Peek().sig != TE_void)
+        AppendError(env, env.errors, m, ERR_INVALID_BLOCK_SIGNATURE,
+                    "If statement without else cannot have a non-void block signature, had %s.",
+                    EnumToString(TYPE_ENCODING_MAP, control.Peek().sig, buf, 10));
+      ValidateEndBlock(ins, control.Pop(), values, env, m, true);
+    }
+    break;
+  case OP_else:
+    if(!control.Size())
+      AppendError(env, env.errors, m, ERR_INVALID_FUNCTION_BODY, "Mismatched else instruction at index %u!", i);
+    else
+    {
+      char buf[10];
+      internal::ControlBlock block = control.Pop();
+      if(block.type != OP_if)
+        AppendError(env, env.errors, m, ERR_INVALID_FUNCTION_BODY,
+                    "Expected else instruction to terminate if block, but found %s instead.",
+                    EnumToString(TYPE_ENCODING_MAP, block.type, buf, 10));
+      ValidateEndBlock(ins, block, values, env, m, false);
+      control.Push(
+        { values.Limit(), block.sig, OP_else }); // Push a new else block that must be terminated by an end instruction
       values.SetLimit(values.Size() + values.Limit());
-      break;
-    case OP_end:
-      if(!control.Size())
-        AppendError(env, env.errors, m, ERR_INVALID_FUNCTION_BODY, "Mismatched end instruction at index %u!", i);
-      else
-      {
-        char buf[10];
-        if(control.Peek().type == OP_if && control.Peek().sig != TE_void)
-          AppendError(env, env.errors, m, ERR_INVALID_BLOCK_SIGNATURE,
-                      "If statement without else cannot have a non-void block signature, had %s.",
-                      EnumToString(TYPE_ENCODING_MAP, control.Peek().sig, buf, 10));
-        ValidateEndBlock(cur[i], control.Pop(), values, env, m, true);
-      }
-      break;
-    case OP_else:
-      if(!control.Size())
-        AppendError(env, env.errors, m, ERR_INVALID_FUNCTION_BODY, "Mismatched else instruction at index %u!", i);
-      else
-      {
-        char buf[10];
-        internal::ControlBlock block = control.Pop();
-        if(block.type != OP_if)
-          AppendError(env, env.errors, m, ERR_INVALID_FUNCTION_BODY,
-                      "Expected else instruction to terminate if block, but found %s instead.",
-                      EnumToString(TYPE_ENCODING_MAP, block.type, buf, 10));
-        ValidateEndBlock(cur[i], block, values, env, m, false);
-        control.Push(
-          { values.Limit(), block.sig, OP_else }); // Push a new else block that must be terminated by an end instruction
-        values.SetLimit(values.Size() + values.Limit());
-      }
     }
   }
+}
+
+void BodyValidator::Finish()
+{
+  if(skip)
+    return;
+  if(!index)
+    return AppendError(env, env.errors, m, ERR_INVALID_FUNCTION_BODY, "Cannot have an empty function body!");
 
   for(varuint32 i = 0; i < sig.n_returns; ++i)
     ValidatePopType(Instruction{ 0, 0, body.debug.line, body.debug.column }, values, sig.returns[i], env, m);
@@ -1154,9 +1158,26 @@ void innative::ValidateFunctionBody(const FunctionType& sig, const FunctionBody&
     AppendError(env, env.errors, m, ERR_INVALID_VALUE_STACK, "Value stack not fully empty, off by %zu",
                 values.Size() + values.Limit());
 
-  if(cur[body.n_body - 1].opcode != OP_end)
+  if(last != OP_end)
     AppendError(env, env.errors, m, ERR_INVALID_FUNCTION_BODY,
-                "Expected end instruction to terminate function body, got %hhu instead.", cur[body.n_body - 1].opcode);
+                "Expected end instruction to terminate function body, got %hhu instead.", last);
+}
+
+void innative::ValidateFunctionBody(const FunctionType& sig, const FunctionBody& body, Environment& env, Module* m)
+{
+  BodyReader reader(body, env);
+  BodyValidator validator(sig, body, env, m);
+  Instruction cur = { OP_unreachable };
+
+  for(varuint32 i = 0; !reader.End(); ++i)
+  {
+    IN_ERROR err = reader.Read(cur);
+    if(err < 0)
+      return AppendError(env, env.errors, m, err, "Failed to decode instruction at index %u.", i);
+    validator.Validate(cur);
+  }
+
+  validator.Finish();
 }
 
 void innative::ValidateDataOffset(const DataInit& init, Environment& env, Module* m)
@@ -1279,13 +1300,21 @@ void innative::ValidateModule(Environment& env, Module& m)
   if(m.knownsections & (1 << WASM_SECTION_ELEMENT))
     ValidateSection<TableInit, &ValidateTableOffset>(m.element.elements, m.element.n_elements, env, &m);
 
-  if(m.knownsections & (1 << WASM_SECTION_CODE))
+  if((m.knownsections & (1 << WASM_SECTION_CODE)) && !m.code.validated) // ENV_FUSED_VALIDATION already checked them
   {
-    for(varuint32 j = 0; j < m.code.n_funcbody; ++j)
-    {
+    // Function bodies are independent of each other, so large modules validate them in parallel. AppendError is lock-free,
+    // but this means errors from different bodies can be reported in any order.
+    auto validate = [&](size_t j) {
       if(m.function.funcdecl[j] < m.type.n_functions)
         ValidateFunctionBody(m.type.functions[m.function.funcdecl[j]], m.code.funcbody[j], env, &m);
-    }
+    };
+
+    varuint32 n = std::min(m.code.n_funcbody, m.function.n_funcdecl);
+    if(env.flags & ENV_MULTITHREADED)
+      ParallelFor(env, n, IN_PARALLEL_PARSE_MIN_FUNCTIONS, validate);
+    else
+      for(varuint32 j = 0; j < n; ++j)
+        validate(j);
   }
 
   if(m.knownsections & (1 << WASM_SECTION_DATA))
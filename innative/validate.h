@@ -5,8 +5,42 @@
 #define IN__VALIDATE_H
 
 #include "innative/schema.h"
+#include "util.h"
+#include "stack.h"
 
 namespace innative {
+  namespace internal {
+    struct ControlBlock
+    {
+      size_t limit; // Previous limit of value stack
+      varsint7 sig; // Block signature
+      uint8_t type; // instruction that pushed this label
+    };
+  }
+
+  // Validates a function body one instruction at a time, so a body can be validated while it is being decoded
+  class BodyValidator
+  {
+  public:
+    BodyValidator(const FunctionType& sig, const FunctionBody& body, Environment& env, Module* m);
+    void Validate(const Instruction& ins);
+    void Finish(); // Must be called after the last instruction to check that the body was properly terminated
+
+  protected:
+    const FunctionType& sig;
+    const FunctionBody& body;
+    Environment& env;
+    Module* m;
+    utility::ScratchScope scratch;
+    Stack<internal::ControlBlock> control; // control-flow stack that must be closed by end instructions
+    Stack<varsint7> values;                // Current stack of value types
+    varsint7* locals;
+    varuint32 n_local;
+    varuint32 index; // Number of instructions validated so far
+    uint8_t last;    // Opcode of the last instruction validated
+    bool skip;       // Set if the body can't be validated at all, which has already been reported
+  };
+
   bool ValidateIdentifier(const ByteArray& bytes);
   void AppendError(const Environment& env, ValidationError*& errors, Module* m, int code, const char* fmt, ...);
   void ValidateFunctionSig(const FunctionType& sig, Environment& env, Module* m);
@@ -2,6 +2,7 @@
 // For conditions of distribution and use, see copyright notice in innative.h
 
 #include "wat.h"
+#include "body.h"
 #include "util.h"
 #include "parse.h"
 #include "validate.h"
@@ -483,7 +484,14 @@ int WatParser::ParseOperator(Queue<WatToken>& tokens, Instruction& op, FunctionB
       break;
     }
   case OP_global_set:
-  case OP_call: defer = WatParser::DeferWatAction{ op.opcode, tokens.Pop(), 0, 0 }; break;
+  case OP_call:
+    if(!sig.form) // Initializers have no function body to patch, so resolve what we can now and let validation fail
+    {
+      op.immediates[0]._varuint32 = GetFromHash((op.opcode == OP_call) ? funchash : globalhash, tokens.Pop());
+      break;
+    }
+    defer = WatParser::DeferWatAction{ op.opcode, tokens.Pop(), 0, 0 };
+    break;
   case OP_i32_const:
   case OP_i64_const:
   case OP_f32_const:
@@ -626,7 +634,7 @@ int WatParser::ParseExpression(Queue<WatToken>& tokens, FunctionBody& f, Functio
       op.immediates[0]._varsint7 = blocktype;
       op.line                    = t.line;
       op.column                  = t.column;
-      if(err = AppendArray<Instruction>(env, op, f.body, f.n_body))
+      if(err = AppendInstruction(env, f, op))
         return err;
     }
 
@@ -637,7 +645,7 @@ int WatParser::ParseExpression(Queue<WatToken>& tokens, FunctionBody& f, Functio
     Instruction op = { OP_end };
     op.line        = tokens.Peek().line;
     op.column      = tokens.Peek().column;
-    if(err = AppendArray<Instruction>(env, op, f.body, f.n_body))
+    if(err = AppendInstruction(env, f, op))
       return err;
 
     stack.Pop();
@@ -660,8 +668,7 @@ int WatParser::ParseExpression(Queue<WatToken>& tokens, FunctionBody& f, Functio
       op.immediates[0]._varsint7 = blocktype;
       op.line                    = t.line;
       op.column                  = t.column;
-      if(err = AppendArray<Instruction>(env, op, f.body,
-                                        f.n_body)) // We append the if instruction _after_ the optional condition expression
+      if(err = AppendInstruction(env, f, op)) // We append the if instruction _after_ the optional condition expression
         return err;
     }
   }
@@ -685,7 +692,7 @@ int WatParser::ParseExpression(Queue<WatToken>& tokens, FunctionBody& f, Functio
 
       op.line   = t.line;
       op.column = t.column;
-      if(err = AppendArray<Instruction>(env, op, f.body, f.n_body))
+      if(err = AppendInstruction(env, f, op))
         return err;
 
       while(tokens.Peek().id != WatTokens::CLOSE)
@@ -700,7 +707,7 @@ int WatParser::ParseExpression(Queue<WatToken>& tokens, FunctionBody& f, Functio
 
       op.line   = tokens.Peek().line;
       op.column = tokens.Peek().column;
-      if(err = AppendArray<Instruction>(env, op, f.body, f.n_body))
+      if(err = AppendInstruction(env, f, op))
         return err;
     }
 
@@ -718,10 +725,11 @@ int WatParser::ParseExpression(Queue<WatToken>& tokens, FunctionBody& f, Functio
       if(err = ParseExpression(tokens, f, sig, index))
         return err;
 
-    if(defer.id) // Only perform the defer after we evaluate the folded instructions, so f.n_body is correct
-      deferred.Push(WatParser::DeferWatAction{ defer.id, defer.t, index, f.n_body });
-    if(err = AppendArray<Instruction>(env, op, f.body, f.n_body)) // Now we append the operator
+    varuint32 patch; // Only append the operator after we evaluate the folded instructions, so the order is correct
+    if(err = AppendInstruction(env, f, op, defer.id ? &patch : nullptr))
       return err;
+    if(defer.id)
+      deferred.Push(WatParser::DeferWatAction{ defer.id, defer.t, index, patch });
     break;
   }
   }
@@ -752,7 +760,7 @@ int WatParser::ParseInstruction(Queue<WatToken>& tokens, FunctionBody& f, Functi
       op.immediates[0]._varsint7 = blocktype;
       op.line                    = t.line;
       op.column                  = t.column;
-      if(err = AppendArray<Instruction>(env, op, f.body, f.n_body))
+      if(err = AppendInstruction(env, f, op))
         return err;
     }
 
@@ -770,7 +778,7 @@ int WatParser::ParseInstruction(Queue<WatToken>& tokens, FunctionBody& f, Functi
 
       op.line   = tokens.Peek().line;
       op.column = tokens.Peek().column;
-      if(err = AppendArray<Instruction>(env, op, f.body, f.n_body))
+      if(err = AppendInstruction(env, f, op))
         return err;
     }
 
@@ -790,8 +798,7 @@ int WatParser::ParseInstruction(Queue<WatToken>& tokens, FunctionBody& f, Functi
       op.immediates[0]._varsint7 = blocktype;
       op.line                    = t.line;
       op.column                  = t.column;
-      if(err = AppendArray<Instruction>(env, op, f.body,
-                                        f.n_body)) // We append the if instruction _after_ the optional condition expression
+      if(err = AppendInstruction(env, f, op)) // We append the if instruction _after_ the optional condition expression
         return err;
     }
 
@@ -809,7 +816,7 @@ int WatParser::ParseInstruction(Queue<WatToken>& tokens, FunctionBody& f, Functi
 
       op.line   = t.line;
       op.column = t.column;
-      if(err = AppendArray<Instruction>(env, op, f.body, f.n_body))
+      if(err = AppendInstruction(env, f, op))
         return err;
 
       while(tokens.Peek().id != WatTokens::END)
@@ -828,7 +835,7 @@ int WatParser::ParseInstruction(Queue<WatToken>& tokens, FunctionBody& f, Functi
 
       op.line   = tokens.Peek().line;
       op.column = tokens.Peek().column;
-      if(err = AppendArray<Instruction>(env, op, f.body, f.n_body))
+      if(err = AppendInstruction(env, f, op))
         return err;
     }
 
@@ -841,9 +848,12 @@ int WatParser::ParseInstruction(Queue<WatToken>& tokens, FunctionBody& f, Functi
     if(err = ParseOperator(tokens, op, f, sig, defer))
       return err;
 
+    varuint32 patch;
+    if(err = AppendInstruction(env, f, op, defer.id ? &patch : nullptr))
+      return err;
     if(defer.id)
-      deferred.Push(WatParser::DeferWatAction{ defer.id, defer.t, index, f.n_body });
-    return AppendArray<Instruction>(env, op, f.body, f.n_body);
+      deferred.Push(WatParser::DeferWatAction{ defer.id, defer.t, index, patch });
+    return ERR_SUCCESS;
   }
   }
 
@@ -984,7 +994,7 @@ int WatParser::ParseFunction(Queue<WatToken>& tokens, varuint32* index, StringRe
   Instruction op = { OP_end };
   op.line        = tokens.Peek().line;
   op.column      = tokens.Peek().column;
-  if(err = AppendArray(env, op, body.body, body.n_body))
+  if(err = AppendInstruction(env, body, op))
     return err;
 
   m.knownsections |= (1 << WASM_SECTION_FUNCTION);
@@ -1076,13 +1086,23 @@ int WatParser::ParseInitializerInstruction(Queue<WatToken>& tokens, Instruction&
   if(blank.n_body == 0)
     AppendError(env, env.errors, 0, ERR_INVALID_INITIALIZER_TYPE, "Only one instruction is allowed as an initializer");
 
+  BodyReader reader(blank, env);
+  if(blank.n_body > 0)
+  {
+    reader.Read(op);
+    if(op.opcode == OP_br_table) // Never valid here, and the targets only live as long as the reader does
+      op.immediates[0].n_table = 0;
+  }
+
   if(blank.n_body > 1)
   {
     varuint32 i = 0; // For some reason, webassembly wants a type mismatch error if there are multiple constant
                      // instructions that would otherwise be valid.
-    for(; i < blank.n_body; ++i)
+    for(Instruction cur = op; i < blank.n_body; ++i)
     {
-      switch(blank.body[i].opcode)
+      if(i > 0)
+        reader.Read(cur);
+      switch(cur.opcode)
       {
       case OP_i32_const:
       case OP_i64_const:
@@ -1096,9 +1116,6 @@ int WatParser::ParseInitializerInstruction(Queue<WatToken>& tokens, Instruction&
                 "Only one instruction is allowed as an initializer");
   }
 
-  if(blank.n_body > 0)
-    op = blank.body[0];
-
   return ERR_SUCCESS;
 }
 
@@ -1522,9 +1539,9 @@ int WatParser::ParseModule(Environment& env, Module& m, Queue<WatToken>& tokens,
        s.deferred[0].func >= mod.code.n_funcbody + mod.importsection.functions)
       return ERR_INVALID_FUNCTION_INDEX;
     auto& f = mod.code.funcbody[s.deferred[0].func - mod.importsection.functions];
-    if(s.deferred[0].index >= f.n_body)
+    if(s.deferred[0].index + PATCH_ENCODED_SIZE > f.n_bytes)
       return ERR_INVALID_FUNCTION_BODY;
-    f.body[s.deferred[0].index].immediates[0]._varuint32 = e;
+    PatchInstruction(f, (varuint32)s.deferred[0].index, e);
     return ERR_SUCCESS;
   };
 
@@ -0,0 +1,59 @@
+(module
+ (memory $0 16)
+ (export "memory" (memory $0))
+ (export "memloop" (func $memloop))
+ (func $memloop (param $0 i32) (result i32)
+  (local $1 i32)
+  (local $2 i32)
+  (block $label$0
+   (loop $label$1
+    (br_if $label$0
+     (i32.eqz
+      (local.get $0)
+     )
+    )
+    (local.set $1
+     (i32.const 0)
+    )
+    (loop $label$2
+     (local.set $2
+      (i32.add
+       (local.get $2)
+       (i32.add
+        (i32.load
+         (local.get $1)
+        )
+        (i32.load offset=4
+         (local.get $1)
+        )
+       )
+      )
+     )
+     (i32.store
+      (local.get $1)
+      (local.get $2)
+     )
+     (br_if $label$2
+      (i32.lt_u
+       (local.tee $1
+        (i32.add
+         (local.get $1)
+         (i32.const 4)
+        )
+       )
+       (i32.const 1048572)
+      )
+     )
+    )
+    (local.set $0
+     (i32.sub
+      (local.get $0)
+      (i32.const 1)
+     )
+    )
+    (br $label$1)
+   )
+  )
+  (local.get $2)
+ )
+)